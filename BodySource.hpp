@@ -0,0 +1,156 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <string>
+
+#ifndef __IMAP_BODY_SOURCE__
+#define __IMAP_BODY_SOURCE__
+
+namespace IMAPProvider {
+// Random access to the raw bytes of a message wherever a backend keeps them,
+// so large sections can be sent in chunks (and partial fetches can start at
+// an offset) without ever holding the whole message in memory.
+class BodySource {
+ public:
+  virtual ~BodySource() {}
+  virtual size_t size() const = 0;
+  // Copies up to n bytes starting at offset into buf. Returns the number of
+  // bytes copied (0 at the end), or -1 on error.
+  virtual ssize_t read(size_t offset, char* buf, size_t n) = 0;
+  // The whole message, if it is already contiguous in memory
+  virtual const char* data() const { return nullptr; }
+  // An fd positioned anywhere that holds exactly these bytes, if any
+  virtual int fd() const { return -1; }
+};
+
+// A message already in memory
+class StringBodySource : public BodySource {
+ private:
+  std::shared_ptr<const std::string> str;
+
+ public:
+  explicit StringBodySource(std::shared_ptr<const std::string> s)
+      : str(std::move(s)) {}
+  explicit StringBodySource(std::string s)
+      : str(std::make_shared<const std::string>(std::move(s))) {}
+  size_t size() const { return str->size(); }
+  ssize_t read(size_t offset, char* buf, size_t n) {
+    if (offset >= str->size()) return 0;
+    n = std::min(n, str->size() - offset);
+    std::memcpy(buf, str->data() + offset, n);
+    return n;
+  }
+  const char* data() const { return str->data(); }
+};
+
+// A message file read with pread(); the descriptor is closed on destruction
+class FdBodySource : public BodySource {
+ private:
+  int file;
+  size_t length;
+
+ public:
+  explicit FdBodySource(int f) : file(f), length(0) {
+    struct stat st;
+    if (file >= 0 && fstat(file, &st) == 0) length = st.st_size;
+  }
+  explicit FdBodySource(const std::string& path)
+      : FdBodySource(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {}
+  ~FdBodySource() {
+    if (file >= 0) ::close(file);
+  }
+  FdBodySource(const FdBodySource&) = delete;
+  FdBodySource& operator=(const FdBodySource&) = delete;
+  bool ok() const { return file >= 0; }
+  size_t size() const { return length; }
+  ssize_t read(size_t offset, char* buf, size_t n) {
+    if (offset >= length) return 0;
+    ssize_t r;
+    do {
+      r = ::pread(file, buf, std::min(n, length - offset), offset);
+    } while (r < 0 && errno == EINTR);
+    return r;
+  }
+  int fd() const { return file; }
+};
+
+// A message file mapped read-only; reads are memcpy()s from the page cache
+class MmapBodySource : public BodySource {
+ private:
+  int file = -1;
+  const char* map = nullptr;
+  size_t length = 0;
+
+ public:
+  explicit MmapBodySource(int f) : file(f) {
+    struct stat st;
+    if (file < 0 || fstat(file, &st) != 0 || st.st_size == 0) return;
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (p == MAP_FAILED) return;
+    map = static_cast<const char*>(p);
+    length = st.st_size;
+  }
+  explicit MmapBodySource(const std::string& path)
+      : MmapBodySource(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {}
+  ~MmapBodySource() {
+    if (map != nullptr) munmap(const_cast<char*>(map), length);
+    if (file >= 0) ::close(file);
+  }
+  MmapBodySource(const MmapBodySource&) = delete;
+  MmapBodySource& operator=(const MmapBodySource&) = delete;
+  bool ok() const { return file >= 0 && (map != nullptr || length == 0); }
+  size_t size() const { return length; }
+  ssize_t read(size_t offset, char* buf, size_t n) {
+    if (offset >= length) return 0;
+    n = std::min(n, length - offset);
+    std::memcpy(buf, map + offset, n);
+    return n;
+  }
+  const char* data() const { return map; }
+  int fd() const { return file; }
+};
+
+// Any seekable stream, e.g. one a backend opened over its own storage
+class StreamBodySource : public BodySource {
+ private:
+  std::unique_ptr<std::istream> in;
+  size_t length = 0;
+
+ public:
+  explicit StreamBodySource(std::unique_ptr<std::istream> s) : in(std::move(s)) {
+    in->seekg(0, std::ios::end);
+    std::streamoff end = in->tellg();
+    length = end > 0 ? static_cast<size_t>(end) : 0;
+  }
+  size_t size() const { return length; }
+  ssize_t read(size_t offset, char* buf, size_t n) {
+    if (offset >= length) return 0;
+    in->clear();
+    if (!in->seekg(offset)) return -1;
+    in->read(buf, std::min(n, length - offset));
+    return in->bad() ? -1 : in->gcount();
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,333 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <tls.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BodySource.hpp"
+#include "Compression.hpp"
+
+#ifndef __IMAP_BUFFER__
+#define __IMAP_BUFFER__
+
+namespace IMAPProvider {
+// Per-connection input buffer. Bytes are read straight into the free space at
+// the tail and consumed from the head; the unread region is always contiguous
+// so the parser can hand out views into it. Space at the front is reclaimed
+// lazily (only when the tail runs out of room) so steady-state reads do not
+// move data around, and an idle connection holds no memory at all.
+class InputBuffer {
+ private:
+  std::vector<char> buf;
+  size_t head = 0;
+  size_t tail = 0;
+
+ public:
+  static constexpr size_t kIdleCapacity = 64 * 1024;
+
+  const char* data() const { return buf.data() + head; }
+  size_t size() const { return tail - head; }
+  bool empty() const { return head == tail; }
+  std::string_view view() const { return std::string_view(data(), size()); }
+
+  // Returns a pointer to at least n writable bytes at the end of the buffer.
+  // Call commit() with the number of bytes actually written.
+  char* prepare(size_t n) {
+    if (buf.size() - tail < n) {
+      if (head > 0) {
+        std::memmove(buf.data(), buf.data() + head, tail - head);
+        tail -= head;
+        head = 0;
+      }
+      if (buf.size() - tail < n) {
+        buf.resize(std::max(buf.size() * 2, tail + n));
+      }
+    }
+    return buf.data() + tail;
+  }
+  void commit(size_t n) { tail += n; }
+  void append(const char* d, size_t n) {
+    std::memcpy(prepare(n), d, n);
+    commit(n);
+  }
+  void append(const std::string& s) { append(s.data(), s.length()); }
+
+  void consume(size_t n) {
+    head += std::min(n, size());
+    if (head == tail) {
+      head = tail = 0;
+      // give back memory held over from a burst (e.g. a large literal)
+      if (buf.size() > kIdleCapacity) std::vector<char>().swap(buf);
+    }
+  }
+
+  size_t find(char c, size_t from = 0) const {
+    if (from >= size()) return std::string::npos;
+    const void* p = std::memchr(data() + from, c, size() - from);
+    return p == nullptr ? std::string::npos
+                        : static_cast<const char*>(p) - data();
+  }
+};
+
+// Per-connection output queue. Responses are staged as plain text while a
+// command runs, sealed (compressed if COMPRESS is active) into wire chunks,
+// and flushed with as few syscalls as possible: one sendmsg() over all queued
+// chunks for plain sockets, one tls_write() per record-sized chunk for TLS.
+// Whatever the socket will not take right now stays queued, in order, for
+// the next flush.
+//
+// Large literals (message bodies) are queued by reference to their
+// BodySource and only read a window at a time as the socket drains, so a
+// big FETCH holds at most kStreamWindow bytes of it in memory. Unless the
+// connection is compressed, bodies are not even copied: they go out with
+// sendfile() from their file on plain sockets, or straight from their
+// memory when the source has it.
+class OutputQueue {
+ private:
+  struct Deferred {
+    std::shared_ptr<BodySource> source;
+    size_t offset;
+    size_t length;      // bytes of source still to send
+    std::string after;  // text written after this body was queued
+    bool direct = false;  // sent by flush() from source itself
+  };
+  std::deque<std::string> wire;
+  size_t offset = 0;   // bytes of wire.front() already written
+  size_t pending = 0;  // unwritten bytes across all wire chunks
+  bool blocked = false;
+  std::string staged;  // text written before the first deferred body
+  std::deque<Deferred> deferred;
+  size_t deferredBytes = 0;
+
+  void append(const char* d, size_t n) {
+    if (deferred.empty()) {
+      staged.append(d, n);
+    } else {
+      deferred.back().after.append(d, n);
+      deferredBytes += n;
+    }
+  }
+  bool push(std::string&& s, CompressionContext* z) {
+    if (z == nullptr) {
+      push(std::move(s));
+      return true;
+    }
+    std::string out;
+    if (!z->deflate(s, out)) return false;
+    push(std::move(out));
+    return true;
+  }
+
+  void push(std::string&& s) {
+    pending += s.length();
+    // Small responses are coalesced, but never into a chunk that a blocked
+    // TLS write has to retry with unchanged contents
+    if (!wire.empty() && wire.back().length() + s.length() <= kChunkSize &&
+        (wire.size() > 1 || (offset == 0 && !blocked))) {
+      wire.back().append(s);
+    } else {
+      wire.push_back(std::move(s));
+    }
+  }
+  static bool canSendFile(const BodySource& source) {
+#ifdef __linux__
+    return source.fd() >= 0;
+#else
+    return false;
+#endif
+  }
+  // Writes the front body from its file or memory once everything before
+  // it is on the wire. Returns 0 when it is sent or the socket is full,
+  // otherwise an errno value.
+  int sendBody(int fd, struct tls* t) {
+    Deferred& d = deferred.front();
+    while (d.length > 0) {
+      ssize_t sent;
+      if (t != NULL) {
+        // a blocked write is retried with the same record, as libtls needs
+        sent = tls_write(t, d.source->data() + d.offset, std::min(d.length, kChunkSize));
+        if (sent == TLS_WANT_POLLIN || sent == TLS_WANT_POLLOUT) {
+          blocked = true;
+          return 0;
+        }
+        if (sent < 0) return errno != 0 ? errno : EIO;
+      } else {
+#ifdef __linux__
+        if (d.source->fd() >= 0) {
+          off_t from = d.offset;
+          sent = sendfile(fd, d.source->fd(), &from, d.length);
+          if (sent == 0) return EIO;  // the file is shorter than announced
+        } else {
+          sent = send(fd, d.source->data() + d.offset, d.length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+#elif !defined(SO_NOSIGPIPE)
+        sent = send(fd, d.source->data() + d.offset, d.length, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+        sent = send(fd, d.source->data() + d.offset, d.length, MSG_DONTWAIT);
+#endif
+        if (sent < 0) {
+          if (errno == EINTR) continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            blocked = true;
+            return 0;
+          }
+          return errno;
+        }
+      }
+      d.offset += sent;
+      d.length -= sent;
+      deferredBytes -= sent;
+    }
+    staged = std::move(d.after);
+    deferredBytes -= staged.length();
+    deferred.pop_front();
+    // only uncompressed queues send bodies directly
+    if (!staged.empty()) push(std::move(staged));
+    staged.clear();
+    return 0;
+  }
+  void consume(size_t n) {
+    pending -= n;
+    while (n > 0) {
+      size_t left = wire.front().length() - offset;
+      if (n < left) {
+        offset += n;
+        return;
+      }
+      n -= left;
+      offset = 0;
+      wire.pop_front();
+    }
+  }
+
+ public:
+  static constexpr size_t kChunkSize = 16 * 1024;  // max TLS record payload
+  static constexpr int kMaxIov = 64;
+
+  static constexpr size_t kStreamWindow = 256 * 1024;
+
+  size_t size() const { return pending + staged.length() + deferredBytes; }
+  bool empty() const { return size() == 0; }
+  // True while a queued body still has bytes to read from its source
+  bool streaming() const { return !deferred.empty(); }
+  // True once everything sealed so far has been written
+  bool drained() const { return pending == 0 && !blocked; }
+
+  void write(const char* d, size_t n) { append(d, n); }
+  void write(const std::string& s) { append(s.data(), s.length()); }
+  // Queues length bytes of source from offset, to be read as they are sent
+  void stream(std::shared_ptr<BodySource> source, size_t offset, size_t length) {
+    if (length == 0) return;
+    deferredBytes += length;
+    deferred.push_back({std::move(source), offset, length, std::string()});
+  }
+
+  // Moves staged responses onto the wire, compressing them as one block,
+  // then tops the wire up from any deferred bodies. plain says the kernel
+  // sees the bytes as they are (no TLS), so files can be sendfile()d.
+  bool seal(CompressionContext* z, bool plain = false) {
+    if (!staged.empty()) {
+      if (!push(std::move(staged), z)) return false;
+      staged.clear();
+    }
+    while (!deferred.empty() && pending < kStreamWindow) {
+      Deferred& d = deferred.front();
+      if (z == nullptr && (d.source->data() != nullptr || (plain && canSendFile(*d.source)))) {
+        d.direct = true;
+        break;
+      }
+      std::string chunk(std::min(d.length, kChunkSize), '\0');
+      ssize_t n = d.source->read(d.offset, &chunk[0], chunk.length());
+      if (n <= 0) return false;  // the body cannot be sent as announced
+      chunk.resize(n);
+      d.offset += n;
+      d.length -= n;
+      deferredBytes -= n;
+      if (!push(std::move(chunk), z)) return false;
+      if (d.length == 0) {
+        staged = std::move(d.after);
+        deferredBytes -= staged.length();
+        deferred.pop_front();
+        if (!staged.empty()) {
+          if (!push(std::move(staged), z)) return false;
+          staged.clear();
+        }
+      }
+    }
+    return true;
+  }
+
+  // Writes as much as the socket accepts. Returns 0 if the queue drained or
+  // the socket is full (the rest stays queued), otherwise an errno value.
+  int flush(int fd, struct tls* t) {
+    blocked = false;
+    while (true) {
+      while (pending > 0) {
+        ssize_t sent;
+        if (t != NULL) {
+          sent = tls_write(t, wire.front().data() + offset,
+                           wire.front().length() - offset);
+          if (sent == TLS_WANT_POLLIN || sent == TLS_WANT_POLLOUT) {
+            blocked = true;
+            return 0;
+          }
+          if (sent < 0) return errno != 0 ? errno : EIO;
+        } else {
+          struct iovec iov[kMaxIov];
+          int n = 0;
+          for (auto it = wire.begin(); it != wire.end() && n < kMaxIov; ++it, ++n) {
+            size_t skip = (n == 0 ? offset : 0);
+            iov[n].iov_base = const_cast<char*>(it->data()) + skip;
+            iov[n].iov_len = it->length() - skip;
+          }
+          struct msghdr msg = {};
+          msg.msg_iov = iov;
+          msg.msg_iovlen = n;
+#ifndef SO_NOSIGPIPE
+          sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+          sent = sendmsg(fd, &msg, MSG_DONTWAIT);
+#endif
+          if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              blocked = true;
+              return 0;
+            }
+            return errno;
+          }
+        }
+        consume(sent);
+      }
+      if (deferred.empty() || !deferred.front().direct) return 0;
+      int err = sendBody(fd, t);
+      if (err != 0 || blocked) return err;
+    }
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <strings.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "Notifications.hpp"
+
+#ifndef __IMAP_CHANGE_BUS__
+#define __IMAP_CHANGE_BUS__
+
+namespace IMAPProvider {
+// Routes mailbox changes from a backend to every session that has the
+// mailbox selected. A backend publishes each change once, to the mailbox's
+// Topic, and the bus posts it to each subscriber's NotificationQueue.
+//
+// A Topic's subscribers are an immutable list that subscribe() and
+// unsubscribe() replace with an edited copy. publish() only locks to copy
+// the pointer to the current list and posts without any lock held, so it
+// never waits for a list to be copied or for another publisher. Backends
+// that publish often should hold on to the Topic (topic()) rather
+// than look it up by name for every change.
+class ChangeBus {
+ public:
+  class Topic {
+   private:
+    typedef std::vector<std::weak_ptr<NotificationQueue>> Subscribers;
+    mutable std::mutex lock;  // guards the pointer only
+    std::mutex editing;       // one update() at a time
+    std::shared_ptr<const Subscribers> subscribers = std::make_shared<const Subscribers>();
+
+    std::shared_ptr<const Subscribers> current() const {
+      std::lock_guard<std::mutex> guard(lock);
+      return subscribers;
+    }
+    // Replaces the list with change(copy of it); change returns false to
+    // leave the list as it is
+    template <typename F>
+    void update(F change) {
+      std::lock_guard<std::mutex> serial(editing);
+      auto copy = std::make_shared<Subscribers>(*current());
+      if (!change(*copy)) return;
+      std::shared_ptr<const Subscribers> next(std::move(copy));
+      std::lock_guard<std::mutex> guard(lock);
+      subscribers.swap(next);  // the old list goes when next does, unlocked
+    }
+
+   public:
+    void subscribe(const std::shared_ptr<NotificationQueue>& queue) {
+      update([&](Subscribers& s) {
+        s.erase(std::remove_if(s.begin(), s.end(),
+                               [](const std::weak_ptr<NotificationQueue>& w) { return w.expired(); }),
+                s.end());
+        s.push_back(queue);
+        return true;
+      });
+    }
+    void unsubscribe(const std::shared_ptr<NotificationQueue>& queue) {
+      update([&](Subscribers& s) {
+        size_t before = s.size();
+        s.erase(std::remove_if(s.begin(), s.end(),
+                               [&](const std::weak_ptr<NotificationQueue>& w) {
+                                 auto q = w.lock();
+                                 return !q || q == queue;
+                               }),
+                s.end());
+        return s.size() != before;
+      });
+    }
+    bool empty() const { return current()->empty(); }
+    void publish(const MailboxEvent& e) const {
+      std::shared_ptr<const Subscribers> now = current();
+      for (const std::weak_ptr<NotificationQueue>& w : *now)
+        if (auto q = w.lock()) q->post(e);
+    }
+  };
+
+ private:
+  std::map<std::string, std::shared_ptr<Topic>> topics;
+  mutable std::shared_mutex lock;
+
+  // Mailbox names are case-sensitive except INBOX
+  static std::string key(const std::string& user, const std::string& mailbox) {
+    std::string k = user;
+    k.push_back('\0');
+    if (mailbox.size() >= 5 && strncasecmp(mailbox.c_str(), "INBOX", 5) == 0 &&
+        (mailbox.size() == 5 || mailbox[5] == '/')) {
+      k += "INBOX";
+      k.append(mailbox, 5, std::string::npos);
+    } else {
+      k += mailbox;
+    }
+    return k;
+  }
+
+ public:
+  // The mailbox's topic, created if need be. It stays the mailbox's topic
+  // as long as anyone holds it or it has subscribers.
+  std::shared_ptr<Topic> topic(const std::string& user, const std::string& mailbox) {
+    const std::string k = key(user, mailbox);
+    {
+      std::shared_lock<std::shared_mutex> guard(lock);
+      auto it = topics.find(k);
+      if (it != topics.end()) return it->second;
+    }
+    std::unique_lock<std::shared_mutex> guard(lock);
+    std::shared_ptr<Topic>& t = topics[k];
+    if (!t) t = std::make_shared<Topic>();
+    return t;
+  }
+  void subscribe(const std::string& user, const std::string& mailbox,
+                 const std::shared_ptr<NotificationQueue>& queue) {
+    topic(user, mailbox)->subscribe(queue);
+  }
+  void unsubscribe(const std::string& user, const std::string& mailbox,
+                   const std::shared_ptr<NotificationQueue>& queue) {
+    const std::string k = key(user, mailbox);
+    std::unique_lock<std::shared_mutex> guard(lock);
+    auto it = topics.find(k);
+    if (it == topics.end()) return;
+    it->second->unsubscribe(queue);
+    // dropped once no session listens and no backend holds it
+    if (it->second->empty() && it->second.use_count() == 1) topics.erase(it);
+  }
+  // Gives back a topic() the backend is done with, dropping the topic if
+  // no session listens and no one else holds it
+  void release(const std::string& user, const std::string& mailbox, std::shared_ptr<Topic> held) {
+    const std::string k = key(user, mailbox);
+    std::unique_lock<std::shared_mutex> guard(lock);
+    held.reset();
+    auto it = topics.find(k);
+    if (it != topics.end() && it->second->empty() && it->second.use_count() == 1) topics.erase(it);
+  }
+  void publish(const std::string& user, const std::string& mailbox, const MailboxEvent& e) const {
+    std::shared_ptr<Topic> t;
+    {
+      std::shared_lock<std::shared_mutex> guard(lock);
+      auto it = topics.find(key(user, mailbox));
+      if (it == topics.end()) return;
+      t = it->second;
+    }
+    t->publish(e);
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -11,14 +11,30 @@
  *
  */
 
+#include <functional>
+#include <memory>
+
 #include "AuthenticationModel.hpp"
+#include "Buffer.hpp"
+#include "CommandParser.hpp"
+#include "Compression.hpp"
 #include "Helpers.hpp"
+#include "Notifications.hpp"
+#include "TLSContext.hpp"
 
 #ifndef __IMAP_CLIENT_STATE__
 #define __IMAP_CLIENT_STATE__
 
 namespace IMAPProvider {
 typedef enum { UNENC = 0, UNAUTH = 1, AUTH = 2, SELECTED = 3 } IMAPState_t;
+// How far a connection's TLS handshake has got; READ and WRITE are what
+// it waits on before it can go on
+typedef enum {
+  HANDSHAKE_NONE = 0,
+  HANDSHAKE_READ = 1,
+  HANDSHAKE_WRITE = 2,
+  HANDSHAKE_DONE = 3
+} Handshake_t;
 template <typename A>
 class ClientStateModel {
  private:
@@ -28,13 +44,53 @@ class ClientStateModel {
   std::string user;
   bool selected;
   std::string mbox;
-  bool compressed;
+  std::unique_ptr<CompressionContext> compression;
 
  public:
-  bool& isCompressed() { return compressed; }
-  bool isSubscribedToChanges = false;
+  bool isCompressed() const { return compression != nullptr; }
+  CompressionContext& compressor() { return *compression; }
+  bool compress() {
+    compression = std::make_unique<CompressionContext>();
+    if (!compression->ready()) compression.reset();
+    return isCompressed();
+  }
+  // Changes to the selected mailbox, if the backend reports them
+  std::shared_ptr<NotificationQueue> notifications;
+  // Messages in the selected mailbox as far as the client has been told
+  uint32_t exists = 0;
+  // Between IDLE and DONE, when changes are sent as soon as they arrive
+  bool idling = false;
   struct tls* tls = NULL;
-  ClientStateModel() : encrypted(false), authenticated(false), user(""), selected(false), mbox(""),uuid(gen_uuid(15)), compressed(false){}
+  // what tls was accepted with, kept until it is freed
+  std::shared_ptr<TLSContext> tlsContext;
+  Handshake_t handshake = HANDSHAKE_NONE;
+  bool handshaking() const {
+    return handshake == HANDSHAKE_READ || handshake == HANDSHAKE_WRITE;
+  }
+  // bytes received but not yet parsed
+  InputBuffer input;
+  CommandParser parser;
+  // responses not yet accepted by the socket
+  OutputQueue output;
+  bool seal() { return output.seal(compression.get(), tls == NULL); }
+  // Set while a command is suspended waiting on the client's next line
+  // (e.g. a SASL response)
+  std::function<void(const std::string&)> continuation;
+  void await(std::function<void(const std::string&)> fn) {
+    continuation = std::move(fn);
+  }
+  // Set while a literal is handed to literalSink as it arrives instead of
+  // being buffered; literalDone runs after the last byte
+  std::function<void(const char*, size_t)> literalSink;
+  std::function<void()> literalDone;
+  size_t literalRemaining = 0;
+  void stream(size_t length, std::function<void(const char*, size_t)> sink,
+              std::function<void()> done) {
+    literalRemaining = length;
+    literalSink = std::move(sink);
+    literalDone = std::move(done);
+  }
+  ClientStateModel() : encrypted(false), authenticated(false), user(""), selected(false), mbox(""),uuid(gen_uuid(15)){}
   const IMAPState_t state() const {
     if (!encrypted && !authenticated) {
       return UNENC;
@@ -56,14 +112,13 @@ class ClientStateModel {
   const std::string getUser() const { return user; }
   const std::string getMBox() const { return mbox; }
   const std::string get_uuid() const { return uuid; }
-  bool SASL(std::string mechanism) {
-    AuthenticationModel& provider = AuthenticationModel::getInst<A>();
+  bool SASL(AuthenticationModel& provider, std::string mechanism) {
     user = provider.SASL(tls, mechanism);
     authenticated = (user == "");
     return (user == "");
   }
-  bool authenticate(const std::string& username, const std::string& password) {
-    AuthenticationModel& provider = AuthenticationModel::getInst<A>();
+  bool authenticate(AuthenticationModel& provider, const std::string& username,
+                    const std::string& password) {
     if (provider.lookup(username) == false) {
       return false;
     }
@@ -0,0 +1,350 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef __IMAP_COMMAND_PARSER__
+#define __IMAP_COMMAND_PARSER__
+
+namespace IMAPProvider {
+typedef enum { ATOM = 0, QUOTED = 1, LITERAL = 2, LIST = 3 } TokenType_t;
+
+// One top-level token of a command, stored as offsets from the start of the
+// command so it stays valid while the input buffer compacts between reads.
+struct Token {
+  TokenType_t type;
+  size_t begin;     // value: atom text, quoted contents, literal bytes
+  size_t length;
+  size_t rawBegin;  // the token exactly as it appeared on the wire
+  size_t rawLength;
+};
+
+// A complete command, as views into the connection's input buffer. Only valid
+// until the buffer is consumed.
+class Command {
+ private:
+  const char* base = nullptr;
+  const std::vector<Token>* tokens = nullptr;
+  size_t len = 0;
+
+ public:
+  Command() {}
+  Command(const char* b, const std::vector<Token>& t, size_t l)
+      : base(b), tokens(&t), len(l) {}
+
+  std::string_view tag() const { return value(0); }
+  std::string_view name() const { return value(1); }
+  // number of arguments following the command name
+  size_t size() const { return tokens->size() < 2 ? 0 : tokens->size() - 2; }
+  // total bytes of input the command occupies, including its CRLF
+  size_t length() const { return len; }
+
+  const Token& arg(size_t n) const { return (*tokens)[n + 2]; }
+  TokenType_t type(size_t n) const { return arg(n).type; }
+  std::string_view raw(size_t n) const {
+    return std::string_view(base + arg(n).rawBegin, arg(n).rawLength);
+  }
+  // The argument's value with quoting undone; allocates only for quoted
+  // strings that contain escapes
+  std::string str(size_t n) const {
+    const Token& t = arg(n);
+    std::string out(base + t.begin, t.length);
+    if (t.type == QUOTED && out.find('\\') != std::string::npos) {
+      size_t w = 0;
+      for (size_t r = 0; r < out.length(); r++) {
+        if (out[r] == '\\' && r + 1 < out.length()) r++;
+        out[w++] = out[r];
+      }
+      out.resize(w);
+    }
+    return out;
+  }
+  // Raw text of arguments [from, to), exactly as sent
+  std::string_view rest(size_t from, size_t to) const {
+    if (from >= to || from >= size()) return std::string_view();
+    if (to > size()) to = size();
+    size_t b = arg(from).rawBegin;
+    size_t e = arg(to - 1).rawBegin + arg(to - 1).rawLength;
+    return std::string_view(base + b, e - b);
+  }
+  std::string_view rest(size_t from) const { return rest(from, size()); }
+
+ private:
+  std::string_view value(size_t n) const {
+    if (n >= tokens->size()) return std::string_view();
+    return std::string_view(base + (*tokens)[n].begin, (*tokens)[n].length);
+  }
+};
+
+// Incremental IMAP command tokenizer (RFC 3501 section 9). It is fed the
+// unread bytes of the input buffer on every wakeup and resumes where it left
+// off, so a command may arrive in any number of pieces. Atoms, quoted
+// strings, parenthesized lists and synchronizing ({n}) and non-synchronizing
+// ({n+}) literals are recognised without copying; tokens are offsets into the
+// buffer and the token vector keeps its capacity between commands.
+class CommandParser {
+ public:
+  typedef enum {
+    INCOMPLETE = 0,  // wait for more input
+    COMPLETE = 1,    // command() is ready
+    CONTINUE = 2,    // send a continuation request, then wait for the literal
+    ERROR = 3,       // error() explains, skip() bytes to resynchronize
+    STREAM = 4       // a large literal follows command(); see literalSize()
+  } Status;
+
+  static constexpr size_t kMaxLineLength = 64 * 1024;
+  static constexpr size_t kMaxLiteral = 64 * 1024 * 1024;
+  // top-level literals at least this large are offered to the caller to
+  // stream (STREAM) rather than being buffered whole
+  static constexpr size_t kStreamLiteral = 256 * 1024;
+
+ private:
+  std::vector<Token> tokens;
+  size_t pos = 0;            // where scanning resumes
+  size_t ackedThrough = 0;   // synchronizing literals before here were acked
+  size_t literalBytes = 0;   // literal data so far, in lists too (not line)
+  bool inLiteral = false;    // top-level literal data starts at pos
+  bool bufferAll = false;    // caller declined to stream this command
+  size_t literalHeader = 0;  // where that literal's {n} began
+  size_t literalLength = 0;
+  const char* data = nullptr;
+  size_t len = 0;
+  size_t cmdLength = 0;
+  const char* err = "";
+
+  Status fail(const char* e) {
+    err = e;
+    return ERROR;
+  }
+  static bool isAtomEnd(char c) {
+    return c == ' ' || c == '\r' || c == '\n' || c == '(' || c == ')' ||
+           c == '"' || c == '{';
+  }
+  // Scans a quoted string starting at p (on the opening quote). Sets p past
+  // the closing quote.
+  Status scanQuoted(size_t& p) {
+    for (size_t i = p + 1; i < len; i++) {
+      if (data[i] == '\\') {
+        i++;
+      } else if (data[i] == '"') {
+        p = i + 1;
+        return COMPLETE;
+      } else if (data[i] == '\r' || data[i] == '\n') {
+        return fail("Unterminated quoted string");
+      }
+    }
+    return INCOMPLETE;
+  }
+  // Scans a literal header "{n}" or "{n+}" and its CRLF starting at p. Sets
+  // p to the first byte of literal data and n to its length.
+  Status scanLiteralHeader(size_t& p, size_t& n) {
+    size_t i = p + 1;
+    n = 0;
+    for (; i < len && data[i] >= '0' && data[i] <= '9'; i++) {
+      n = n * 10 + (data[i] - '0');
+      if (n > kMaxLiteral) return fail("Literal too large");
+    }
+    bool sync = true;
+    if (i < len && data[i] == '+') {
+      sync = false;
+      i++;
+    }
+    if (i >= len) return INCOMPLETE;
+    if (data[i] != '}' || i == p + 1) return fail("Invalid literal");
+    i++;
+    if (i < len && data[i] == '\r') i++;
+    if (i >= len) return INCOMPLETE;
+    if (data[i] != '\n') return fail("Invalid literal");
+    i++;
+    p = i;
+    if (sync && p > ackedThrough && len - p < n) {
+      ackedThrough = p;
+      return CONTINUE;
+    }
+    return COMPLETE;
+  }
+  // Scans a parenthesized list starting at p (on the opening paren),
+  // including any nested lists, quoted strings and literals. Adds the bytes
+  // of literal data it went over (so far, if INCOMPLETE) to literal.
+  Status scanList(size_t& p, size_t& literal) {
+    size_t depth = 0, i = p;
+    while (i < len) {
+      char c = data[i];
+      if (c == '(') {
+        depth++;
+        i++;
+      } else if (c == ')') {
+        i++;
+        if (--depth == 0) {
+          p = i;
+          return COMPLETE;
+        }
+      } else if (c == '"') {
+        Status s = scanQuoted(i);
+        if (s != COMPLETE) return s;
+      } else if (c == '{') {
+        size_t n;
+        Status s = scanLiteralHeader(i, n);
+        if (s != COMPLETE) return s;
+        if (len - i < n) {
+          literal += len - i;
+          return INCOMPLETE;
+        }
+        literal += n;
+        i += n;
+      } else if (c == '\r' || c == '\n') {
+        return fail("Unterminated list");
+      } else {
+        i++;
+      }
+    }
+    return INCOMPLETE;
+  }
+  // Atoms may carry a bracketed section with spaces and parens in it, as in
+  // BODY[HEADER.FIELDS (DATE FROM)]<0.100>
+  Status scanAtom(size_t& p) {
+    size_t brackets = 0, i = p;
+    for (; i < len; i++) {
+      char c = data[i];
+      if (c == '\r' || c == '\n') {
+        if (brackets > 0) return fail("Unterminated section");
+        break;
+      }
+      if (c == '[') {
+        brackets++;
+      } else if (c == ']') {
+        if (brackets > 0) brackets--;
+      } else if (brackets == 0 && isAtomEnd(c)) {
+        break;
+      }
+    }
+    if (i >= len) return INCOMPLETE;
+    if (i == p) return fail("Unexpected character");
+    p = i;
+    return COMPLETE;
+  }
+  void add(TokenType_t type, size_t b, size_t l, size_t rb, size_t rl) {
+    tokens.push_back({type, b, l, rb, rl});
+  }
+
+ public:
+  // Parses the command at the start of buf. Call again with the same
+  // (possibly longer) buffer contents after INCOMPLETE or CONTINUE.
+  Status parse(const char* buf, size_t buflen) {
+    data = buf;
+    len = buflen;
+    size_t listLiteral = 0;  // literal data in a list not complete yet
+    while (true) {
+      if (inLiteral) {
+        if (len - pos < literalLength) {
+          if (literalLength >= kStreamLiteral && !bufferAll) {
+            cmdLength = pos;
+            return STREAM;
+          }
+          return INCOMPLETE;
+        }
+        add(LITERAL, pos, literalLength, literalHeader,
+            pos + literalLength - literalHeader);
+        pos += literalLength;
+        literalBytes += literalLength;
+        inLiteral = false;
+        continue;
+      }
+      if (pos >= len) break;
+      char c = data[pos];
+      size_t start = pos;
+      Status s = COMPLETE;
+      if (c == ' ') {
+        pos++;
+        continue;
+      } else if (c == '\r' || c == '\n') {
+        size_t end = pos + 1;
+        if (c == '\r') {
+          if (end >= len) break;
+          if (data[end] != '\n') return fail("Expected CRLF");
+          end++;
+        }
+        if (tokens.size() < 2) return fail("Unable to parse command");
+        cmdLength = end;
+        return COMPLETE;
+      } else if (c == '"') {
+        s = scanQuoted(pos);
+        if (s == COMPLETE) add(QUOTED, start + 1, pos - start - 2, start, pos - start);
+      } else if (c == '(') {
+        size_t nested = 0;
+        s = scanList(pos, nested);
+        if (s == COMPLETE) {
+          add(LIST, start, pos - start, start, pos - start);
+          literalBytes += nested;
+        } else {
+          listLiteral = nested;
+        }
+      } else if (c == '{') {
+        s = scanLiteralHeader(pos, literalLength);
+        if (s == COMPLETE || s == CONTINUE) {
+          inLiteral = true;
+          literalHeader = start;
+          if (s == CONTINUE) {
+            cmdLength = pos;
+            return CONTINUE;
+          }
+          continue;
+        }
+      } else if (c == ')') {
+        return fail("Unexpected ')'");
+      } else {
+        s = scanAtom(pos);
+        if (s == COMPLETE) add(ATOM, start, pos - start, start, pos - start);
+      }
+      if (s == INCOMPLETE) {
+        pos = start;
+        break;
+      }
+      if (s != COMPLETE) return s;
+    }
+    if (len - literalBytes - listLiteral > kMaxLineLength) return fail("Command line too long");
+    return INCOMPLETE;
+  }
+
+  // After COMPLETE the whole command; after STREAM (or a streamable()
+  // CONTINUE) the tokens before the literal, with length() running through
+  // the literal's header
+  Command command() const { return Command(data, tokens, cmdLength); }
+  size_t literalSize() const { return literalLength; }
+  // After CONTINUE: whether the literal asked for will be offered as a
+  // STREAM, so the caller can take it on before the client sends it
+  bool streamable() const { return inLiteral && literalLength >= kStreamLiteral && !bufferAll; }
+  // Declines a STREAM: the literal is buffered like any other
+  void buffer() { bufferAll = true; }
+  const char* error() const { return err; }
+  // Bytes to discard after an ERROR: through the end of the offending line
+  size_t skip() const {
+    for (size_t i = pos; i < len; i++)
+      if (data[i] == '\n') return i + 1;
+    return len;
+  }
+  // Ready the parser for the next command; call after consuming the last one
+  void reset() {
+    tokens.clear();
+    pos = ackedThrough = literalBytes = literalHeader = literalLength = 0;
+    inLiteral = bufferAll = false;
+    cmdLength = 0;
+    err = "";
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <miniz.h>
+
+#include <string>
+#include <boost/log/trivial.hpp>
+
+#ifndef __IMAP_COMPRESSION__
+#define __IMAP_COMPRESSION__
+
+#define Z_CHUNK_SIZE (16 * 1024)
+
+namespace IMAPProvider {
+// Per-connection COMPRESS=DEFLATE state (RFC 4978). Each direction is a single
+// raw DEFLATE stream for the lifetime of the connection, so the dictionary
+// carries over between responses. Every call ends on a Z_SYNC_FLUSH boundary
+// so the peer can decode everything written so far.
+class CompressionContext {
+ private:
+  z_stream outStrm = {};
+  z_stream inStrm = {};
+  bool outReady = false;
+  bool inReady = false;
+  unsigned char chunk[Z_CHUNK_SIZE];
+
+ public:
+  explicit CompressionContext(int level = 6) {
+    outReady = (deflateInit2(&outStrm, level, Z_DEFLATED, -MAX_WBITS, 8,
+                             Z_DEFAULT_STRATEGY) == Z_OK);
+    inReady = (inflateInit2(&inStrm, -MAX_WBITS) == Z_OK);
+    if (!outReady || !inReady) {
+      BOOST_LOG_TRIVIAL(error) << "Unable to init DEFLATE streams";
+    }
+  }
+  ~CompressionContext() {
+    // Z_DATA_ERROR only signals that the stream was never finished, which is
+    // expected when the connection closes
+    int status = outReady ? deflateEnd(&outStrm) : Z_OK;
+    if (status != Z_OK && status != Z_DATA_ERROR) {
+      BOOST_LOG_TRIVIAL(warning) << "zlib unable to cleanup deflate stream";
+    }
+    if (inReady && inflateEnd(&inStrm) != Z_OK) {
+      BOOST_LOG_TRIVIAL(warning) << "zlib unable to cleanup inflate stream";
+    }
+  }
+  CompressionContext(const CompressionContext&) = delete;
+  CompressionContext& operator=(const CompressionContext&) = delete;
+
+  bool ready() const { return outReady && inReady; }
+
+  // Compress len bytes of data and append them to out
+  bool deflate(const char* data, size_t len, std::string& out) {
+    if (!outReady) return false;
+    outStrm.next_in =
+        reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+    outStrm.avail_in = len;
+    do {
+      outStrm.next_out = chunk;
+      outStrm.avail_out = Z_CHUNK_SIZE;
+      int status = ::deflate(&outStrm, Z_SYNC_FLUSH);
+      if (status != Z_OK && status != Z_BUF_ERROR) {
+        BOOST_LOG_TRIVIAL(error) << "Deflate status not 'OK': " << status;
+        return false;
+      }
+      out.append(reinterpret_cast<char*>(chunk),
+                 Z_CHUNK_SIZE - outStrm.avail_out);
+    } while (outStrm.avail_out == 0);
+    return true;
+  }
+  bool deflate(const std::string& data, std::string& out) {
+    return deflate(data.data(), data.length(), out);
+  }
+
+  // Decompress len bytes of data and append them to out. Fails rather than
+  // append more than limit bytes, so a small input cannot inflate without
+  // bound.
+  bool inflate(const char* data, size_t len, std::string& out,
+               size_t limit = std::string::npos) {
+    if (!inReady) return false;
+    inStrm.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(data));
+    inStrm.avail_in = len;
+    size_t added = 0;
+    do {
+      inStrm.next_out = chunk;
+      inStrm.avail_out = Z_CHUNK_SIZE;
+      int status = ::inflate(&inStrm, Z_SYNC_FLUSH);
+      if (status != Z_OK && status != Z_BUF_ERROR && status != Z_STREAM_END) {
+        BOOST_LOG_TRIVIAL(error) << "Inflate status not 'OK': " << status;
+        return false;
+      }
+      added += Z_CHUNK_SIZE - inStrm.avail_out;
+      if (added > limit) {
+        BOOST_LOG_TRIVIAL(error) << "Inflated data over " << limit << " bytes";
+        return false;
+      }
+      out.append(reinterpret_cast<char*>(chunk),
+                 Z_CHUNK_SIZE - inStrm.avail_out);
+      if (status == Z_STREAM_END) break;
+    } while (inStrm.avail_out == 0);
+    return true;
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -11,26 +11,43 @@
  *
  */
 
+#include <string>
+
 #ifndef __IMAP_CONFIG__
 #define __IMAP_CONFIG__
 
 namespace IMAPProvider {
+// What a TLS context is built from; IMAPProvider::reload() can replace it
+// while the server runs
+struct TLSOptions {
+  std::string versions;
+  std::string ciphers;
+  std::string keypath;
+  std::string certpath;
+  // Seconds a TLS session stays resumable (by session ID or ticket); 0
+  // turns resumption off
+  int sessionLifetime = 0;
+  // Seconds between ticket key changes, shared by every IMAPProvider in
+  // the process; 0 uses sessionLifetime
+  int ticketRotation = 0;
+};
+
 class ConfigModel {
  public:
   const bool secure;
   const bool starttls;
-  const char* ciphers;
-  const char* versions;
-  const char* keypath;
-  const char* certpath;
+  const TLSOptions tls;
   ConfigModel(bool _secure, bool _starttls, const char* _versions,
-              const char* _ciphers, const char* _keypath, const char* _certpath)
+              const char* _ciphers, const char* _keypath, const char* _certpath,
+              int _sessionLifetime = 0, int _ticketRotation = 0)
       : secure(_secure),
         starttls(_starttls),
-        ciphers(_ciphers),
-        versions(_versions),
-        keypath(_keypath),
-        certpath(_certpath) {}
+        tls{orEmpty(_versions), orEmpty(_ciphers), orEmpty(_keypath), orEmpty(_certpath),
+            _sessionLifetime, _ticketRotation} {}
+
+ private:
+  // configs without TLS may pass NULL for the TLS settings
+  static std::string orEmpty(const char* s) { return s != nullptr ? s : ""; }
 };
 }  // namespace IMAPProvider
 
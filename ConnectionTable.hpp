@@ -0,0 +1,106 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#ifndef __IMAP_CONNECTION_TABLE__
+#define __IMAP_CONNECTION_TABLE__
+
+namespace IMAPProvider {
+// Per-connection state indexed directly by file descriptor. The kernel hands
+// out the lowest free fd, so a flat table stays dense. Slots live in
+// fixed-size pages that are allocated on first use and never move, so a
+// lookup is two atomic loads and no lock; only allocating a new page takes
+// the mutex.
+//
+// Each entry is owned by the thread currently serving its fd: emplace() and
+// erase() happen in connect()/disconnect(), which never run concurrently
+// with anything else for the same fd (see IMAPProvider::Serving).
+template <typename T>
+class ConnectionTable {
+ private:
+  static constexpr size_t kPageBits = 10;
+  static constexpr size_t kPageSize = size_t(1) << kPageBits;
+  static constexpr size_t kMaxPages = 4096;
+  struct Page {
+    std::atomic<T*> slots[kPageSize] = {};
+  };
+  std::atomic<Page*> pages[kMaxPages] = {};
+  std::mutex growLock;
+
+  std::atomic<T*>* slot(int fd) const {
+    if (fd < 0 || static_cast<size_t>(fd) >= kPageSize * kMaxPages)
+      return nullptr;
+    Page* p = pages[fd >> kPageBits].load(std::memory_order_acquire);
+    return p == nullptr ? nullptr : &p->slots[fd & (kPageSize - 1)];
+  }
+  std::atomic<T*>& createSlot(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= kPageSize * kMaxPages)
+      throw std::out_of_range("fd " + std::to_string(fd) +
+                              " outside of connection table");
+    std::atomic<Page*>& p = pages[fd >> kPageBits];
+    if (p.load(std::memory_order_acquire) == nullptr) {
+      std::lock_guard<std::mutex> lock(growLock);
+      if (p.load(std::memory_order_relaxed) == nullptr)
+        p.store(new Page(), std::memory_order_release);
+    }
+    return p.load(std::memory_order_acquire)->slots[fd & (kPageSize - 1)];
+  }
+
+ public:
+  ConnectionTable() {}
+  ConnectionTable(const ConnectionTable&) = delete;
+  ConnectionTable& operator=(const ConnectionTable&) = delete;
+  ~ConnectionTable() {
+    for (std::atomic<Page*>& p : pages) {
+      Page* page = p.load();
+      if (page == nullptr) continue;
+      for (std::atomic<T*>& s : page->slots) delete s.load();
+      delete page;
+    }
+  }
+
+  // Returns the entry for fd, or nullptr if there is no such connection
+  T* find(int fd) const {
+    std::atomic<T*>* s = slot(fd);
+    return s == nullptr ? nullptr : s->load(std::memory_order_acquire);
+  }
+  bool contains(int fd) const { return find(fd) != nullptr; }
+
+  // Unlike std::map, a miss is an error rather than a silent insert
+  T& operator[](int fd) const {
+    T* t = find(fd);
+    if (t == nullptr)
+      throw std::out_of_range("No connection state for fd " +
+                              std::to_string(fd));
+    return *t;
+  }
+
+  // Creates a fresh entry for fd, replacing any stale one
+  T& emplace(int fd) {
+    T* fresh = new T();
+    delete createSlot(fd).exchange(fresh, std::memory_order_acq_rel);
+    return *fresh;
+  }
+  void erase(int fd) {
+    std::atomic<T*>* s = slot(fd);
+    if (s != nullptr) delete s->exchange(nullptr, std::memory_order_acq_rel);
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
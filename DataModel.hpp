@@ -11,17 +11,46 @@
  *
  */
 
+#include <cstdio>
 #include <functional>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "Flags.hpp"
 #include "Helpers.hpp"
+#include "ChangeBus.hpp"
 #include "Message.hpp"
+#include "SearchIndex.hpp"
+#include "SequenceSet.hpp"
 #ifndef __IMAP_DATA_PROVIDER__
 #define __IMAP_DATA_PROVIDER__
 
 namespace IMAPProvider {
+// What a FETCH asked for, so a backend can skip loading what it does not need
+typedef enum : unsigned {
+  FETCH_UID = 1 << 0,
+  FETCH_FLAGS = 1 << 1,
+  FETCH_INTERNALDATE = 1 << 2,
+  FETCH_SIZE = 1 << 3,
+  FETCH_ENVELOPE = 1 << 4,
+  FETCH_BODYSTRUCTURE = 1 << 5,
+  FETCH_CONTENT = 1 << 6,  // BODY[...], RFC822*, BODY
+  // Anything short of these is answered from metadata alone, so a backend
+  // can hand back Message(uid, date, flags, size) without reading the body
+  FETCH_NEEDS_BODY = FETCH_ENVELOPE | FETCH_BODYSTRUCTURE | FETCH_CONTENT
+} FetchAttribute_t;
+
+// Receives an APPENDed message in pieces as they arrive from the client.
+// Destroying a stream without commit() abandons the message.
+class AppendStream {
+ public:
+  virtual ~AppendStream() {}
+  virtual bool write(const char* data, size_t length) = 0;
+  virtual bool commit() = 0;
+};
+
 // DataModel Subclass must provide init() to initialize m_Inst and implement all
 // public functions.
 class DataModel {
@@ -63,19 +92,173 @@ class DataModel {
                              const std::string& mailbox) = 0;
   virtual bool append(const std::string& user, const std::string& mailbox,
                       const std::string& messageData) = 0;
-  virtual bool expunge(const std::string& user, const std::string& mailbox, std::vector<std::string>& expunged) = 0;
-  virtual bool subscribe(
+  // Streaming form of append() used for large messages. Backends that can
+  // store a message incrementally should override this; the default buffers
+  // through BufferedAppendStream and hands the result to append().
+  virtual std::unique_ptr<AppendStream> beginAppend(
       const std::string& user, const std::string& mailbox,
-      std::function<void(std::vector<std::string>)> callback) {
+      const std::vector<std::string>& flags, const std::string& date,
+      size_t size);
+  virtual bool expunge(const std::string& user, const std::string& mailbox, std::vector<std::string>& expunged) = 0;
+  // COPY of a (resolved) set of sequence numbers into destination, which
+  // should come out with either every copy or none of them. Backends should
+  // override this; the default re-appends one message at a time through
+  // beginAppend(), so it cannot take back the copies made before a failure.
+  virtual bool copyRange(const std::string& user, const std::string& mailbox,
+                         const SequenceSet& messages, const std::string& destination) {
+    auto copy = [&](int, Message& msg) -> bool {
+      std::shared_ptr<BodySource> src = msg.source();
+      std::string date = msg.internalDate();
+      if (date.size() >= 2 && date.front() == '"') date = date.substr(1, date.size() - 2);
+      std::unique_ptr<AppendStream> stream =
+          beginAppend(user, destination, msg.flagList(), date, src->size());
+      if (!stream) return false;
+      char chunk[64 * 1024];
+      for (size_t off = 0; off < src->size();) {
+        ssize_t n = src->read(off, chunk, sizeof(chunk));
+        if (n <= 0 || !stream->write(chunk, n)) return false;
+        off += n;
+      }
+      return stream->commit();
+    };
+    return fetchRange(user, mailbox, messages, FETCH_FLAGS | FETCH_INTERNALDATE | FETCH_CONTENT,
+                      copy);
+  }
+  // Posts the mailbox's changes (new messages, expunges, flag changes by
+  // any session) to queue until unsubscribe(). Returns false if the backend
+  // does not report changes, in which case clients only see them on
+  // SELECT. Backends that do report them subscribe queue to changes() and
+  // publish each change there once.
+  virtual bool subscribe(const std::string& /*user*/, const std::string& /*mailbox*/,
+                         const std::shared_ptr<NotificationQueue>& /*queue*/) {
     return false;
-  }  // note, function passed by value in order to preserve temporary std::bind
-     // value
+  }
+  virtual void unsubscribe(const std::string& /*user*/, const std::string& /*mailbox*/,
+                           const std::shared_ptr<NotificationQueue>& /*queue*/) {}
   virtual bool search(const std::string& user, const std::string& mailbox, const std::vector<std::string>& queries, std::vector<int>& messages) = 0;
+  // Parsed form of SEARCH. When the backend provides columns(), flag, size,
+  // date, sequence and UID keys (and sent date keys, if the columns have
+  // sent) are filtered here and the backend is only asked (through
+  // matches()) about the rest, for the messages still in the running. Otherwise the query goes back to search() above
+  // as strings. Matches are returned as a set of sequence numbers.
+  virtual bool search(const std::string& user, const std::string& mailbox,
+                      const SearchKey& query, SequenceSet& messages) {
+    std::shared_ptr<const MailboxColumns> cols = columns(user, mailbox);
+    if (!cols) {
+      std::vector<std::string> terms;
+      if (query.kind == SearchKey::AND) {
+        for (const SearchKey& k : query.children) terms.push_back(k.str());
+      } else {
+        terms.push_back(query.str());
+      }
+      std::vector<int> found;
+      if (!search(user, mailbox, terms, found)) return false;
+      for (int i : found)
+        if (i > 0) messages.add(i);
+      return true;
+    }
+    ContentMatcher matcher = [&](size_t row, const SearchKey& key) {
+      return matches(user, mailbox, row + 1, key);
+    };
+    std::shared_ptr<const TextIndex> text = textIndex(user, mailbox);
+    messages = SearchIndex(*cols, matcher, text.get()).evaluate(query).sequence();
+    return true;
+  }
+  // A snapshot of the mailbox's SEARCH columns, or nullptr if the backend
+  // does not keep them
+  virtual std::shared_ptr<const MailboxColumns> columns(const std::string& /*user*/,
+                                                        const std::string& /*mailbox*/) {
+    return nullptr;
+  }
+  // An inverted index of the mailbox's text, if the backend keeps one, to
+  // cut down the messages matches() is asked about
+  virtual std::shared_ptr<const TextIndex> textIndex(const std::string& /*user*/,
+                                                     const std::string& /*mailbox*/) {
+    return nullptr;
+  }
+  // Whether message msgID matches a header or text key
+  virtual bool matches(const std::string& user, const std::string& mailbox,
+                       int msgID, const SearchKey& key) {
+    Message msg = fetch(user, mailbox, msgID);
+    return matchesContent(key, msg.body("HEADER", 0), msg.body("TEXT", 0));
+  }
   virtual Message fetch(const std::string& user, const std::string& mailbox, int id) = 0;
-  virtual bool setFlags(const std::string& user, const std::string& mailbox, int msgID, const std::vector<std::string>& flagList) = 0;
-  virtual bool addFlags(const std::string& user, const std::string& mailbox, int msgID, const std::vector<std::string>& flagList) = 0;
-  virtual bool removeFlags(const std::string& user, const std::string& mailbox, int msgID, const std::vector<std::string>& flagList) = 0;
+  // Called for each fetched message in ascending order; return false to stop
+  typedef std::function<bool(int, Message&)> FetchCallback;
+  // Batch form of fetch() for a (resolved) set of sequence numbers.
+  // attributes is a mask of FetchAttribute_t. Backends should override this
+  // to load a whole range in one query or scan; the default falls back to
+  // one fetch() per message.
+  virtual bool fetchRange(const std::string& user, const std::string& mailbox,
+                          const SequenceSet& messages, unsigned /*attributes*/,
+                          const FetchCallback& callback) {
+    for (uint32_t i : messages) {
+      Message msg = fetch(user, mailbox, i);
+      if (!callback(i, msg)) return false;
+    }
+    return true;
+  }
+  // Persistent storage for MessageMetadata::serialize() blobs, so ENVELOPE
+  // and BODYSTRUCTURE survive restarts without reparsing. The blob for a UID
+  // never changes; backends that do not persist anything keep the defaults.
+  virtual bool loadMetadata(const std::string& /*user*/, const std::string& /*mailbox*/,
+                            long /*uid*/, std::string& /*serialized*/) {
+    return false;
+  }
+  virtual bool storeMetadata(const std::string& /*user*/, const std::string& /*mailbox*/,
+                             long /*uid*/, const std::string& /*serialized*/) {
+    return false;
+  }
+  virtual bool setFlags(const std::string& user, const std::string& mailbox, int msgID, const FlagSet& flags) = 0;
+  virtual bool addFlags(const std::string& user, const std::string& mailbox, int msgID, const FlagSet& flags) = 0;
+  virtual bool removeFlags(const std::string& user, const std::string& mailbox, int msgID, const FlagSet& flags) = 0;
+  // Receives the sequence number and resulting flags of each message a
+  // storeFlags() covered, for the untagged FETCH responses
+  typedef std::function<void(int, const MessageFlags&)> StoreCallback;
+  // STORE over a (resolved) set of sequence numbers as one transaction:
+  // either every message gets the change or none does. Backends should
+  // override this; the default reads the flags first, makes one setFlags()/
+  // addFlags()/removeFlags() call per message, and on a failure sets the
+  // messages already changed back to what they had. It is not isolated: a
+  // store by another session in between can be undone along with it.
+  virtual bool storeFlags(const std::string& user, const std::string& mailbox,
+                          const SequenceSet& messages, StoreOp_t op,
+                          const FlagSet& flags, const StoreCallback& stored) {
+    typedef bool (DataModel::*Mutator)(const std::string&, const std::string&, int,
+                                       const FlagSet&);
+    const Mutator fn = op == STORE_REMOVE ? &DataModel::removeFlags
+                       : op == STORE_ADD  ? &DataModel::addFlags
+                                          : &DataModel::setFlags;
+    std::vector<std::pair<int, FlagSet>> before;
+    if (!fetchRange(user, mailbox, messages, FETCH_FLAGS, [&](int i, Message& msg) {
+          before.emplace_back(i, FlagSet::fromNames(msg.flagList()));
+          return true;
+        }))
+      return false;
+    for (size_t n = 0; n < before.size(); n++) {
+      if ((this->*fn)(user, mailbox, before[n].first, flags)) continue;
+      while (n-- > 0) setFlags(user, mailbox, before[n].first, before[n].second);
+      return false;
+    }
+    if (!stored) return true;
+    return fetchRange(user, mailbox, messages, FETCH_FLAGS, [&](int i, Message& msg) {
+      stored(i, msg.flagBits());
+      return true;
+    });
+  }
+  // False if mailbox has no room for flags' keywords next to the ones it
+  // already has; asked after a STORE or APPEND fails, to answer [LIMIT]
+  virtual bool keywordsFit(const std::string& /*user*/, const std::string& /*mailbox*/,
+                           const FlagSet& /*flags*/) {
+    return true;
+  }
+ protected:
+  // Sessions watching each mailbox, shared by every connection
+  ChangeBus& changes() { return bus; }
+
  private:
+  ChangeBus bus;
+
   DataModel(DataModel const&) = delete;
   DataModel& operator=(DataModel const&) = delete;
 
@@ -83,6 +266,59 @@ class DataModel {
   DataModel() {}
 };
 
+
+// Keeps up to kMemoryLimit bytes in memory and spills anything larger to an
+// unlinked temporary file, so receiving a message costs at most one copy of
+// it in memory (when it is finally handed to DataModel::append).
+class BufferedAppendStream : public AppendStream {
+ private:
+  DataModel& dm;
+  const std::string user;
+  const std::string mailbox;
+  std::string buffer;
+  std::FILE* spill = nullptr;
+  size_t written = 0;
+
+ public:
+  static constexpr size_t kMemoryLimit = 1024 * 1024;
+  BufferedAppendStream(DataModel& d, const std::string& u,
+                       const std::string& m, size_t size)
+      : dm(d), user(u), mailbox(m) {
+    if (size <= kMemoryLimit) buffer.reserve(size);
+  }
+  ~BufferedAppendStream() {
+    if (spill != nullptr) std::fclose(spill);
+  }
+  bool write(const char* data, size_t length) {
+    if (spill == nullptr && buffer.length() + length > kMemoryLimit) {
+      spill = std::tmpfile();
+      if (spill == nullptr ||
+          std::fwrite(buffer.data(), 1, buffer.length(), spill) != buffer.length())
+        return false;
+      std::string().swap(buffer);
+    }
+    written += length;
+    if (spill != nullptr)
+      return std::fwrite(data, 1, length, spill) == length;
+    buffer.append(data, length);
+    return true;
+  }
+  bool commit() {
+    if (spill != nullptr) {
+      buffer.resize(written);
+      std::rewind(spill);
+      if (std::fread(&buffer[0], 1, written, spill) != written) return false;
+    }
+    return dm.append(user, mailbox, buffer);
+  }
+};
+
+inline std::unique_ptr<AppendStream> DataModel::beginAppend(
+    const std::string& user, const std::string& mailbox,
+    const std::vector<std::string>& /*flags*/, const std::string& /*date*/,
+    size_t size) {
+  return std::make_unique<BufferedAppendStream>(*this, user, mailbox, size);
+}
 }  // namespace IMAPProvider
 
 #endif
\ No newline at end of file
@@ -97,13 +97,13 @@ class DAuthP : public IMAPProvider::DataModel {
     std::stringstream ss;
     return IMAPProvider::Message(ss, 0, "1/1/2020", {"\\Seen", "\\Recent"});
   }
-  virtual bool setFlags(const std::string& user, const std::string& mailbox, int msgID, const std::vector<std::string>& flagList){
+  virtual bool setFlags(const std::string& user, const std::string& mailbox, int msgID, const IMAPProvider::FlagSet& flags){
     return true;
   }
-  virtual bool addFlags(const std::string& user, const std::string& mailbox, int msgID, const std::vector<std::string>& flagList){
+  virtual bool addFlags(const std::string& user, const std::string& mailbox, int msgID, const IMAPProvider::FlagSet& flags){
     return true;
   }
-  virtual bool removeFlags(const std::string& user, const std::string& mailbox, int msgID, const std::vector<std::string>& flagList){
+  virtual bool removeFlags(const std::string& user, const std::string& mailbox, int msgID, const IMAPProvider::FlagSet& flags){
     return true;
   }
 };
\ No newline at end of file
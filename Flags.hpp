@@ -0,0 +1,381 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Helpers.hpp"
+
+#ifndef __IMAP_FLAGS__
+#define __IMAP_FLAGS__
+
+namespace IMAPProvider {
+// System flags as bits. Where a mailbox numbers its keywords, keyword i
+// takes bit kKeywordShift + i of the same word.
+typedef enum : uint32_t {
+  FLAG_SEEN = 1 << 0,
+  FLAG_ANSWERED = 1 << 1,
+  FLAG_FLAGGED = 1 << 2,
+  FLAG_DELETED = 1 << 3,
+  FLAG_DRAFT = 1 << 4,
+  FLAG_RECENT = 1 << 5
+} Flag_t;
+static constexpr uint32_t kKeywordShift = 6;
+static constexpr size_t kMaxKeywords = 64 - kKeywordShift;
+
+// How STORE combines its flags with a message's: FLAGS, +FLAGS or -FLAGS
+typedef enum { STORE_REPLACE, STORE_ADD, STORE_REMOVE } StoreOp_t;
+
+// A set of flags: system flags as Flag_t bits, keywords by name (unique,
+// in the order they were added)
+class FlagSet {
+ public:
+  uint32_t system = 0;
+  std::vector<std::string> keywords;
+
+  FlagSet() {}
+  // Unknown \flags among names are left out
+  FlagSet(std::initializer_list<std::string_view> names) {
+    for (std::string_view n : names) add(n);
+  }
+
+ private:
+  static constexpr std::pair<std::string_view, Flag_t> kSystem[] = {
+      {"\\Seen", FLAG_SEEN},       {"\\Answered", FLAG_ANSWERED},
+      {"\\Flagged", FLAG_FLAGGED}, {"\\Deleted", FLAG_DELETED},
+      {"\\Draft", FLAG_DRAFT},     {"\\Recent", FLAG_RECENT}};
+
+ public:
+  // Adds one flag by name; false for an unknown \flag
+  bool add(std::string_view name) {
+    if (name.empty()) return false;
+    if (name[0] == '\\') {
+      auto sys = std::find_if(std::begin(kSystem), std::end(kSystem),
+                              [&](const auto& s) { return ciCompare(s.first, name) == 0; });
+      if (sys == std::end(kSystem)) return false;
+      system |= sys->second;
+      return true;
+    }
+    if (!has(name)) keywords.emplace_back(name);
+    return true;
+  }
+  bool has(std::string_view keyword) const {
+    return std::any_of(keywords.begin(), keywords.end(),
+                       [&](const std::string& k) { return ciCompare(k, keyword) == 0; });
+  }
+
+  static FlagSet fromNames(const std::vector<std::string>& names) {
+    FlagSet out;
+    for (const std::string& n : names) out.add(n);
+    return out;
+  }
+  // Parses a flag list such as "(\Seen $Junk)" or "\Seen $Junk"
+  static bool parse(std::string_view list, FlagSet& out) {
+    if (!list.empty() && list.front() == '(') {
+      if (list.back() != ')') return false;
+      list = list.substr(1, list.size() - 2);
+    }
+    FlagSet flags;
+    while (!list.empty()) {
+      size_t sp = list.find(' ');
+      std::string_view name = list.substr(0, sp);
+      if (!name.empty() && !flags.add(name)) return false;
+      if (sp == std::string_view::npos) break;
+      list.remove_prefix(sp + 1);
+    }
+    out = std::move(flags);
+    return true;
+  }
+
+  // Combines delta into this set as STORE op would
+  void apply(StoreOp_t op, const FlagSet& delta) {
+    // \Recent belongs to the server; STORE never changes it
+    const uint32_t bits = delta.system & ~FLAG_RECENT;
+    switch (op) {
+      case STORE_REPLACE:
+        system = (system & FLAG_RECENT) | bits;
+        keywords = delta.keywords;
+        break;
+      case STORE_ADD:
+        system |= bits;
+        for (const std::string& k : delta.keywords)
+          if (!has(k)) keywords.push_back(k);
+        break;
+      case STORE_REMOVE:
+        system &= ~bits;
+        keywords.erase(std::remove_if(keywords.begin(), keywords.end(),
+                                      [&](const std::string& k) { return delta.has(k); }),
+                       keywords.end());
+        break;
+    }
+  }
+
+  bool empty() const { return system == 0 && keywords.empty(); }
+  std::vector<std::string> names() const {
+    std::vector<std::string> out;
+    for (const auto& s : kSystem)
+      if (system & s.second) out.emplace_back(s.first);
+    out.insert(out.end(), keywords.begin(), keywords.end());
+    return out;
+  }
+  // Wire form, e.g. "(\Seen $Junk)"
+  std::string str() const { return "(" + join(names(), " ") + ")"; }
+};
+
+// Flag ids are bit numbers: a system flag's is its Flag_t bit, keyword i of
+// a mailbox's FlagDictionary has kKeywordShift + i. A message's flags are
+// then one word.
+typedef uint64_t FlagBits;
+
+// A mailbox's keywords, numbered in the order they were first used. A
+// dictionary never changes once built; with() makes a new one for new
+// keywords, and since ids are only ever appended, bits taken against an
+// older dictionary mean the same in every later one. Messages share their
+// mailbox's dictionary, and their wire form is put together from strings
+// computed once here rather than joined per message.
+class FlagDictionary {
+ private:
+  std::vector<std::string> names;
+  std::string all;
+  std::string permanent;
+
+  // "(\Seen \Answered)" and the like, for each combination of system flags
+  static const std::array<std::string, 1u << kKeywordShift>& systemStrings() {
+    static const std::array<std::string, 1u << kKeywordShift> table = [] {
+      static const char* system[] = {"\\Seen", "\\Answered", "\\Flagged",
+                                     "\\Deleted", "\\Draft", "\\Recent"};
+      std::array<std::string, 1u << kKeywordShift> t;
+      for (uint32_t bits = 0; bits < t.size(); bits++) {
+        t[bits] = "(";
+        for (uint32_t i = 0; i < kKeywordShift; i++) {
+          if (!(bits & (1u << i))) continue;
+          if (t[bits].size() > 1) t[bits] += ' ';
+          t[bits] += system[i];
+        }
+        t[bits] += ')';
+      }
+      return t;
+    }();
+    return table;
+  }
+
+ public:
+  // keywords must number at most kMaxKeywords; with() checks
+  explicit FlagDictionary(std::vector<std::string> keywords = {})
+      : names(std::move(keywords)) {
+    std::string list = "\\Answered \\Flagged \\Deleted \\Seen \\Draft";
+    for (const std::string& k : names) list.append(" ").append(k);
+    all = "(" + list + ")";
+    permanent = "(" + list + " \\*)";
+  }
+  // The dictionary of a mailbox with no keywords
+  static const std::shared_ptr<const FlagDictionary>& standard() {
+    static const std::shared_ptr<const FlagDictionary> none =
+        std::make_shared<const FlagDictionary>();
+    return none;
+  }
+  // dict, or a new dictionary that also holds set's keywords; nullptr if
+  // they would not fit
+  static std::shared_ptr<const FlagDictionary> with(
+      const std::shared_ptr<const FlagDictionary>& dict, const FlagSet& set) {
+    std::vector<std::string> grown;
+    for (const std::string& k : set.keywords) {
+      if (dict->keyword(k) != 0 ||
+          std::any_of(grown.begin(), grown.end(),
+                      [&](const std::string& g) { return ciCompare(g, k) == 0; }))
+        continue;
+      if (grown.empty()) grown = dict->names;
+      grown.push_back(k);
+    }
+    if (grown.empty()) return dict;
+    if (grown.size() > kMaxKeywords) return nullptr;
+    return std::make_shared<const FlagDictionary>(std::move(grown));
+  }
+
+  const std::vector<std::string>& keywords() const { return names; }
+  // A keyword's bit; 0 if it is not in the dictionary
+  FlagBits keyword(std::string_view name) const {
+    for (size_t i = 0; i < names.size(); i++)
+      if (ciCompare(names[i], name) == 0) return FlagBits(1) << (kKeywordShift + i);
+    return 0;
+  }
+  // set as bits; false if one of its keywords is not in the dictionary
+  bool bits(const FlagSet& set, FlagBits& out) const {
+    FlagBits b = set.system;
+    for (const std::string& k : set.keywords) {
+      FlagBits kw = keyword(k);
+      if (kw == 0) return false;
+      b |= kw;
+    }
+    out = b;
+    return true;
+  }
+  FlagSet set(FlagBits bits) const {
+    FlagSet out;
+    out.system = static_cast<uint32_t>(bits & ((1u << kKeywordShift) - 1));
+    for (size_t i = 0; i < names.size(); i++)
+      if (bits & (FlagBits(1) << (kKeywordShift + i))) out.keywords.push_back(names[i]);
+    return out;
+  }
+  // Wire form of bits, e.g. "(\Seen $Junk)"
+  std::string str(FlagBits bits) const {
+    const std::string& system = systemStrings()[bits & ((1u << kKeywordShift) - 1)];
+    bits >>= kKeywordShift;
+    if (bits == 0) return system;
+    std::string out(system, 0, system.size() - 1);
+    for (size_t i = 0; bits != 0 && i < names.size(); i++, bits >>= 1) {
+      if (!(bits & 1)) continue;
+      if (out.size() > 1) out += ' ';
+      out += names[i];
+    }
+    out += ')';
+    return out;
+  }
+  // For the FLAGS and PERMANENTFLAGS responses to SELECT
+  const std::string& flags() const { return all; }
+  const std::string& permanentFlags() const { return permanent; }
+};
+
+// A message's flags: its bits and the dictionary that names them
+struct MessageFlags {
+  FlagBits bits = 0;
+  std::shared_ptr<const FlagDictionary> dict = FlagDictionary::standard();
+  // keywords past the kMaxKeywords that have bits; only the by-name
+  // constructor below has any
+  std::vector<std::string> extra;
+
+  MessageFlags() {}
+  MessageFlags(FlagBits b, std::shared_ptr<const FlagDictionary> d)
+      : bits(b), dict(d ? std::move(d) : FlagDictionary::standard()) {}
+  // For backends that keep flags by name; anything that is not a system
+  // flag is a keyword of a dictionary made for this message alone
+  MessageFlags(const std::vector<std::string>& flagNames) {
+    FlagSet set;
+    for (const std::string& n : flagNames)
+      if (!set.add(n) && !set.has(n)) set.keywords.push_back(n);
+    if (set.keywords.size() > kMaxKeywords) {
+      extra.assign(set.keywords.begin() + kMaxKeywords, set.keywords.end());
+      set.keywords.resize(kMaxKeywords);
+    }
+    if (!set.keywords.empty()) dict = FlagDictionary::with(dict, set);
+    dict->bits(set, bits);
+  }
+  MessageFlags(std::initializer_list<std::string> flagNames)
+      : MessageFlags(std::vector<std::string>(flagNames)) {}
+
+  bool has(Flag_t flag) const { return bits & flag; }
+  FlagSet set() const {
+    FlagSet out = dict->set(bits);
+    out.keywords.insert(out.keywords.end(), extra.begin(), extra.end());
+    return out;
+  }
+  std::vector<std::string> names() const { return set().names(); }
+  std::string str() const { return extra.empty() ? dict->str(bits) : set().str(); }
+};
+
+// Mailbox attributes for LIST and LSUB (RFC 3501, RFC 3348, RFC 6154)
+typedef enum : uint32_t {
+  MBOX_NOINFERIORS = 1 << 0,
+  MBOX_NOSELECT = 1 << 1,
+  MBOX_MARKED = 1 << 2,
+  MBOX_UNMARKED = 1 << 3,
+  MBOX_HASCHILDREN = 1 << 4,
+  MBOX_HASNOCHILDREN = 1 << 5,
+  MBOX_ALL = 1 << 6,
+  MBOX_ARCHIVE = 1 << 7,
+  MBOX_DRAFTS = 1 << 8,
+  MBOX_FLAGGED = 1 << 9,
+  MBOX_JUNK = 1 << 10,
+  MBOX_SENT = 1 << 11,
+  MBOX_TRASH = 1 << 12
+} MailboxAttr_t;
+
+// A mailbox's attributes: the known ones as MailboxAttr_t bits, any others
+// by name
+class MailboxFlags {
+ public:
+  uint32_t bits = 0;
+  std::vector<std::string> other;
+
+ private:
+  static constexpr std::pair<std::string_view, MailboxAttr_t> kKnown[] = {
+      {"\\Noinferiors", MBOX_NOINFERIORS}, {"\\Noselect", MBOX_NOSELECT},
+      {"\\Marked", MBOX_MARKED},           {"\\Unmarked", MBOX_UNMARKED},
+      {"\\HasChildren", MBOX_HASCHILDREN}, {"\\HasNoChildren", MBOX_HASNOCHILDREN},
+      {"\\All", MBOX_ALL},                 {"\\Archive", MBOX_ARCHIVE},
+      {"\\Drafts", MBOX_DRAFTS},           {"\\Flagged", MBOX_FLAGGED},
+      {"\\Junk", MBOX_JUNK},               {"\\Sent", MBOX_SENT},
+      {"\\Trash", MBOX_TRASH}};
+
+ public:
+  MailboxFlags() {}
+  MailboxFlags(std::initializer_list<std::string_view> names) {
+    for (std::string_view n : names) add(n);
+  }
+  explicit MailboxFlags(const std::vector<std::string>& names) {
+    for (const std::string& n : names) add(n);
+  }
+  void add(std::string_view name) {
+    for (const auto& k : kKnown) {
+      if (ciCompare(k.first, name) == 0) {
+        bits |= k.second;
+        return;
+      }
+    }
+    if (std::none_of(other.begin(), other.end(),
+                     [&](const std::string& o) { return ciCompare(o, name) == 0; }))
+      other.emplace_back(name);
+  }
+  void add(MailboxAttr_t attr) { bits |= attr; }
+  bool has(MailboxAttr_t attr) const { return bits & attr; }
+  // Wire form, e.g. "(\Noselect \HasChildren)"
+  std::string str() const {
+    std::string out = "(";
+    for (const auto& k : kKnown) {
+      if (!(bits & k.second)) continue;
+      if (out.size() > 1) out += ' ';
+      out += k.first;
+    }
+    for (const std::string& o : other) {
+      if (out.size() > 1) out += ' ';
+      out += o;
+    }
+    return out + ")";
+  }
+};
+}  // namespace IMAPProvider
+
+struct mailbox {
+  std::string path;
+  IMAPProvider::MailboxFlags flags;
+};
+
+struct selectResp {
+  std::shared_ptr<const IMAPProvider::FlagDictionary> flags;
+  int exists;
+  int recent;
+  int unseen;
+  std::string permanentFlags;
+  long uidnext;
+  long uidvalid;
+  std::string accessType;
+};
+
+#endif
@@ -19,12 +19,11 @@
 #include <vector>
 #include <map>
 #include <sstream>
+#include <string_view>
 #include <boost/log/trivial.hpp>
-#include <miniz.h>
 #include <csignal>
 #include <cerrno>
 #include <cstring>
-#include <poll.h>
 
 #ifndef __IMAP_HELPERS__
 #define __IMAP_HELPERS__
@@ -50,49 +49,6 @@ std::string gen_uuid(int len) {
   return uuid;
 }
 
-inline int sendMsg(int fd, const std::string &data) {
-  // std::signal(SIGPIPE, SIG_IGN);
-  #ifndef SO_NOSIGPIPE
-    int i = send(fd, &data[0], data.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
-  #else
-    int i = send(fd, &data[0], data.length(), MSG_DONTWAIT);
-  #endif
-    BOOST_LOG_TRIVIAL(trace) <<"SEND call to socket " << fd << " Returned:" << i << " " << (errno != 0 ? strerror(errno) : "");
-    return (i < 0 ? errno : 0);
-}
-inline int sendMsg(struct tls *fd, int fdn, const std::string &data) {
-  std::signal(SIGPIPE, SIG_IGN);
-  int i = tls_write(fd, &data[0], data.length());
-  if(i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT){
-    struct pollfd pfd[1];
-    pfd[0].fd = fdn;
-    if(i == TLS_WANT_POLLOUT){
-      pfd[0].events = POLLOUT;
-    }else if(i == TLS_WANT_POLLIN){
-      pfd[0].events = POLLIN;
-    }else return (i < 0 ? errno : 0);
-    poll(pfd, 1, 0); 
-    i = tls_write(fd, &data[0], data.length());
-  }
-  BOOST_LOG_TRIVIAL(trace) <<"SEND call to socket " << fd << " Returned:" << i << " " << (errno != 0 ? strerror(errno) : "");
-  return (i < 0 ? errno : 0);
-}
-struct mailbox {
-  std::string path;
-  std::vector<std::string> flags;
-};
-
-struct selectResp {
-  std::string flags;
-  int exists;
-  int recent;
-  int unseen;
-  std::string permanentFlags;
-  long uidnext;
-  long uidvalid;
-  std::string accessType;
-};
-
 template <class T>
 std::string join(const T& itms,
                  const std::string& delimiter) {
@@ -122,6 +78,16 @@ bool isNumeric(const std::string& s){
       return std::isdigit(c);
     });
 }
+// ASCII case-insensitive three-way compare; usable in constant expressions
+constexpr int ciCompare(std::string_view a, std::string_view b){
+  for(size_t i = 0; i < a.size() && i < b.size(); i++){
+    char ca = (a[i] >= 'a' && a[i] <= 'z') ? a[i] - 'a' + 'A' : a[i];
+    char cb = (b[i] >= 'a' && b[i] <= 'z') ? b[i] - 'a' + 'A' : b[i];
+    if(ca != cb) return ca < cb ? -1 : 1;
+  }
+  return a.size() == b.size() ? 0 : (a.size() < b.size() ? -1 : 1);
+}
+
 bool isRange(const std::string& s){
   if(s.length() < 1)
     return false;
@@ -152,108 +118,4 @@ std::string base64_decode(const std::string &in) {
   return out;
 }
 
-#define Z_BUF_SIZE (1024*1024)
-const std::string deflate(const std::string& data, const int level){
-  z_stream strm = {0};
-  std::string outbuf(Z_BUF_SIZE, 0);
-  std::string inbuf(__min__(Z_BUF_SIZE, data.length()), 0);
-  std::stringstream buf;
-  strm.next_out = reinterpret_cast<unsigned char*>(&outbuf[0]);
-  strm.avail_out = Z_BUF_SIZE;
-  strm.next_in = reinterpret_cast<unsigned char*>(&inbuf[0]);
-  strm.avail_in = 0;
-
-  uint remaining = data.length();
-
-  if(deflateInit(&strm, level) != Z_OK){
-    BOOST_LOG_TRIVIAL(error) << "Unable to init deflate";
-    return data;
-  }
-  while(1){
-    if(!strm.avail_in){
-      uint bytesToRead = __min__(Z_BUF_SIZE, remaining);
-      inbuf = data.substr(data.length() - remaining, bytesToRead);
-      strm.next_in = reinterpret_cast<unsigned char*>(&inbuf[0]);
-      strm.avail_in = bytesToRead;
-      remaining -= bytesToRead;
-    }
-    int status = deflate(&strm, ifThenElse(remaining, Z_NO_FLUSH, Z_FINISH));
-    if(status == Z_STREAM_END || (!strm.avail_out)){
-      // Output buffer is full, or compression is done.
-      uint n = Z_BUF_SIZE - strm.avail_out;
-      buf << outbuf.substr(0,n);
-      std::fill(outbuf.begin(), outbuf.end(), 0);
-      strm.next_out = reinterpret_cast<unsigned char*>(&outbuf[0]);
-      strm.avail_out = Z_BUF_SIZE;
-    }
-    if(status == Z_STREAM_END)
-      break;
-    else if(status != Z_OK)
-      BOOST_LOG_TRIVIAL(error) << "Deflate status not 'OK'";
-      return data;
-  }
-  if(deflateEnd(&strm) != Z_OK){
-    BOOST_LOG_TRIVIAL(warning) << "zlib unable to cleanup deflate stream";
-  }
-  std::string ret = buf.str();
-  if(ret.length() != strm.total_out){
-    BOOST_LOG_TRIVIAL(error) << "Output size mismatch - Expected: " << strm.total_out << " Got: " << ret.length(); 
-  }
-  BOOST_LOG_TRIVIAL(trace) << "DEFLATE: " << ((ret.length() * 100) / data.length()) << "%" << ret;
-  return ret;
-}
-
-const std::string inflate(const std::string& data){
-  z_stream strm = {0};
-  std::string outbuf(Z_BUF_SIZE, 0);
-  std::string inbuf(Z_BUF_SIZE, 0);
-  std::stringstream buf;
-  strm.next_out = reinterpret_cast<unsigned char*>(&outbuf[0]);
-  strm.avail_out = Z_BUF_SIZE;
-  strm.next_in = reinterpret_cast<unsigned char*>(&inbuf[0]);
-  strm.avail_in = 0;
-  uint remaining = data.length();
-  if(inflateInit(&strm) != Z_OK){
-    throw std::runtime_error("Unable to inflate command data: Init failed.\n");
-  }
-  while(remaining > 0){
-    std::cout << strm.avail_in + remaining << std::endl;
-    if(strm.avail_in <= 0){
-      uint bytesToRead = __min__(Z_BUF_SIZE, remaining);
-      inbuf = data.substr(data.length() - remaining, bytesToRead);
-      strm.next_in = reinterpret_cast<unsigned char*>(&inbuf[0]);
-      strm.avail_in = bytesToRead;
-      remaining -= bytesToRead;
-    }
-    int status = ::inflate(&strm, Z_SYNC_FLUSH);
-    if ((status == Z_STREAM_END) || (!strm.avail_out)){
-        // Output buffer is full, or decompression is done
-      uint n = Z_BUF_SIZE - strm.avail_out;
-      buf << outbuf.substr(0,n);
-      std::fill(outbuf.begin(), outbuf.end(), 0);
-      strm.next_out = reinterpret_cast<unsigned char*>(&outbuf[0]);
-      strm.avail_out = Z_BUF_SIZE;
-    }
-    if(status == Z_STREAM_END){
-      break;
-    }
-    else if(status != Z_OK){
-      return "";
-    }
-   
-  }
-  BOOST_LOG_TRIVIAL(trace) << buf.str();
-  if(inflateEnd(&strm) != Z_OK){
-    BOOST_LOG_TRIVIAL(warning) << "zlib unable to cleanup inflate stream";
-  }
-  BOOST_LOG_TRIVIAL(trace) << buf.str();
-  std::string ret(buf.str());
-  if(ret.length() != strm.total_out){
-    BOOST_LOG_TRIVIAL(error) << "Output size mismatch - Expected: " << strm.total_out << " Got: " << ret.length(); 
-  }
-  BOOST_LOG_TRIVIAL(trace) << buf.str();
-  return ret;
-}
-
-
 #endif
\ No newline at end of file
@@ -10,37 +10,173 @@
  * or visit: https://zacharytipnis.com
  *
  */
+#include <charconv>
 #include <functional>
-#include <unordered_map>
-#include <variant>
+#include <iterator>
 #include <regex>
 #include <unistd.h>
-#include <array>
 #include "Message.hpp"
 
 template <class AuthP, class DataP>
-std::map<int, typename IMAPProvider::ClientStateModel<AuthP> >
-IMAPProvider::IMAPProvider<AuthP, DataP>::states;
+IMAPProvider::MetadataCache IMAPProvider::IMAPProvider<AuthP, DataP>::metadata;
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::operator()(int fd) const {
-  auto rec = receive(fd);
-  int rcvd = rec.first;
-  std::string recData = rec.second;
-  std::stringstream data(recData);
-  if (rcvd == -1) {
-    disconnect(fd, "Unable to read from socket");
+  Serving serving(*this, fd);
+  ClientStateModel<AuthP>* st = states.find(fd);
+  if (st == nullptr) return;
+  if (st->handshaking()) {
+    handshake(fd);
+    return;
+  }
+  // a client that is not reading its responses is not read from either;
+  // what it sends waits in the kernel until flush() has drained them
+  while (st->output.size() <= kOutputHighWater) {
+    int got = receive(fd);
+    if (got < 0) {
+      disconnect(fd, "");
+      return;
+    }
+    process(fd);
+    // anything past the budget is still waiting to be read
+    if (static_cast<size_t>(got) < kReadBudget || (st = states.find(fd)) == nullptr) return;
+  }
+}
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::flush(int fd) const {
+  Serving serving(*this, fd);
+  ClientStateModel<AuthP>* st = states.find(fd);
+  if (st == nullptr) return;
+  if (st->handshaking()) {
+    handshake(fd);
+    return;
+  }
+  if (st->notifications) {
+    // outside IDLE, changes wait for the client's next command
+    if (st->idling) {
+      deliver(fd);
+    } else {
+      st->notifications->acknowledge();
+    }
+  }
+  if (sendQueued(fd) != 0) {
+    disconnect(fd, "");
   } else {
-    for(std::string line; std::getline(data, line);)
-      parse(fd,line);
+    // resume any commands held back while the queue was full, then read on
+    // from where operator() stopped
+    process(fd);
+    if (states.contains(fd)) (*this)(fd);
+  }
+}
+// Runs every complete command (or awaited continuation line) in the input buffer,
+// then flushes all of the responses in one go. Anything incomplete stays
+// buffered until the next time fd is readable.
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::process(int fd) const {
+  for (auto st = states.find(fd); st != nullptr; st = states.find(fd)) {
+    if (st->output.size() > kOutputHighWater || st->output.streaming()) {
+      if (sendQueued(fd) != 0) {
+        disconnect(fd, "");
+        return;
+      }
+      // client is not keeping up, or a body is still being streamed (and
+      // e.g. COMPRESS must not start in the middle of it); wait for flush()
+      // before reading on
+      if (st->output.size() > kOutputHighWater || st->output.streaming()) return;
+    }
+    InputBuffer& input = st->input;
+    if (st->literalSink) {
+      if (input.empty()) break;
+      size_t n = std::min(st->literalRemaining, input.size());
+      st->literalSink(input.data(), n);
+      input.consume(n);
+      if ((st->literalRemaining -= n) == 0) {
+        auto done = std::move(st->literalDone);
+        st->literalSink = nullptr;
+        st->literalDone = nullptr;
+        done();
+      }
+      continue;
+    }
+    if (st->continuation) {
+      size_t eol = input.find('\n');
+      if (eol == std::string::npos) {
+        if (input.size() > CommandParser::kMaxLineLength) {
+          disconnect(fd, "Command line too long");
+        }
+        break;
+      }
+      std::string line(input.data(), (eol > 0 && input.data()[eol - 1] == '\r') ? eol - 1 : eol);
+      input.consume(eol + 1);
+      auto resume = std::move(st->continuation);
+      st->continuation = nullptr;
+      resume(line);
+      continue;
+    }
+    CommandParser& parser = st->parser;
+    CommandParser::Status status = parser.parse(input.data(), input.size());
+    if (status == CommandParser::INCOMPLETE) {
+      break;
+    } else if (status == CommandParser::CONTINUE) {
+      if (parser.streamable()) {
+        // a streamed APPEND is checked before the client is told to go on
+        Command command = parser.command();
+        if (ciCompare(command.name(), "APPEND") != 0) {
+          parser.buffer();
+        } else {
+          bool accepted = STREAMING_APPEND(fd, command, parser.literalSize(), true);
+          if ((st = states.find(fd)) == nullptr) return;
+          st->input.consume(command.length());
+          st->parser.reset();
+          if (!accepted) continue;
+        }
+      }
+      respond(fd, "+", "", "Ready for literal data");
+      if (sendQueued(fd) != 0) {
+        disconnect(fd, "");
+        return;
+      }
+    } else if (status == CommandParser::STREAM) {
+      Command command = parser.command();
+      if (ciCompare(command.name(), "APPEND") != 0) {
+        parser.buffer();
+        continue;
+      }
+      STREAMING_APPEND(fd, command, parser.literalSize(), false);
+      if ((st = states.find(fd)) == nullptr) return;
+      st->input.consume(command.length());
+      st->parser.reset();
+    } else if (status == CommandParser::ERROR) {
+      BAD(fd, "*", parser.error());
+      input.consume(parser.skip());
+      parser.reset();
+    } else {
+      // the command is a view into input, so it is consumed after routing
+      Command command = parser.command();
+      route(fd, command);
+      if ((st = states.find(fd)) == nullptr) return;
+      st->input.consume(command.length());
+      st->parser.reset();
+    }
+  }
+  if (states.contains(fd) && sendQueued(fd) != 0) {
+    disconnect(fd, "");
   }
 }
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::disconnect(
   int fd, const std::string& reason) const {
+  Serving serving(*this, fd);
+  if (!states.contains(fd)) {
+    close(fd);
+    return;
+  }
   BOOST_LOG_TRIVIAL(debug) << " [UUID: " << states[fd].get_uuid() << "] Disconnected" << (reason == "" ? "" : ": " + reason);
   if (reason != "") {
-    BYE(fd, "*", reason);
+    respond(fd, "*", "BYE", reason + " " + states[fd].get_uuid());
   }
+  unwatch(fd);
+  // best effort: whatever the socket will not take now is dropped
+  sendQueued(fd);
   if (states[fd].tls != NULL) {
     tls_close(states[fd].tls);
     tls_free(states[fd].tls);
@@ -50,24 +186,43 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::disconnect(
 }
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::connect(int fd) const {
-  states.erase(fd);
+  Serving serving(*this, fd);
+  states.emplace(fd);
   if (config.secure) {
-    if (tls_accept_socket(tls, &states[fd].tls, fd) < 0) {
+    if (tls_accept(fd) < 0) {
       disconnect(fd, "TLS Negotiation Failed");
     } else {
-      int hndshk = tls_handshake(states[fd].tls);
-      struct timespec tim, tim2;
-      while(hndshk == TLS_WANT_POLLIN || hndshk == TLS_WANT_POLLOUT) {
-        usleep(1000);
-        hndshk = tls_handshake(states[fd].tls);
-      }
-      if (hndshk < 0) {
-        disconnect(fd, "TLS Negotiation Failed");
-      } else {
-        states[fd].starttls();
-      }
+      // greeted once the handshake is done
+      handshake(fd);
     }
+    return;
   }
+  greet(fd);
+}
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::handshake(int fd) const {
+  ClientStateModel<AuthP>& st = states[fd];
+  int hndshk = tls_handshake(st.tls);
+  if (hndshk == TLS_WANT_POLLIN || hndshk == TLS_WANT_POLLOUT) {
+    st.handshake = hndshk == TLS_WANT_POLLIN ? HANDSHAKE_READ : HANDSHAKE_WRITE;
+    return;
+  }
+  if (hndshk < 0) {
+    BOOST_LOG_TRIVIAL(debug) << " [UUID: " << st.get_uuid()
+                             << "] TLS Negotiation Failed: " << tls_error(st.tls);
+    // nothing can be said to the client over a half-made session
+    disconnect(fd, "");
+    return;
+  }
+  st.handshake = HANDSHAKE_DONE;
+  st.starttls();
+  if (config.secure) greet(fd);
+  // the client's first command may have come in with the end of the
+  // handshake, in which case fd will not be readable again for it
+  if (states.contains(fd)) (*this)(fd);
+}
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::greet(int fd) const {
   struct sockaddr_in addr;
   socklen_t addrlen = sizeof(addr);
   int getaddr = getpeername(fd, (struct sockaddr*)&addr, &addrlen);
@@ -75,158 +230,86 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::connect(int fd) const {
     BAD(fd, "*",
         "Welcome to IMAPlw. IMAP ready for requests from [error... Peer "
         "Address Not Found]");
+    if (sendQueued(fd) != 0) disconnect(fd, "");
     return;
   }
   std::string address(inet_ntoa(addr.sin_addr));
   BOOST_LOG_TRIVIAL(debug) << "New Connection from " << address
                            << " [UUID: " << states[fd].get_uuid() << "]";
   OK(fd, "*", "Welcome to IMAPlw. IMAP ready for requests from " + address);
+  if (sendQueued(fd) != 0) disconnect(fd, "");
 }
 template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::tls_setup() {
-  if (t_conf == NULL) {
-    const char* err = tls_config_error(t_conf);
-    if (err == NULL)
-      throw std::runtime_error("TLS Out of Memory Exception");
-    else
-      throw std::runtime_error(err);
-  }
-  tls = tls_server();
-  unsigned int protocols = 0;
-  if (tls_config_parse_protocols(&protocols, config.versions) < 0) {
-    BOOST_LOG_TRIVIAL(fatal) << "tls_config_parse_protocols error";
-  }
-  tls_config_set_protocols(t_conf, protocols);
-  if (tls_config_set_ciphers(t_conf, config.ciphers) < 0) {
-    BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_ciphers error";
-  }
-  if (tls_config_set_key_file(t_conf, config.keypath) < 0) {
-    BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_key_file error";
-  }
-  if (tls_config_set_cert_file(t_conf, config.certpath) < 0) {
-    BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_cert_file error";
-  }
-  if (tls_configure(tls, t_conf) < 0) {
-    BOOST_LOG_TRIVIAL(fatal) << "tls_configure error: %" << tls_error(tls);
-  }
-}
-template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::tls_cleanup() {
-  if (t_conf != NULL) {
-    tls_config_free(t_conf);
-  }
-  if (tls != NULL) {
-    tls_close(tls);
-    tls_free(tls);
-  }
+int IMAPProvider::IMAPProvider<AuthP, DataP>::tls_accept(int fd) const {
+  tls->poll();
+  ClientStateModel<AuthP>& st = states[fd];
+  st.tlsContext = tls->get();
+  return st.tlsContext->accept(fd, &st.tls);
 }
 
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::route(
-  int fd, const std::string& tag, const std::string& cmd,
-  const WordList& args) const {
-  std::string command(cmd);
-  std::transform(
-    command.begin(), command.end(), command.begin(),
-    ::toupper); // https://stackoverflow.com/questions/735204/convert-a-string-in-c-to-upper-case
-  // BOOST_LOG_TRIVIAL(trace) << states[fd].get_uuid() << " : " << command;
-  typedef decltype(&IMAPProvider::CAPABILITY) one;
-  typedef decltype(&IMAPProvider::AUTHENTICATE) two;
-  typedef decltype(&IMAPProvider::LOGIN) three;
-  typedef decltype(&IMAPProvider::APPEND) four;
-  typedef std::variant<one, two, three, four> variedFunc;
-
-  std::unordered_map<std::string, variedFunc> routeMap = {
-    {"CAPABILITY", &IMAPProvider::CAPABILITY},
-    {"NOOP", &IMAPProvider::NOOP},
-    {"LOGOUT", &IMAPProvider::LOGOUT},
-    {"STARTTLS", &IMAPProvider::STARTTLS},
-    {"AUTHENTICATE", &IMAPProvider::AUTHENTICATE},
-    {"LOGIN", &IMAPProvider::LOGIN},
-    {"SELECT", &IMAPProvider::SELECT},
-    {"EXAMINE", &IMAPProvider::EXAMINE},
-    {"CREATE", &IMAPProvider::CREATE},
-    {"DELETE", &IMAPProvider::DELETE},
-    {"RENAME", &IMAPProvider::RENAME},
-    {"SUBSCRIBE", &IMAPProvider::SUBSCRIBE},
-    {"UNSUBSCRIBE", &IMAPProvider::UNSUBSCRIBE},
-    {"LIST", &IMAPProvider::LIST},
-    {"LSUB", &IMAPProvider::LSUB},
-    {"STATUS", &IMAPProvider::STATUS},
-    {"APPEND", &IMAPProvider::APPEND},
-    {"CHECK", &IMAPProvider::CHECK},
-    {"CLOSE", &IMAPProvider::CLOSE},
-    {"UNSELECT", &IMAPProvider::UNSELECT},
-    {"EXPUNGE", &IMAPProvider::EXPUNGE},
-    {"SEARCH", &IMAPProvider::SEARCH},
-    {"FETCH", &IMAPProvider::FETCH},
-    {"STORE", &IMAPProvider::STORE},
-    {"COPY", &IMAPProvider::COPY},
-    {"UID", &IMAPProvider::UID},
-    {"COMPRESS", &IMAPProvider::COMPRESS}
+  int fd, const Command& args) const {
+  const std::string tag(args.tag());
+  const std::string_view cmd = args.name();
+  // Sorted by name for a case-insensitive binary search; built at compile time
+  static constexpr Route routes[] = {
+    {"APPEND",       AUTH,     2, &IMAPProvider::dispatch<&IMAPProvider::APPEND>},
+    {"AUTHENTICATE", UNENC,    1, &IMAPProvider::dispatch<&IMAPProvider::AUTHENTICATE>},
+    {"CAPABILITY",   UNENC,    0, &IMAPProvider::dispatch<&IMAPProvider::CAPABILITY>},
+    {"CHECK",        SELECTED, 0, &IMAPProvider::dispatch<&IMAPProvider::CHECK>},
+    {"CLOSE",        SELECTED, 0, &IMAPProvider::dispatch<&IMAPProvider::CLOSE>},
+    {"COMPRESS",     AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::COMPRESS>},
+    {"COPY",         SELECTED, 2, &IMAPProvider::dispatch<&IMAPProvider::COPY>},
+    {"CREATE",       AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::CREATE>},
+    {"DELETE",       AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::DELETE>},
+    {"EXAMINE",      AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::EXAMINE>},
+    {"EXPUNGE",      SELECTED, 0, &IMAPProvider::dispatch<&IMAPProvider::EXPUNGE>},
+    {"FETCH",        SELECTED, 2, &IMAPProvider::dispatch<&IMAPProvider::FETCH>},
+    {"IDLE",         AUTH,     0, &IMAPProvider::dispatch<&IMAPProvider::IDLE>},
+    {"LIST",         AUTH,     2, &IMAPProvider::dispatch<&IMAPProvider::LIST>},
+    {"LOGIN",        UNENC,    2, &IMAPProvider::dispatch<&IMAPProvider::LOGIN>},
+    {"LOGOUT",       UNENC,    0, &IMAPProvider::dispatch<&IMAPProvider::LOGOUT>},
+    {"LSUB",         AUTH,     2, &IMAPProvider::dispatch<&IMAPProvider::LSUB>},
+    {"NOOP",         UNENC,    0, &IMAPProvider::dispatch<&IMAPProvider::NOOP>},
+    {"RENAME",       AUTH,     2, &IMAPProvider::dispatch<&IMAPProvider::RENAME>},
+    {"SEARCH",       SELECTED, 1, &IMAPProvider::dispatch<&IMAPProvider::SEARCH>},
+    {"SELECT",       AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::SELECT>},
+    {"STARTTLS",     UNENC,    0, &IMAPProvider::dispatch<&IMAPProvider::STARTTLS>},
+    {"STATUS",       AUTH,     2, &IMAPProvider::dispatch<&IMAPProvider::STATUS>},
+    {"STORE",        SELECTED, 3, &IMAPProvider::dispatch<&IMAPProvider::STORE>},
+    {"SUBSCRIBE",    AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::SUBSCRIBE>},
+    {"UID",          SELECTED, 2, &IMAPProvider::UID},
+    {"UNSELECT",     SELECTED, 0, &IMAPProvider::dispatch<&IMAPProvider::UNSELECT>},
+    {"UNSUBSCRIBE",  AUTH,     1, &IMAPProvider::dispatch<&IMAPProvider::UNSUBSCRIBE>}
   };
-  std::unordered_map<std::string, IMAPState_t> routeMinState = {
-    {"CAPABILITY", UNENC}, {"NOOP", UNENC},         {"LOGOUT", UNENC},
-    {"STARTTLS", UNENC},   {"AUTHENTICATE", UNENC}, {"LOGIN", UNENC},
-    {"SELECT", AUTH},      {"EXAMINE", AUTH},       {"CREATE", AUTH},
-    {"DELETE", AUTH},      {"RENAME", AUTH},        {"SUBSCRIBE", AUTH},
-    {"UNSUBSCRIBE", AUTH}, {"LIST", AUTH},          {"LSUB", AUTH},
-    {"STATUS", AUTH},      {"APPEND", AUTH},        {"CHECK", SELECTED},
-    {"CLOSE", SELECTED},   {"UNSELECT", SELECTED},  {"EXPUNGE", SELECTED},
-    {"SEARCH", SELECTED},  {"FETCH", SELECTED},  {"STORE", SELECTED},
-    {"COPY", SELECTED},    {"UID", SELECTED}};
-  auto found = routeMap.find(command);
-  if (found != routeMap.end()) {
-    if (!found->second.valueless_by_exception()) {
-      auto ptr = &(found->second);
-      if (auto fnVal = std::get_if<one>(ptr)) {
-        auto fn = *fnVal;
-        if (states[fd].state() >= routeMinState[command]) {
-          (this->*fn)(fd, tag);
-        } else {
-          NO(fd, tag, "Command " + command + " Not Allowed At This Time.");
-        }
-      } else if (auto fnVal = std::get_if<two>(ptr)) {
-        auto fn = *fnVal;
-        if (states[fd].state() >= routeMinState[command]) {
-          (this->*fn)(fd, tag, args.rest(0));
-        } else {
-          NO(fd, tag, "Command " + command + " Not Allowed At This Time.");
-        }
-      } else if (auto fnVal = std::get_if<three>(ptr)) {
-        auto fn = *fnVal;
-        if (states[fd].state() >= routeMinState[command]) {
-          (this->*fn)(fd, tag, args[0], args.rest(1));
-        } else {
-          NO(fd, tag, "Command " + command + " Not Allowed At This Time.");
-        }
-      } else if (auto fnVal = std::get_if<four>(ptr)) {
-        auto fn = *fnVal;
-        if (states[fd].state() >= routeMinState[command]) {
-          (this->*fn)(fd, tag, args[0], args[1], args.rest(2));
-        } else {
-          NO(fd, tag, "Command " + command + " Not Allowed At This Time.");
-        }
-      } else {
-        throw std::runtime_error(
-                "Mapping command to function failed. This should never happen...");
-      }
-    }
-  } else {
+  static_assert([]() {
+    for (size_t i = 1; i < sizeof(routes) / sizeof(routes[0]); i++)
+      if (ciCompare(routes[i - 1].name, routes[i].name) >= 0) return false;
+    return true;
+  }(), "IMAP routes must be sorted by name");
+
+  const Route* found = std::lower_bound(
+    std::begin(routes), std::end(routes), cmd,
+    [](const Route& r, std::string_view c) { return ciCompare(r.name, c) < 0; });
+  if (found == std::end(routes) || ciCompare(found->name, cmd) != 0) {
     BOOST_LOG_TRIVIAL(debug)
             << "Command " << cmd << " Not Found [UUID: " << states[fd].get_uuid()
             << "]";
-    BAD(fd, tag, "Command " + cmd + " Not Found.");
-  }
-}
-template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::parse(
-  int fd, const std::string& message) const {
-  WordList args(message);
-  if (args.size() >= 2) {
-    route(fd, args[0], args[1], WordList(args.rest(2)));
+    BAD(fd, tag, "Command " + std::string(cmd) + " Not Found.");
+  } else if (states[fd].state() < found->minState) {
+    NO(fd, tag, "Command " + std::string(found->name) + " Not Allowed At This Time.");
+  } else if (args.size() < found->arity) {
+    BAD(fd, tag, "Command " + std::string(found->name) + " Missing Arguments.");
   } else {
-    BAD(fd, "*", "Unable to parse command \"" + message + "\"");
+    // EXPUNGE may not be sent during a command that takes sequence numbers
+    // (RFC 3501 7.4.1); changes then wait for the next command
+    static constexpr std::string_view holds[] = {"COPY", "FETCH", "SEARCH", "STORE", "UID"};
+    if (std::none_of(std::begin(holds), std::end(holds),
+                     [&](std::string_view h) { return h == found->name; }))
+      deliver(fd);
+    NotificationQueue::Running running(states[fd].notifications.get());
+    (this->*(found->handler))(fd, tag, args);
   }
 }
 
@@ -236,13 +319,13 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::CAPABILITY(
   int rfd, const std::string& tag) const {
   if (config.starttls && !config.secure && (states[rfd].state() == UNENC)) {
     respond(rfd, "*", "CAPABILITY",
-            "IMAP4rev1 UTF8=ONLY STARTTLS LOGINDISABLED", states[rfd].isCompressed());
+            "IMAP4rev1 LITERAL+ UTF8=ONLY STARTTLS LOGINDISABLED");
   } else if (states[rfd].state() == UNAUTH || states[rfd].state() == UNENC) {
     respond(rfd, "*", "CAPABILITY",
-            "IMAP4rev1 UTF8=ONLY " + AP.capabilityString,states[rfd].isCompressed());
+            "IMAP4rev1 LITERAL+ UTF8=ONLY " + AP.capabilityString);
   } else {
     respond(rfd, "*", "CAPABILITY",
-            "IMAP4rev1 UTF8=ONLY UNSELECT MOVE SPECIAL-USE",states[rfd].isCompressed());
+            "IMAP4rev1 LITERAL+ UTF8=ONLY IDLE UNSELECT MOVE SPECIAL-USE ESEARCH");
   }
   OK(rfd, tag, "CAPABILITY Success.");
 }
@@ -261,19 +344,19 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::STARTTLS(
   int rfd, const std::string& tag) const {
   if (config.starttls && !config.secure && (states[rfd].state() == UNENC)) {
     OK(rfd, tag, "Begin TLS Negotiation Now");
-    if (tls_accept_socket(tls, &states[rfd].tls, rfd) < 0) {
+    // Anything pipelined behind STARTTLS was sent in the clear; drop it
+    states[rfd].input.consume(states[rfd].input.size());
+    // the OK has to go out in the clear before the handshake starts
+    if (sendQueued(rfd) != 0 || !states[rfd].output.empty()) {
+      disconnect(rfd, "");
+      return;
+    }
+    if (tls_accept(rfd) < 0) {
       BAD(rfd, "*", "tls_accept_socket error");
     } else {
-      int hndshk = tls_handshake(states[rfd].tls);
-      while(hndshk == TLS_WANT_POLLIN || hndshk == TLS_WANT_POLLOUT) {
-        usleep(10000);
-        hndshk = tls_handshake(states[rfd].tls);
-      }
-      if (hndshk < 0) {
-        BAD(rfd, "*", "tls_handshake error");
-      } else {
-        states[rfd].starttls();
-      }
+      // nothing to do until the client's hello arrives; the handshake is
+      // driven from the event loop from then on
+      states[rfd].handshake = HANDSHAKE_READ;
     }
   } else {
     BAD(rfd, tag, "STARTTLS Disabled");
@@ -290,13 +373,12 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::AUTHENTICATE(
   std::transform(mechanism.begin(), mechanism.end(), mechanism.begin(),
                  ::toupper);
   if (mechanism == "PLAIN") {
-    respond(rfd, "+", "", "Go Ahead",states[rfd].isCompressed());
-    auto rec = receive(rfd);
-    int rcvd = rec.first;
-    std::string data = rec.second;
-    if (rcvd < 6) {
-      NO(rfd, tag, "Authentication Failed");
-    } else {
+    respond(rfd, "+", "", "Go Ahead");
+    states[rfd].await([this, rfd, tag](const std::string& data) {
+      if (data.length() < 6) {
+        NO(rfd, tag, "Authentication Failed");
+        return;
+      }
       std::string decoded_data = base64_decode(data);
       std::string nullSepStr = decoded_data.substr(1, std::string::npos);
       std::size_t seploc = nullSepStr.find('\0');
@@ -305,9 +387,9 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::AUTHENTICATE(
       } else {
         std::string username = nullSepStr.substr(0, seploc),
                     password = nullSepStr.substr(seploc + 1, std::string::npos);
-        if (states[rfd].authenticate(username, password)) {
+        if (states[rfd].authenticate(AP, username, password)) {
           respond(rfd, "*", "CAPABILITY",
-                  "IMAP4rev1 COMPRESS=DEFLATE UNSELECT MOVE SPECIAL-USE", states[rfd].isCompressed());
+                  "IMAP4rev1 LITERAL+ COMPRESS=DEFLATE IDLE UNSELECT MOVE SPECIAL-USE ESEARCH");
           OK(rfd, tag, "AUTHENTICATE Success. Welcome " + username);
         } else {
           BOOST_LOG_TRIVIAL(warning)
@@ -315,13 +397,12 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::AUTHENTICATE(
           NO(rfd, tag, "[AUTHENTICATIONFAILED] Invalid Credentials");
         }
       }
-    }
-
+    });
   } else
     try {
-      if (states[rfd].SASL(mechanism)) {
+      if (states[rfd].SASL(AP, mechanism)) {
         respond(rfd, "*", "CAPABILITY",
-                "IMAP4rev1 COMPRESS=DEFLATE UNSELECT MOVE SPECIAL-USE", states[rfd].isCompressed());
+                "IMAP4rev1 LITERAL+ COMPRESS=DEFLATE IDLE UNSELECT MOVE SPECIAL-USE ESEARCH");
         OK(rfd, tag, "AUTHENTICATE Success.");
       }
     } catch (const std::exception& excp) {
@@ -335,9 +416,9 @@ template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::LOGIN(
   int rfd, const std::string& tag, const std::string& username,
   const std::string& password) const {
-  if (states[rfd].authenticate(username, password)) {
+  if (states[rfd].authenticate(AP, username, password)) {
     respond(rfd, "*", "CAPABILITY",
-            "IMAP4rev1 COMPRESS=DEFLATE UNSELECT MOVE SPECIAL-USE", states[rfd].isCompressed());
+            "IMAP4rev1 LITERAL+ COMPRESS=DEFLATE IDLE UNSELECT MOVE SPECIAL-USE ESEARCH");
     OK(rfd, tag, "LOGIN Success.");
   } else {
     BOOST_LOG_TRIVIAL(warning)
@@ -349,14 +430,16 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::LOGIN(
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::SELECT(
   int rfd, const std::string& tag, const std::string& mailbox) const {
+  unwatch(rfd);
   states[rfd].select(mailbox);
-  auto onData = std::bind(newDataAvailable, rfd, states[rfd].isCompressed(), std::placeholders::_1);
-  states[rfd].isSubscribedToChanges =
-    DP.subscribe(states[rfd].getUser(), mailbox, onData);
+  watch(rfd);
   selectResp r = DP.select(states[rfd].getUser(), mailbox);
-  respond(rfd, "*", "FLAGS", r.flags, states[rfd].isCompressed());
-  respond(rfd, "*", std::to_string(r.exists), "EXISTS", states[rfd].isCompressed());
-  respond(rfd, "*", std::to_string(r.recent), "RECENT", states[rfd].isCompressed());
+  // whatever was posted until now is already counted in r
+  if (states[rfd].notifications) states[rfd].notifications->reset(r.exists);
+  states[rfd].exists = r.exists;
+  respond(rfd, "*", "FLAGS", (r.flags ? r.flags : FlagDictionary::standard())->flags());
+  respond(rfd, "*", std::to_string(r.exists), "EXISTS");
+  respond(rfd, "*", std::to_string(r.recent), "RECENT");
   OK(rfd, "*", "[UNSEEN " + std::to_string(r.unseen) + "]");
   OK(rfd, "*", "[PERMANENTFLAGS " + r.permanentFlags + "]");
   OK(rfd, "*", "[UIDNEXT " + std::to_string(r.uidnext) + "]");
@@ -367,11 +450,16 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::SELECT(
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::EXAMINE(
   int rfd, const std::string& tag, const std::string& mailbox) const {
+  unwatch(rfd);
   states[rfd].select(mailbox);
+  watch(rfd);
   selectResp r = DP.select(states[rfd].getUser(), mailbox);
-  respond(rfd, "*", "FLAGS", r.flags, states[rfd].isCompressed());
-  respond(rfd, "*", std::to_string(r.exists), "EXISTS", states[rfd].isCompressed());
-  respond(rfd, "*", std::to_string(r.recent), "RECENT", states[rfd].isCompressed());
+  // whatever was posted until now is already counted in r
+  if (states[rfd].notifications) states[rfd].notifications->reset(r.exists);
+  states[rfd].exists = r.exists;
+  respond(rfd, "*", "FLAGS", (r.flags ? r.flags : FlagDictionary::standard())->flags());
+  respond(rfd, "*", std::to_string(r.exists), "EXISTS");
+  respond(rfd, "*", std::to_string(r.recent), "RECENT");
   OK(rfd, "*", "[UNSEEN " + std::to_string(r.unseen) + "]");
   OK(rfd, "*", "[PERMANENTFLAGS " + r.permanentFlags + "]");
   OK(rfd, "*", "[UIDNEXT " + std::to_string(r.uidnext) + "]");
@@ -461,14 +549,8 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::LIST(
   auto joined = join(mboxPath, "/");
   DP.list(states[rfd].getUser(), joined, lres);
   if (lres.size() > 0) {
-    for (auto box : std::as_const(lres)) {
-      std::stringstream listres;
-      listres << "(";
-      for (auto flag : std::as_const(box.flags)) listres << flag << " ";
-      listres << "\b"
-              << ") "
-              << "\"/\"" << box.path;
-      respond(rfd, "*", "LIST", listres.str(), states[rfd].isCompressed());
+    for (const mailbox& box : lres) {
+      respond(rfd, "*", "LIST", box.flags.str() + " \"/\" " + enquote(box.path));
     }
     OK(rfd, tag, "LIST Success.");
   } else {
@@ -497,14 +579,8 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::LSUB(
   std::vector<mailbox> lres;
   DP.lsub(states[rfd].getUser(), join(mboxPath, "/"), lres);
   if (lres.size() > 0) {
-    for (auto box : std::as_const(lres)) {
-      std::stringstream listres;
-      listres << "(";
-      for (auto flag : std::as_const(box.flags)) listres << flag << " ";
-      listres << "\b"
-              << ") "
-              << "\"/\"" << box.path;
-      respond(rfd, "*", "LSUB", listres.str(), states[rfd].isCompressed());
+    for (const mailbox& box : lres) {
+      respond(rfd, "*", "LSUB", box.flags.str() + " \"/\" " + enquote(box.path));
     }
     OK(rfd, tag, "LSUB Success.");
   } else {
@@ -542,36 +618,102 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::STATUS(
       ret.seekp(-1, ret.cur);
     }
     ret << ")";
-    respond(rfd, "*", "STATUS", ret.str(), states[rfd].isCompressed());
+    respond(rfd, "*", "STATUS", ret.str());
     OK(rfd, tag, "STATUS Success.");
   } else {
     NO(rfd, tag, "STATUS Failed. No Status for that name.");
   }
 }
 
+// Splits APPEND's optional "(flags) \"date-time\"" arguments
+inline void parseAppendOptions(const std::string& options, std::vector<std::string>& flags,
+                        std::string& date) {
+  std::string rest(options);
+  size_t open = rest.find('('), close = rest.find(')');
+  if (open != std::string::npos && close != std::string::npos && open < close) {
+    std::istringstream list(rest.substr(open + 1, close - open - 1));
+    flags.assign(std::istream_iterator<std::string>(list), std::istream_iterator<std::string>());
+    rest.erase(0, close + 1);
+  }
+  std::istringstream dt(rest);
+  dt >> std::quoted(date);
+}
+
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::APPEND(
   int rfd, const std::string& tag, const std::string& mailbox,
-  const std::string& flags, const std::string& msgsize) const {
+  const std::string& options, const std::string& message) const {
+  std::vector<std::string> flags;
+  std::string date;
+  parseAppendOptions(options, flags, date);
   if (!DP.mailboxExists(states[rfd].getUser(), mailbox)) {
     NO(rfd, tag, "[TRYCREATE] APPEND Failed.");
+    return;
+  }
+  std::unique_ptr<AppendStream> stream =
+    DP.beginAppend(states[rfd].getUser(), mailbox, flags, date, message.length());
+  if (stream && stream->write(message.data(), message.length()) && stream->commit()) {
+    OK(rfd, tag, "APPEND Success.");
   } else {
-    respond(rfd, "+", "", "Go Ahead", states[rfd].isCompressed());
-    int rcvd = 0;
-    int msg_sz = 0;
-    sscanf(msgsize.c_str(), "{%d}", &msg_sz);
-    std::stringstream buffer;
-    for (int total_rcvd = 0; total_rcvd < msg_sz; total_rcvd += rcvd) {
-      auto rec = receive(rfd);
-      rcvd = rec.first;
-      buffer << rec.second;
+    NO(rfd, tag, appendFailure(rfd, mailbox, flags));
+  }
+}
+
+// APPEND whose message literal is too large to buffer: the literal is passed
+// to the backend's AppendStream chunk by chunk as it arrives, and the command
+// completes once its trailing CRLF has been read. A synchronizing literal has
+// not been asked for yet, so a refused one is answered with the tagged NO
+// straight away (and false returned) instead of being read and thrown away.
+template <class AuthP, class DataP>
+bool IMAPProvider::IMAPProvider<AuthP, DataP>::STREAMING_APPEND(
+  int rfd, const Command& args, size_t size, bool synchronizing) const {
+  const std::string tag(args.tag());
+  std::string error;
+  std::shared_ptr<AppendStream> stream;
+  std::string mailbox;
+  std::vector<std::string> flags;
+  if (states[rfd].state() < AUTH) {
+    error = "Command APPEND Not Allowed At This Time.";
+  } else if (args.size() < 1) {
+    error = "Command APPEND Missing Arguments.";
+  } else {
+    mailbox = args.str(0);
+    std::string date;
+    parseAppendOptions(std::string(args.rest(1)), flags, date);
+    if (!DP.mailboxExists(states[rfd].getUser(), mailbox)) {
+      error = "[TRYCREATE] APPEND Failed.";
+    } else {
+      stream = DP.beginAppend(states[rfd].getUser(), mailbox, flags, date, size);
+      if (!stream) error = appendFailure(rfd, mailbox, flags);
     }
-    std::string dat = buffer.str();
-    DP.append(states[rfd].getUser(), mailbox, dat);
-    OK(rfd, tag, "APPEND Success.");
   }
+  if (synchronizing && !error.empty()) {
+    NO(rfd, tag, error);
+    return false;
+  }
+  auto failed = std::make_shared<bool>(!error.empty());
+  states[rfd].stream(size,
+    [stream, failed](const char* data, size_t length) {
+      if (!*failed && !stream->write(data, length)) *failed = true;
+    },
+    [this, rfd, tag, error, stream, failed, mailbox, flags]() {
+      states[rfd].await([this, rfd, tag, error, stream, failed, mailbox,
+                         flags](const std::string& trailer) {
+        if (!trailer.empty()) {
+          BAD(rfd, tag, "APPEND Failed. Unexpected data after message.");
+        } else if (!error.empty()) {
+          NO(rfd, tag, error);
+        } else if (*failed || !stream->commit()) {
+          NO(rfd, tag, appendFailure(rfd, mailbox, flags));
+        } else {
+          OK(rfd, tag, "APPEND Success.");
+        }
+      });
+    });
+  return true;
 }
 
+
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::CHECK(
   int rfd, const std::string& tag) const {
@@ -581,6 +723,8 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::CHECK(
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::CLOSE(
   int rfd, const std::string& tag) const {
+  // CLOSE expunges silently
+  unwatch(rfd);
   std::vector<std::string> v;
   DP.expunge(states[rfd].getUser(), states[rfd].getMBox(), v);
   states[rfd].unselect();
@@ -589,6 +733,7 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::CLOSE(
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::UNSELECT(
   int rfd, const std::string& tag) const {
+  unwatch(rfd);
   states[rfd].unselect();
   OK(rfd, tag, "UNSELECT Success.");
 }
@@ -598,295 +743,417 @@ void IMAPProvider::IMAPProvider<AuthP, DataP>::EXPUNGE(
   int rfd, const std::string& tag) const {
   std::vector<std::string> expunged;
   DP.expunge(states[rfd].getUser(), states[rfd].getMBox(), expunged);
-  for (std::string uid : expunged) {
-    respond(rfd, "*", uid, "EXPUNGE", states[rfd].isCompressed());
+  if (states[rfd].notifications) {
+    // the backend posted these as events too; report them once, in order
+    // with any other changes
+    deliver(rfd);
+  } else {
+    for (std::string uid : expunged) {
+      respond(rfd, "*", uid, "EXPUNGE");
+    }
   }
   OK(rfd, tag, "EXPUNGE Success.");
 }
 
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::IDLE(
+  int rfd, const std::string& tag) const {
+  respond(rfd, "+", "", "idling");
+  deliver(rfd);
+  states[rfd].idling = true;
+  states[rfd].await([this, rfd, tag](const std::string& line) {
+    states[rfd].idling = false;
+    if (ciCompare(line, "DONE") == 0) {
+      OK(rfd, tag, "IDLE terminated.");
+    } else {
+      BAD(rfd, tag, "IDLE Expected DONE.");
+    }
+  });
+}
 
-std::string* search_query_r(std::string* query){
-  static const std::array<std::string,34> regex_query_items= {{
-    "ALL",
-    "ANSWERED",
-    "DELETED",
-    "FLAGGED",
-    "NEW",
-    "NOT",
-    "OR",
-    "OLD",
-    "RECENT",
-    "SEEN",
-    "UNANSWERED",
-    "UNDELETED",
-    "UNDRAFT",
-    "UNFLAGGED",
-    "UNSEEN",
-    "BCC .+?",
-    "CC .+?",
-    "FROM .+?",
-    "HEADER .+?",
-    "KEYWORD .+?",
-    "LARGER \\d+",
-    "ON .+?",
-    "SENTBEFORE .+?",
-    "SENTON .+?",
-    "SENTSINCE .+?",
-    "SINCE .+?",
-    "SMALLER \\d+",
-    "SUBJECT .+?",
-    "TEXT .+?",
-    "TO .+?",
-    "UID (?:\\d+-\\d+|(?:[\\d\\s]+)+)",
-    "UNKEYWORD .+?",
-    "\\d+[-:]\\d+",
-    "[\\d\\s]+"
-  }};
-  static const std::regex searchParse("^(" + join(regex_query_items, "|") + ")(?:\\s|^|$|\\r\\n|\\n)", std::regex::icase | std::regex::optimize);
-  thread_local std::string *cPtr;
-  if(query != NULL){
-    cPtr = query;
-  }else if(cPtr == NULL){
-    return NULL;
-  }else if(cPtr->length() == 0){
-    cPtr = NULL;
-    return NULL;
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::watch(int rfd) const {
+  ClientStateModel<AuthP>& st = states[rfd];
+  auto queue = std::make_shared<NotificationQueue>();
+  if (queue->fd() >= 0 && DP.subscribe(st.getUser(), st.getMBox(), queue))
+    st.notifications = std::move(queue);
+}
+
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::unwatch(int rfd) const {
+  ClientStateModel<AuthP>& st = states[rfd];
+  if (!st.notifications) return;
+  DP.unsubscribe(st.getUser(), st.getMBox(), st.notifications);
+  st.notifications.reset();
+}
+
+
+template <class AuthP, class DataP>
+void IMAPProvider::IMAPProvider<AuthP, DataP>::searchMessages(
+  int rfd, const std::string& tag, const std::string& query, bool byUID) const {
+  SearchParser parser;
+  SearchKey key;
+  if (!parser.parse(query, key)) {
+    if (parser.badCharset())
+      NO(rfd, tag, "[BADCHARSET (US-ASCII UTF-8)] SEARCH Failed.");
+    else
+      BAD(rfd, tag, "SEARCH Failed. Query Invalid.");
+    return;
   }
-  std::smatch m;
-  std::regex_search(*cPtr, m, searchParse);
-  if(m.size() == 2){
-    std::string* match = new std::string(m.str(1));
-    *cPtr = cPtr->substr(m.position()+m.length());
-    if(match->length() > 0 && *match != "\0")
-      return match;
-    else{
-      delete match;
-      return search_query_r(NULL);
-    }
+  BOOST_LOG_TRIVIAL(trace) << key.str();
+  SequenceSet found;
+  if(!DP.search(states[rfd].getUser(), states[rfd].getMBox(), key, found)){
+    NO(rfd, tag, "SEARCH Failed. Query Invalid.");
+    return;
+  }
+  if(byUID && !found.empty()){
+    // UIDs rise with sequence numbers, so they are added in order
+    const std::vector<uint32_t> uids = uidsOf(rfd);
+    SequenceSet matched;
+    for(uint32_t i : found)
+      if(i <= uids.size()) matched.add(uids[i - 1]);
+    found = std::move(matched);
+  }
+  OutputQueue& out = states[rfd].output;
+  if(parser.esearch()){
+    // RFC 4731: only what was asked for, with ALL as a compact sequence set
+    const unsigned options = parser.returnOptions();
+    std::string line = "* ESEARCH (TAG \"" + tag + "\")";
+    if(byUID) line += " UID";
+    if(!found.empty() && (options & SearchParser::RETURN_MIN))
+      line += " MIN " + std::to_string(found.min());
+    if(!found.empty() && (options & SearchParser::RETURN_MAX))
+      line += " MAX " + std::to_string(found.max());
+    if(options & SearchParser::RETURN_COUNT)
+      line += " COUNT " + std::to_string(found.count());
+    if(!found.empty() && (options & SearchParser::RETURN_ALL))
+      line += " ALL " + found.str();
+    out.write(line + "\r\n");
   }else{
-    return NULL;
+    // plain SEARCH has to list every number; format them straight into
+    // the output a chunk at a time
+    std::string line = "* SEARCH";
+    char num[16];
+    for(uint32_t i : found){
+      line += ' ';
+      line.append(num, std::to_chars(num, num + sizeof(num), i).ptr);
+      if(line.size() >= kSearchChunk){
+        out.write(line);
+        line.clear();
+      }
+    }
+    out.write(line + "\r\n");
   }
+  OK(rfd, tag, "SEARCH Success.");
 }
 
-template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::SEARCH(
-  int rfd, const std::string& tag, const std::string& query) const {
-  std::string qTmp(query);
-  std::vector<std::string> queryTerms;
-  for(std::string* nextToken = search_query_r(&qTmp); nextToken != NULL; nextToken = search_query_r(NULL)){
-    if(*nextToken == "NOT"){
-      std::string *sq1 = search_query_r(NULL);
-      if(sq1 != NULL){
-        *nextToken = *nextToken + " " + *sq1;
-      }else{
-        delete sq1;
-        delete nextToken;
-        BAD(rfd, tag, "NOT requires additional token");
-        return;
-      }
-    }else if(*nextToken == "OR"){
-      std::string *sq1 = search_query_r(NULL), *sq2 = search_query_r(NULL);
-      if(sq1 != NULL && sq2 != NULL){
-        *nextToken = *nextToken + " " + *sq1 + " " + *sq2;
-      }else{
-        delete sq1;
-        delete sq2;
-        delete nextToken;
-        BAD(rfd, tag, "OR requires additional two tokens");
-        return;
-      }
+
+// Splits a FETCH item list into items, keeping bracketed sections such as
+// BODY[HEADER.FIELDS (DATE FROM)]<0.100> together
+inline std::vector<std::string> fetchItems(const std::string& list) {
+  std::vector<std::string> items;
+  std::string cur;
+  int brackets = 0;
+  for (char c : list) {
+    if (c == '[') brackets++;
+    if (c == ']' && brackets > 0) brackets--;
+    if (c == ' ' && brackets == 0) {
+      if (!cur.empty()) items.push_back(std::move(cur));
+      cur.clear();
+    } else {
+      cur += (brackets == 0 ? std::toupper(static_cast<unsigned char>(c)) : c);
     }
-    queryTerms.push_back(std::move(*nextToken));
-  }
-  BOOST_LOG_TRIVIAL(trace) << join(queryTerms, ", ");
-  std::vector<int> ret;
-  if(DP.search(states[rfd].getUser(), states[rfd].getMBox(), queryTerms, ret)){
-    std::vector<std::string> ret_s;
-    std::transform(ret.begin(), ret.end(), std::back_inserter(ret_s), [](const int i){
-      return std::to_string(i);
-    });
-    std::string ranges = join(ret_s, " ");
-    respond(rfd, "*", "SEARCH", ranges, states[rfd].isCompressed());
-    OK(rfd,tag, "SEARCH Success.");
-  }else{
-    NO(rfd, tag, "SEARCH Failed. Query Invalid.");
   }
+  if (!cur.empty()) items.push_back(std::move(cur));
+  return items;
 }
 
+// The attributes a backend has to load to answer a FETCH item
+inline unsigned fetchAttributes(const std::string& item) {
+  if (item == "ALL") return IMAPProvider::FETCH_FLAGS | IMAPProvider::FETCH_INTERNALDATE |
+                            IMAPProvider::FETCH_SIZE | IMAPProvider::FETCH_ENVELOPE;
+  if (item == "FAST") return IMAPProvider::FETCH_FLAGS | IMAPProvider::FETCH_INTERNALDATE |
+                             IMAPProvider::FETCH_SIZE;
+  if (item == "FULL") return fetchAttributes("ALL") | IMAPProvider::FETCH_BODYSTRUCTURE;
+  if (item == "UID") return IMAPProvider::FETCH_UID;
+  if (item == "FLAGS") return IMAPProvider::FETCH_FLAGS;
+  if (item == "INTERNALDATE") return IMAPProvider::FETCH_INTERNALDATE;
+  if (item == "RFC822.SIZE") return IMAPProvider::FETCH_SIZE;
+  if (item == "ENVELOPE") return IMAPProvider::FETCH_ENVELOPE;
+  if (item == "BODY" || item == "BODYSTRUCTURE") return IMAPProvider::FETCH_BODYSTRUCTURE;
+  return IMAPProvider::FETCH_CONTENT;
+}
 
 template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::FETCH(
-  int rfd, const std::string& tag, const std::string& args) const {
-  static const std::regex fetchSyntax("(.*?) \\(?(.*?)\\)?$", std::regex::optimize);
+void IMAPProvider::IMAPProvider<AuthP, DataP>::fetchMessages(
+  int rfd, const std::string& tag, const std::string& args, bool byUID) const {
+  static const std::regex fetchSyntax("(\\S+) \\(?(.*?)\\)?$", std::regex::optimize);
+  static const std::regex bd_rx("BODY(.PEEK)?\\[(.*?)\\](?:\\<([0-9]+)\\.([0-9]+)\\>)?",
+                                std::regex::optimize);
   std::smatch m;
-  std::string fetchRequest(args);
-  if(std::regex_match(fetchRequest, m, fetchSyntax)){
-    std::string range(m.str(1));
-    int start,end;
-    std::size_t cloc = range.find(':');
-    if(cloc == std::string::npos || cloc == range.length() - 1){
-      start = stoi(range);
-      end   = stoi(range);
-    }else{
-      start = stoi(range.substr(0,cloc));
-      end   = stoi(range.substr(cloc+1));
+  SequenceSet range;
+  if(!std::regex_match(args, m, fetchSyntax) || !SequenceSet::parse(m.str(1), range)){
+    BAD(rfd, tag, "Bad FETCH format");
+    return;
+  }
+  const std::string& user = states[rfd].getUser();
+  const std::string& mbox = states[rfd].getMBox();
+  // Items are parsed once for the whole range, and the backend is told up
+  // front which attributes they need
+  std::vector<std::string> fetchTokens = fetchItems(m.str(2));
+  // UID FETCH reports the UID whether or not it was asked for
+  if(byUID && std::find(fetchTokens.begin(), fetchTokens.end(), "UID") == fetchTokens.end())
+    fetchTokens.push_back("UID");
+  unsigned attributes = FETCH_UID;
+  for(const std::string& item : fetchTokens) attributes |= fetchAttributes(item);
+  range = byUID ? sequenceOf(range, uidsOf(rfd)) : range.resolve(DP.messages(user, mbox));
+  // ENVELOPE/BODYSTRUCTURE/BODY come from the shared cache, then whatever
+  // the backend persisted, and are only computed from the message on a miss
+  const bool cached = attributes & (FETCH_ENVELOPE | FETCH_BODYSTRUCTURE);
+  const unsigned long uidvalidity = cached ? DP.uidvalid(user, mbox) : 0;
+  std::stringstream ss;
+  enum { READ_OK, READ_FAILED, READ_BROKEN } bodyRead = READ_OK;
+  auto format = [&](int i, Message& msg) -> bool {
+    MetadataKey key{user, mbox, uidvalidity, msg.uidNumber()};
+    unsigned known = 0;
+    if(cached){
+      MessageMetadata meta;
+      std::string stored;
+      if(metadata.get(key, meta)){
+        msg.metadata(meta);
+      }else if(DP.loadMetadata(user, mbox, key.uid, stored) &&
+               MessageMetadata::deserialize(stored, meta)){
+        msg.metadata(meta);
+        metadata.put(key, meta);
+      }
+      known = msg.metadata().known();
     }
-    std::string qry(m.str(2) + " ");
-    std::for_each(qry.begin(), qry.end(), [](char c){return std::toupper(static_cast<unsigned char>(c));});
-    static const std::regex splitSyntax("(?:.+?(?:\\[.*?\\])?(?:<.*?>)?)( )", std::regex::optimize);
-    std::vector<std::string> fetchTokens;
-    std::copy( std::sregex_token_iterator(qry.begin(), qry.end(), splitSyntax,0),
-               std::sregex_token_iterator(),
-               std::back_inserter(fetchTokens)
-              );
-    for(int i=start; i <= end; i++){
-      Message msg = DP.fetch(states[rfd].getUser(), states[rfd].getMBox(), i);
-      std::stringstream ss;
-      for(auto iter = fetchTokens.begin(); iter != fetchTokens.end(); iter++){
-        std::string bodyToken(*iter);
-        bodyToken.erase(std::find_if(bodyToken.rbegin(), bodyToken.rend(), [](int ch) {
-            return !std::isspace(ch);
-        }).base(), bodyToken.end());
-        if(ss.str().length() > 0) ss << " ";
-        if(bodyToken == "ALL"){
-          ss << "FLAGS "         << msg.flags()
-             << " INTERNALDATE " << msg.internalDate()
-             << " RFC822.SIZE "  << msg.size()
-             << " ENVELOPE "     << msg.envelope();
-        }else if(bodyToken == "FAST"){
-          ss << "FLAGS "         << msg.flags()
-             << " INTERNALDATE " << msg.internalDate()
-             << " RFC822.SIZE "  << msg.size();
-        }else if(bodyToken == "FULL"){
-          ss << "FLAGS "         << msg.flags()
-             << " INTERNALDATE " << msg.internalDate()
-             << " RFC822.SIZE "  << msg.size()
-             << " ENVELOPE "     << msg.envelope()
-             << " BODY"          << msg.body();
-        }else if(bodyToken == "BODY"){
-          ss << "BODY " <<  msg.body();
-        }else if(bodyToken == "BODYSTRUCTURE"){
-          ss << "BODYSTRUCTURE " <<  msg.bodyStructure();
-        }else if(bodyToken == "ENVELOPE"){
-          ss << "ENVELOPE " <<  msg.envelope();
-        }else if(bodyToken == "FLAGS"){
-          ss << "FLAGS " <<  msg.flags();
-        }else if(bodyToken == "INTERNALDATE"){
-          ss << "INTERNALDATE " <<  msg.internalDate();
-        }else if(bodyToken == "RFC822"){
-          std::string msgbody = msg.body("", 0);
-          ss << "RFC822 {" << msgbody.size() << "}" << std::endl  << msgbody;
-        }else if(bodyToken == "RFC822.HEADER"){
-          std::string msghdr = msg.body("HEADER", 0);
-          ss << "RFC822.HEADER {" << msghdr.size() << "}" << std::endl << msghdr;
-        }else if(bodyToken == "RFC822.SIZE"){
-          ss << "RFC822.SIZE " << msg.body("", 0).size();
-        }else if(bodyToken == "RFC822.TEXT"){
-          std::string msgtxt = msg.body("TEXT", 0);
-          ss << "RFC822.TEXT {" << msgtxt.size() << "}" << std::endl << msgtxt;
-        }else if(bodyToken == "UID"){
-          ss << "UID " << msg.uid() << std::endl;
-        }else{
-          const std::regex bd_rx("BODY(.PEEK)?\\[(.+?)\\](?:\\<([^.]+)\\.(.+)\\>)?");
-          std::smatch bd_match;
-          if(std::regex_match(bodyToken, bd_match, bd_rx)){
-
-            bool peek = (bd_match.str(1) == ".PEEK");
-            std::string parts = bd_match.str(2);
-            bool readrange = (bd_match.str(3) + bd_match.str(4)).length() >= 2;
-            int bstart = bd_match.str(3).length() ? stoi(bd_match.str(3)): 0;
-            int bend = bd_match.str(4).length() ? stoi(bd_match.str(4)): 0;
-            std::string msgbody = msg.body(parts, bstart);
-            if(bstart <= msgbody.length()){
-              bend = bend > msgbody.length() ? msgbody.length() : bend;
-              msgbody = msgbody.substr(bstart, bend-bstart);
-            }else{
-              msgbody = "NIL";
-            }
-            if(!peek){
-              std::vector<std::string> seen = {"\\Seen"};
-              DP.addFlags(states[rfd].getUser(), states[rfd].getMBox(), i, seen);
-            }
-            ss << "BODY[" << parts << "]";
-            if(readrange) ss << "<" << bstart << ">";
-            ss << " " << "{" << msgbody.length() << "}" << std::endl;
-            ss << msgbody;
-          }else{
-            ss << bodyToken << " NIL";
+    OutputQueue& out = states[rfd].output;
+    ss.str(std::string());
+    ss << "* " << i << " FETCH (";
+    // whether part of this response is already queued
+    bool started = false;
+    // Emits "{n}" and n bytes of a section (or the count bytes of it from
+    // start). Top-level sections come straight from the message's source:
+    // large ones are queued to be read as the socket drains, small ones are
+    // copied once. Anything else is materialized. A source that comes up
+    // short is caught before "{n}" is written and fails the FETCH.
+    auto literal = [&](const std::string& section, size_t start, size_t count) {
+      if(bodyRead != READ_OK) return;
+      size_t offset, length;
+      if(!msg.span(section, offset, length)){
+        std::string part = msg.body(section, 0);
+        if(start > 0 || count < part.length())
+          part = start < part.length() ? part.substr(start, count) : "";
+        ss << "{" << part.length() << "}\r\n" << part;
+        return;
+      }
+      start = std::min(start, length);
+      length = std::min(count, length - start);
+      offset += start;
+      std::shared_ptr<BodySource> src = msg.source();
+      if(length >= kStreamBody){
+        ss << "{" << length << "}\r\n";
+        out.write(ss.str());
+        ss.str(std::string());
+        out.stream(src, offset, length);
+        started = true;
+      }else if(src->data() != nullptr){
+        ss << "{" << length << "}\r\n";
+        ss.write(src->data() + offset, length);
+      }else{
+        std::string part(length, '\0');
+        size_t got = 0;
+        for(ssize_t n; got < length && (n = src->read(offset + got, &part[got], length - got)) > 0;)
+          got += n;
+        if(got < length){
+          BOOST_LOG_TRIVIAL(error) << "FETCH: message " << i << " in " << mbox
+                                   << " ended " << (length - got) << " bytes early";
+          bodyRead = started ? READ_BROKEN : READ_FAILED;
+          return;
+        }
+        ss << "{" << length << "}\r\n" << part;
+      }
+    };
+    bool first = true;
+    for(const std::string& bodyToken : fetchTokens){
+      if(!first) ss << " ";
+      first = false;
+      if(bodyToken == "ALL"){
+        ss << "FLAGS "         << msg.flags()
+           << " INTERNALDATE " << msg.internalDate()
+           << " RFC822.SIZE "  << msg.size()
+           << " ENVELOPE "     << msg.envelope();
+      }else if(bodyToken == "FAST"){
+        ss << "FLAGS "         << msg.flags()
+           << " INTERNALDATE " << msg.internalDate()
+           << " RFC822.SIZE "  << msg.size();
+      }else if(bodyToken == "FULL"){
+        ss << "FLAGS "         << msg.flags()
+           << " INTERNALDATE " << msg.internalDate()
+           << " RFC822.SIZE "  << msg.size()
+           << " ENVELOPE "     << msg.envelope()
+           << " BODY "         << msg.body();
+      }else if(bodyToken == "BODY"){
+        ss << "BODY " <<  msg.body();
+      }else if(bodyToken == "BODYSTRUCTURE"){
+        ss << "BODYSTRUCTURE " <<  msg.bodyStructure();
+      }else if(bodyToken == "ENVELOPE"){
+        ss << "ENVELOPE " <<  msg.envelope();
+      }else if(bodyToken == "FLAGS"){
+        ss << "FLAGS " <<  msg.flags();
+      }else if(bodyToken == "INTERNALDATE"){
+        ss << "INTERNALDATE " <<  msg.internalDate();
+      }else if(bodyToken == "RFC822"){
+        ss << "RFC822 ";
+        literal("", 0, Message::npos);
+      }else if(bodyToken == "RFC822.HEADER"){
+        ss << "RFC822.HEADER ";
+        literal("HEADER", 0, Message::npos);
+      }else if(bodyToken == "RFC822.SIZE"){
+        ss << "RFC822.SIZE " << msg.size();
+      }else if(bodyToken == "RFC822.TEXT"){
+        ss << "RFC822.TEXT ";
+        literal("TEXT", 0, Message::npos);
+      }else if(bodyToken == "UID"){
+        ss << "UID " << msg.uid();
+      }else{
+        std::smatch bd_match;
+        if(std::regex_match(bodyToken, bd_match, bd_rx)){
+          bool peek = (bd_match.str(1) == ".PEEK");
+          std::string parts = bd_match.str(2);
+          bool readrange = bd_match[3].matched;
+          size_t bstart = readrange ? std::stoul(bd_match.str(3)) : 0;
+          size_t blen = readrange ? std::stoul(bd_match.str(4)) : Message::npos;
+          if(!peek){
+            DP.addFlags(user, mbox, i, {"\\Seen"});
           }
+          ss << "BODY[" << parts << "]";
+          if(readrange) ss << "<" << bstart << ">";
+          ss << " ";
+          literal(parts, bstart, blen);
+        }else{
+          ss << bodyToken << " NIL";
         }
       }
-      std::string resp = "(" + ss.str() + ")";
-      respond(rfd, "*", std::to_string(i) + " FETCH", resp, states[rfd].isCompressed());
-      ss.str(std::string());
     }
+    if(bodyRead != READ_OK) return false;
+    ss << ")\r\n";
+    out.write(ss.str());
+    if(cached && msg.metadata().known() != known){
+      metadata.put(key, msg.metadata());
+      DP.storeMetadata(user, mbox, key.uid, msg.metadata().serialize());
+    }
+    return true;
+  };
+  if(DP.fetchRange(user, mbox, range, attributes, format)){
     OK(rfd, tag, "FETCH Success.");
+  }else if(bodyRead == READ_BROKEN){
+    // the client already has the start of a response that cannot be finished
+    disconnect(rfd, "FETCH body could not be read");
   }else{
-    BAD(rfd, tag, "Bad FETCH format");
+    NO(rfd, tag, "FETCH Failed.");
   }
-  
 }
 
 template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::STORE(
-  int rfd, const std::string& tag, const std::string& args) const {
-  static const std::regex storeParse("([0-9:]+?) (\\+|-)?FLAGS(\\.SILENT)? \\(?(.+?)\\)?");
+void IMAPProvider::IMAPProvider<AuthP, DataP>::storeMessages(
+  int rfd, const std::string& tag, const std::string& args, bool byUID) const {
+  static const std::regex storeParse("(\\S+) (\\+|-)?FLAGS(\\.SILENT)? (.+)",
+                                     std::regex::icase | std::regex::optimize);
   std::smatch m;
-  if(std::regex_match(args, m, storeParse)){
-    std::string range(m.str(1)), modifier(m.str(2)), silent(m.str(3)), flags(m.str(4));
-    const size_t rdelim = range.find_first_of(":");
-    int rst(stoi(range)), ren(stoi(rdelim == std::string::npos ? range : range.substr(rdelim)));
-    std::istringstream vfparser(flags);
-    std::vector<std::string> vflags{std::istream_iterator<std::string>(vfparser), std::istream_iterator<std::string>()};
-    auto storeAction = [this, dpr{std::cref(DP)}, modifier, tstate{std::cref(states[rfd])}, vflags{std::move(vflags)}](int i) -> bool{
-      auto fn =
-              modifier == "-" ? &DataModel::removeFlags :
-              modifier == "+" ? &DataModel::addFlags :
-              &DataModel::setFlags;
-      return (DP.*fn)(tstate.get().getUser(), tstate.get().getMBox(), i, vflags);
-    };
-    bool didcompleteallsucess = true;
-    for(int i = rst; i <= ren; i++)
-    if(storeAction(i)){
-
-    }else{
-      didcompleteallsucess = false;
-    }
-    
-    if(didcompleteallsucess){
+  SequenceSet range;
+  FlagSet flags;
+  if(!std::regex_match(args, m, storeParse) || !SequenceSet::parse(m.str(1), range) ||
+     !FlagSet::parse(m.str(4), flags)){
+    BAD(rfd,tag,"Bad STORE format");
+    return;
+  }
+  const StoreOp_t op = m.str(2) == "+" ? STORE_ADD : m.str(2) == "-" ? STORE_REMOVE : STORE_REPLACE;
+  const std::string& user = states[rfd].getUser();
+  const std::string& mbox = states[rfd].getMBox();
+  std::vector<uint32_t> uids;
+  if(byUID){
+    uids = uidsOf(rfd);
+    range = sequenceOf(range, uids);
+    // UIDs that match no message are not an error
+    if(range.empty()){
       OK(rfd, tag, "STORE Success.");
-    }else{
-      NO(rfd, tag, "Unable to complete all STORE transactions");
+      return;
     }
   }else{
-    BAD(rfd,tag,"Bad STORE format");
+    range = range.resolve(DP.messages(user, mbox));
+  }
+  OutputQueue& out = states[rfd].output;
+  DataModel::StoreCallback stored;
+  if(m.length(3) == 0){
+    stored = [&out, &uids](int i, const MessageFlags& now){
+      std::string line = "* " + std::to_string(i) + " FETCH (FLAGS " + now.str();
+      if(static_cast<size_t>(i) <= uids.size()) line += " UID " + std::to_string(uids[i - 1]);
+      out.write(line + ")\r\n");
+    };
+  }
+  if(DP.storeFlags(user, mbox, range, op, flags, stored)){
+    OK(rfd, tag, "STORE Success.");
+  }else if(!DP.keywordsFit(user, mbox, flags)){
+    NO(rfd, tag, "[LIMIT] STORE Failed. Too many keywords.");
+  }else{
+    NO(rfd, tag, "Unable to complete all STORE transactions");
   }
 }
 
 template <class AuthP, class DataP>
-void IMAPProvider::IMAPProvider<AuthP, DataP>::COPY(
-  int rfd, const std::string& tag, const std::string& sequence, const std::string& mailbox) const {
-  if (!DP.mailboxExists(states[rfd].getUser(), mailbox)){
+void IMAPProvider::IMAPProvider<AuthP, DataP>::copyMessages(
+  int rfd, const std::string& tag, const std::string& sequence, const std::string& mailbox,
+  bool byUID) const {
+  const std::string& user = states[rfd].getUser();
+  SequenceSet range;
+  if (!SequenceSet::parse(sequence, range)){
+    BAD(rfd, tag, "COPY Failed. Invalid sequence set.");
+  }else if (!DP.mailboxExists(user, mailbox)){
     NO(rfd, tag, "[TRYCREATE] COPY Failed.");
   }else{
-    const size_t rdelim = sequence.find_first_of(":");
-    int rst(stoi(sequence)), ren(stoi(rdelim == std::string::npos ? sequence : sequence.substr(rdelim)));
-
+    range = byUID ? sequenceOf(range, uidsOf(rfd))
+                  : range.resolve(DP.messages(user, states[rfd].getMBox()));
+    if (DP.copyRange(user, states[rfd].getMBox(), range, mailbox)){
+      OK(rfd, tag, "COPY Success.");
+    }else{
+      NO(rfd, tag, "COPY Failed.");
+    }
   }
 }
 
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::UID(
-  int rfd, const std::string& tag) const {
-
+  int rfd, const std::string& tag, const Command& args) const {
+  const std::string command = args.str(0);
+  if (ciCompare(command, "FETCH") == 0) {
+    fetchMessages(rfd, tag, remaining(args, 1), true);
+  } else if (ciCompare(command, "STORE") == 0) {
+    storeMessages(rfd, tag, remaining(args, 1), true);
+  } else if (ciCompare(command, "SEARCH") == 0) {
+    searchMessages(rfd, tag, remaining(args, 1), true);
+  } else if (ciCompare(command, "COPY") == 0 && args.size() >= 3) {
+    copyMessages(rfd, tag, args.str(1), remaining(args, 2), true);
+  } else {
+    BAD(rfd, tag, "UID Failed. Unknown or incomplete command.");
+  }
 }
 template <class AuthP, class DataP>
 void IMAPProvider::IMAPProvider<AuthP, DataP>::COMPRESS(
   int rfd, const std::string& tag, const std::string& type) const {
+  std::string mechanism(type);
+  std::transform(mechanism.begin(), mechanism.end(), mechanism.begin(),
+                 ::toupper);
   if(states[rfd].isCompressed()) {
-    BAD(rfd, tag, "[COMPRESSIONACTIVE] Compression already enabled.");
+    NO(rfd, tag, "[COMPRESSIONACTIVE] Compression already enabled.");
+  }else if(mechanism != "DEFLATE"){
+    BAD(rfd, tag, "COMPRESS Failed. Unknown compression mechanism.");
   }else{
+    // The tagged OK is the last uncompressed data sent on this connection
     OK(rfd, tag, "COMPRESS Success. Compression now active.");
-    states[rfd].isCompressed() = true;
+    if(!states[rfd].seal() || !states[rfd].compress()){
+      disconnect(rfd, "");
+    }
   }
 }
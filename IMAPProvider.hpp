@@ -18,14 +18,25 @@
 #include <map>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <utility>
 #include <boost/log/trivial.hpp>
+#include <atomic>
 #include <cerrno>
+#include <csignal>
+#include <mutex>
 
 #include "ClientStateModel.hpp"
 #include "ConfigModel.hpp"
+#include "ConnectionTable.hpp"
+#include "Flags.hpp"
 #include "Helpers.hpp"
+#include "CommandParser.hpp"
+#include "Listener.hpp"
+#include "MetadataCache.hpp"
+#include "TLSContext.hpp"
+#include "Waker.hpp"
 #include "WordList.hpp"
 
 
@@ -37,9 +48,12 @@ template <class AuthP, class DataP>
 class IMAPProvider : public Pollster::Handler {
  private:
   const ConfigModel& config;
-  static std::map<int, ClientStateModel<AuthP> > states;
-  struct tls* tls;
-  struct tls_config* t_conf = tls_config_new();
+  // This shard's connections; nothing else touches them
+  mutable ConnectionTable<ClientStateModel<AuthP> > states;
+  // Shared by every shard
+  static MetadataCache metadata;
+  // what new TLS connections are accepted with; null without TLS
+  std::shared_ptr<TLSContextSlot> tls;
   // ANY STATE
   void CAPABILITY(int rfd, const std::string& tag) const;
   void NOOP(int rfd, const std::string& tag) const {
@@ -65,127 +79,322 @@ class IMAPProvider : public Pollster::Handler {
             const std::string& name) const;
   void STATUS(int rfd, const std::string& tag, const std::string& mailbox,
               const std::string& datareq) const;
-  void APPEND(int rfd, const std::string& tag, const std::string& mailbox, const std::string& flags,
-              const std::string& msgsize) const;
+  void APPEND(int rfd, const std::string& tag, const std::string& mailbox, const std::string& options,
+              const std::string& message) const;
+  bool STREAMING_APPEND(int rfd, const Command& args, size_t size, bool synchronizing) const;
   // SELECTED
   void CHECK(int rfd, const std::string& tag) const;
   void CLOSE(int rfd, const std::string& tag) const;
   void UNSELECT(int rfd, const std::string& tag) const;
   void EXPUNGE(int rfd, const std::string& tag) const;
-  void SEARCH(int rfd, const std::string& tag, const std::string& query) const;
-  void FETCH(int rfd, const std::string& tag, const std::string& args) const;
-  void STORE(int rfd, const std::string& tag, const std::string& args) const;
-  void COPY(int rfd, const std::string& tag, const std::string& sequence, const std::string& mailbox) const;
-  void UID(int rfd, const std::string& tag) const;
+  void SEARCH(int rfd, const std::string& tag, const std::string& query) const {
+    searchMessages(rfd, tag, query, false);
+  }
+  void FETCH(int rfd, const std::string& tag, const std::string& args) const {
+    fetchMessages(rfd, tag, args, false);
+  }
+  void STORE(int rfd, const std::string& tag, const std::string& args) const {
+    storeMessages(rfd, tag, args, false);
+  }
+  void COPY(int rfd, const std::string& tag, const std::string& sequence,
+            const std::string& mailbox) const {
+    copyMessages(rfd, tag, sequence, mailbox, false);
+  }
+  void UID(int rfd, const std::string& tag, const Command& args) const;
   void COMPRESS(int rfd, const std::string& tag, const std::string& type) const;
 
-  static void newDataAvailable(int rfd, const bool compressed, const std::vector<std::string>& data) {
-    for (const std::string& d : data) respond(rfd, "*", "", d, compressed);
+  void IDLE(int rfd, const std::string& tag) const;
+
+  // SEARCH, FETCH, STORE and COPY, and their UID forms (byUID), which take
+  // and report UIDs instead of sequence numbers
+  void searchMessages(int rfd, const std::string& tag, const std::string& query, bool byUID) const;
+  void fetchMessages(int rfd, const std::string& tag, const std::string& args, bool byUID) const;
+  void storeMessages(int rfd, const std::string& tag, const std::string& args, bool byUID) const;
+  void copyMessages(int rfd, const std::string& tag, const std::string& sequence,
+                    const std::string& mailbox, bool byUID) const;
+  // NO text for an APPEND of flags to mailbox that failed; [LIMIT] when the
+  // mailbox has no room for its keywords
+  std::string appendFailure(int rfd, const std::string& mailbox,
+                            const std::vector<std::string>& flags) const {
+    return DP.keywordsFit(states[rfd].getUser(), mailbox, FlagSet::fromNames(flags))
+               ? "APPEND Failed."
+               : "[LIMIT] APPEND Failed. Too many keywords.";
+  }
+  // The UID of every message in the selected mailbox, in sequence order
+  std::vector<uint32_t> uidsOf(int rfd) const {
+    const std::string& user = states[rfd].getUser();
+    const std::string& mbox = states[rfd].getMBox();
+    std::shared_ptr<const MailboxColumns> cols = DP.columns(user, mbox);
+    if (cols) return cols->uid;
+    std::vector<uint32_t> uids;
+    int n = DP.messages(user, mbox);
+    if (n > 0)
+      DP.fetchRange(user, mbox, SequenceSet(1, n), FETCH_UID, [&](int, Message& msg) {
+        uids.push_back(msg.uidNumber());
+        return true;
+      });
+    return uids;
+  }
+  // The sequence numbers of the messages whose UIDs are in set, where '*'
+  // is the highest UID in use
+  static SequenceSet sequenceOf(const SequenceSet& set, const std::vector<uint32_t>& uids) {
+    SequenceSet out;
+    if (uids.empty()) return out;
+    const SequenceSet resolved = set.resolve(uids.back());
+    for (size_t i = 0; i < uids.size(); i++)
+      if (resolved.contains(uids[i])) out.add(i + 1);
+    return out;
   }
 
-  std::pair<size_t, const std::string> receive(int fd) const {
-    std::string data(8193, 0);
-    int rcvd;
-    if (states[fd].state() != UNENC) {
-      rcvd = tls_read(states[fd].tls, &data[0], 8912);
-      while(rcvd == TLS_WANT_POLLIN || rcvd == TLS_WANT_POLLOUT){
-        usleep(10000);
-        rcvd = tls_read(states[fd].tls, &data[0], 8912);
+  // Queues the untagged responses for whatever changes the backend has
+  // posted since the last call
+  void deliver(int rfd) const {
+    ClientStateModel<AuthP>& st = states[rfd];
+    if (!st.notifications) return;
+    PendingChanges changes = st.notifications->take();
+    if (changes.empty()) return;
+    std::string updates;
+    changes.write(updates);
+    st.exists = changes.exists;
+    BOOST_LOG_TRIVIAL(trace) << updates;
+    st.output.write(updates);
+    if (changes.resync && st.exists > 0) {
+      // too many changes to have kept track of: send every message's flags
+      DP.fetchRange(st.getUser(), st.getMBox(), SequenceSet(1, st.exists), FETCH_FLAGS,
+                    [&](int i, Message& msg) {
+                      st.output.write("* " + std::to_string(i) + " FETCH (FLAGS " +
+                                      msg.flags() + ")\r\n");
+                      return true;
+                    });
+    }
+  }
+  // Starts/stops taking change events for the selected mailbox
+  void watch(int rfd) const;
+  void unwatch(int rfd) const;
+
+  // Moves up to kReadBudget bytes of what is readable on fd into the
+  // connection's input buffer without blocking. Returns the number of bytes
+  // buffered (less than kReadBudget once the read would block) or -1 if the
+  // peer closed the connection, the read failed, or the input would grow
+  // past kMaxInput.
+  int receive(int fd) const {
+    ClientStateModel<AuthP>& st = states[fd];
+    char chunk[8192];
+    int total = 0;
+    while (static_cast<size_t>(total) < kReadBudget) {
+      ssize_t rcvd;
+      char* dst = st.isCompressed() ? chunk : st.input.prepare(sizeof(chunk));
+      if (st.tls != NULL) {
+        rcvd = tls_read(st.tls, dst, sizeof(chunk));
+        if (rcvd == TLS_WANT_POLLIN || rcvd == TLS_WANT_POLLOUT) break;
+      } else {
+        rcvd = recv(fd, dst, sizeof(chunk), MSG_DONTWAIT);
+        if (rcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (rcvd < 0 && errno == EINTR) continue;
       }
-    } else {
-      rcvd = recv(fd, &data[0], 8192, MSG_DONTWAIT);
-      while(rcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
-        usleep(10000);
-        rcvd = recv(fd, &data[0], 8192, MSG_DONTWAIT);
+      if (rcvd <= 0) return -1;
+      BOOST_LOG_TRIVIAL(trace) << "RECEIVED:" << std::string(dst, rcvd);
+      if (st.isCompressed()) {
+        std::string inflated;
+        if (!st.compressor().inflate(chunk, rcvd, inflated, kMaxInput - st.input.size())) return -1;
+        BOOST_LOG_TRIVIAL(trace) << "INFLATED:" << inflated;
+        st.input.append(inflated);
+        total += inflated.length();
+      } else {
+        st.input.commit(rcvd);
+        total += rcvd;
       }
-    }
-    data.resize(rcvd);
-    BOOST_LOG_TRIVIAL(trace) << "RECEIVED:" << data;
-    if(states[fd].isCompressed()){
-      std::string data2 = inflate(data).c_str();
-      if(data2 != ""){
-        data = data2;
+      if (st.input.size() > kMaxInput) {
+        BOOST_LOG_TRIVIAL(debug) << " [UUID: " << st.get_uuid() << "] Input over " << kMaxInput << " bytes";
+        return -1;
       }
-      BOOST_LOG_TRIVIAL(trace) << "INFLATED:" << data;
-      return {rcvd, data.c_str()};
-      
-
-    }else{
-      return {rcvd, data.c_str()};
     }
-    
+    return total;
   }
+  void process(int fd) const;
 
   // RESPONSES
-  static int respond(int rfd, const std::string& tag, const std::string& code,
-                             const std::string& message, bool compressed){
+  int respond(int rfd, const std::string& tag, const std::string& code,
+              const std::string& message) const {
     std::stringstream msg;
-    msg << tag << " " << code << " " << message << std::endl;
+    msg << tag << " " << code << " " << message << "\r\n";
     BOOST_LOG_TRIVIAL(trace) << msg.str();
-    std::string ret_str;
-    if(compressed){
-      ret_str = deflate(msg.str(), 6);
-    }else{
-      ret_str = msg.str();
-    }
-    if (states[rfd].tls == NULL) {
-      return sendMsg(rfd, ret_str);
-    } else {
-      return sendMsg(states[rfd].tls, rfd, ret_str);
-    }
+    states[rfd].output.write(msg.str());
+    return 0;
+  }
+  // Hands queued responses to the socket. Returns 0 when they were written
+  // or parked because the socket is full, otherwise an errno value.
+  int sendQueued(int rfd) const {
+    ClientStateModel<AuthP>& st = states[rfd];
+    int i;
+    // keep pulling from a streamed body for as long as the socket keeps up
+    do {
+      if(!st.seal()) return -1;
+      i = st.output.flush(rfd, st.tls);
+    } while(i == 0 && st.output.streaming() && st.output.drained());
+    BOOST_LOG_TRIVIAL(trace) << "FLUSH to socket " << rfd << " Returned:" << i << " " << (i > 0 ? strerror(i) : "")
+                             << " (" << st.output.size() << " bytes queued)";
+    return i;
   }
 
   void OK(int rfd, const std::string& tag, const std::string& message) const {
-    int i = respond(rfd, tag, "OK", message + " " + states[rfd].get_uuid(), states[rfd].isCompressed());
+    int i = respond(rfd, tag, "OK", message + " " + states[rfd].get_uuid());
     if(i != 0){
       disconnect(rfd, "");
     }
   }
   void NO(int rfd, const std::string& tag, const std::string& message) const {
-    int i = respond(rfd, tag, "NO", message + " " + states[rfd].get_uuid(), states[rfd].isCompressed());
+    int i = respond(rfd, tag, "NO", message + " " + states[rfd].get_uuid());
     if(i != 0){
       disconnect(rfd, "");
     }
   }
   void BAD(int rfd, const std::string& tag, const std::string& message) const {
-    int i = respond(rfd, tag, "BAD", message + " " + states[rfd].get_uuid(), states[rfd].isCompressed());
+    int i = respond(rfd, tag, "BAD", message + " " + states[rfd].get_uuid());
     if(i != 0){
       disconnect(rfd, "");
     }
   }
   void PREAUTH(int rfd, const std::string& tag, const std::string& message) const {
-    int i = respond(rfd, tag, "PREAUTH", message + " " + states[rfd].get_uuid(), states[rfd].isCompressed());
+    int i = respond(rfd, tag, "PREAUTH", message + " " + states[rfd].get_uuid());
     if(i != 0){
       disconnect(rfd, "");
     }
   }
   void BYE(int rfd, const std::string& tag, const std::string& message) const {
-    int i = respond(rfd, tag, "BYE", message + " " + states[rfd].get_uuid(), states[rfd].isCompressed());
+    int i = respond(rfd, tag, "BYE", message + " " + states[rfd].get_uuid());
     if(i != 0){
       disconnect(rfd, "");
     }
   }
-  void route(int fd, const std::string& tag, const std::string& command,
-             const WordList& args) const;
-  void parse(int fd, const std::string& message) const;
-  void tls_setup();
-  void tls_cleanup();
-  AuthenticationModel& AP = AuthenticationModel::getInst<AuthP>();
-  DataModel& DP = DataModel::getInst<DataP>();
+  // Every command handler is adapted to this one signature so the dispatch
+  // table in route() can be a constant array. A handler's last parameter
+  // gets the value of the last argument if it is a single token (quotes
+  // removed, literal contents) and the raw remaining text otherwise; APPEND's
+  // middle parameter gets everything between the mailbox and the message.
+  typedef void (IMAPProvider::*Handler)(int, const std::string&, const Command&) const;
+  typedef void (IMAPProvider::*Handler0)(int, const std::string&) const;
+  typedef void (IMAPProvider::*Handler1)(int, const std::string&, const std::string&) const;
+  typedef void (IMAPProvider::*Handler2)(int, const std::string&, const std::string&,
+                                         const std::string&) const;
+  typedef void (IMAPProvider::*Handler3)(int, const std::string&, const std::string&,
+                                         const std::string&, const std::string&) const;
+  struct Route {
+    std::string_view name;
+    IMAPState_t minState;
+    size_t arity;
+    Handler handler;
+  };
+  static std::string remaining(const Command& args, size_t from) {
+    return args.size() == from + 1 ? args.str(from) : std::string(args.rest(from));
+  }
+  template <auto Fn>
+  void dispatch(int fd, const std::string& tag, const Command& args) const {
+    if constexpr (std::is_same_v<decltype(Fn), Handler0>) {
+      (this->*Fn)(fd, tag);
+    } else if constexpr (std::is_same_v<decltype(Fn), Handler1>) {
+      (this->*Fn)(fd, tag, remaining(args, 0));
+    } else if constexpr (std::is_same_v<decltype(Fn), Handler2>) {
+      (this->*Fn)(fd, tag, args.str(0), remaining(args, 1));
+    } else {
+      static_assert(std::is_same_v<decltype(Fn), Handler3>,
+                    "Unsupported command handler signature");
+      (this->*Fn)(fd, tag, args.str(0), std::string(args.rest(1, args.size() - 1)),
+                  args.str(args.size() - 1));
+    }
+  }
+
+  // stop taking new commands from a client that is not reading its responses
+  static constexpr size_t kOutputHighWater = 1024 * 1024;
+  // bytes read from one connection before its commands are run
+  static constexpr size_t kReadBudget = 256 * 1024;
+  // the most a connection may have buffered: the largest literal the parser
+  // accepts, its command line and a read's worth past that
+  static constexpr size_t kMaxInput =
+      CommandParser::kMaxLiteral + CommandParser::kMaxLineLength + kReadBudget;
+  // FETCH literals at least this large are streamed from their BodySource
+  static constexpr size_t kStreamBody = 64 * 1024;
+  // plain SEARCH results are handed to the output queue in pieces this size
+  static constexpr size_t kSearchChunk = 64 * 1024;
+  void route(int fd, const Command& command) const;
+  // Takes fd's TLS handshake as far as the socket allows without blocking;
+  // the poller resumes it when fd is ready again. Once it completes, the
+  // connection is encrypted and (for implicit TLS) greeted.
+  void handshake(int fd) const;
+  void greet(int fd) const;
+  // Starts a TLS connection on fd with the current context
+  int tls_accept(int fd) const;
+  AuthenticationModel& AP;
+  DataModel& DP;
+
+  // Serializes the work done for one connection between SocketPool's
+  // threads and the Waker's. The locks are striped by fd rather than kept in
+  // the connection state, so they outlive the state disconnect() erases, and
+  // recursive, since handlers disconnect and handshakes read.
+  static constexpr size_t kServingStripes = 64;
+  mutable std::recursive_mutex serving[kServingStripes];
+  // Holds fd's lock for as long as it lives, then arms the Waker with
+  // whatever the connection is left waiting on
+  class Serving {
+   private:
+    const IMAPProvider& provider;
+    const int fd;
+    std::lock_guard<std::recursive_mutex> guard;
+
+   public:
+    Serving(const IMAPProvider& p, int f)
+        : provider(p), fd(f), guard(p.serving[static_cast<size_t>(f) % kServingStripes]) {}
+    ~Serving() { provider.rearm(fd); }
+  };
+  // SocketPool only reports fd as readable, so waiting for it to become
+  // writable again (parked output, a handshake that wants to write) and for
+  // an IDLE session's changes is left to the Waker
+  void rearm(int fd) const {
+    const ClientStateModel<AuthP>* st = states.find(fd);
+    if (st == nullptr) {
+      waker.disarm(fd);
+      return;
+    }
+    // outside IDLE, changes wait for the client's next command
+    waker.arm(fd, !st->output.empty() || st->handshake == HANDSHAKE_WRITE,
+              st->idling && st->notifications ? st->notifications->fd() : -1);
+  }
+  // constructed last and destroyed first, so its thread never sees a
+  // half-built or half-destroyed provider
+  mutable Waker waker;
 
  public:
-  explicit IMAPProvider(const ConfigModel& cfg) : config(cfg) {
-    static int ctr = 0;
+  explicit IMAPProvider(const ConfigModel& cfg)
+      : IMAPProvider(cfg, AuthenticationModel::getInst<AuthP>(), DataModel::getInst<DataP>()) {}
+  // One shard of a server that runs a provider per thread, each with its
+  // own listener (see listenSocket()), poller and connections. auth and
+  // data are shared by every shard, so they must be thread safe.
+  IMAPProvider(const ConfigModel& cfg, AuthenticationModel& auth, DataModel& data)
+      : config(cfg), AP(auth), DP(data), waker([this](int fd) { flush(fd); }) {
+    static std::atomic<int> ctr{0};
     BOOST_LOG_TRIVIAL(trace) << "New IMAPProvider Initialized (n: " << ++ctr << ", addr: " << this << ")";
-    if (cfg.secure || cfg.starttls) tls_setup();
+    // a peer resetting its connection must not take the process down;
+    // neither libtls nor sendfile() can be told not to raise SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+    if (cfg.secure || cfg.starttls) tls = std::make_shared<TLSContextSlot>(cfg.tls);
   }
   ~IMAPProvider() {
-    if(config.secure || config.starttls) tls_cleanup();
     BOOST_LOG_TRIVIAL(trace) << "IMAPlw (addr: " << this << ") is shutting down...";
   }
   void operator()(int fd) const;
+  // Sends whatever fd has parked, resumes its handshake and delivers its
+  // IDLE changes. The provider's Waker calls this when fd is ready for it;
+  // a poller that watches POLLOUT itself may call it too.
+  void flush(int fd) const;
   void disconnect(int fd, const std::string& reason) const;
   void connect(int fd) const;
+  // Rebuilds the TLS configuration in the background (re-reading the key
+  // and certificate files, or from next) and accepts new connections with
+  // it once it is ready; open connections keep theirs. Returns false
+  // without TLS or while a reload is already under way. A signal set up
+  // with TLSContext::reloadOn() does the same before the next accept.
+  bool reload() const { return tls && tls->reload(tls->get()->settings()); }
+  bool reload(const TLSOptions& next) const { return tls && tls->reload(next); }
 };
 }  // namespace IMAPProvider
 #include "IMAPProvider.cpp"
@@ -0,0 +1,85 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifndef __IMAP_LISTENER__
+#define __IMAP_LISTENER__
+
+namespace IMAPProvider {
+// Opens a non-blocking TCP socket listening on address:port (IPv4 or IPv6
+// literal; "" for every IPv4 address). With reusePort, any number of these
+// can listen on the same port and the kernel spreads new connections
+// across them (SO_REUSEPORT), so each shard's thread accepts for its own
+// IMAPProvider without sharing a listener. Returns the fd, or -1 with
+// errno set.
+inline int listenSocket(const std::string& address, uint16_t port, bool reusePort,
+                        int backlog = SOMAXCONN) {
+  sockaddr_storage addr = {};
+  socklen_t len;
+  if (address.find(':') != std::string::npos) {
+    sockaddr_in6* a = reinterpret_cast<sockaddr_in6*>(&addr);
+    a->sin6_family = AF_INET6;
+    a->sin6_port = htons(port);
+    if (inet_pton(AF_INET6, address.c_str(), &a->sin6_addr) != 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    len = sizeof(*a);
+  } else {
+    sockaddr_in* a = reinterpret_cast<sockaddr_in*>(&addr);
+    a->sin_family = AF_INET;
+    a->sin_port = htons(port);
+    if (address.empty()) {
+      a->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, address.c_str(), &a->sin_addr) != 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    len = sizeof(*a);
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  int on = 1;
+  bool ok = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0;
+#ifdef SO_REUSEPORT
+  if (ok && reusePort) ok = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+#else
+  if (reusePort) {
+    errno = ENOPROTOOPT;
+    ok = false;
+  }
+#endif
+  ok = ok && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0 &&
+       fcntl(fd, F_SETFD, FD_CLOEXEC) == 0 &&
+       bind(fd, reinterpret_cast<sockaddr*>(&addr), len) == 0 && listen(fd, backlog) == 0;
+  if (!ok) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,1199 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BodySource.hpp"
+#include "DataModel.hpp"
+#include "Helpers.hpp"
+#include "Message.hpp"
+#include "SearchIndex.hpp"
+#include "SequenceSet.hpp"
+
+#ifndef __IMAP_MAILDIR_MODEL__
+#define __IMAP_MAILDIR_MODEL__
+
+namespace IMAPProvider {
+// Reference DataModel that keeps each user's mail in a directory tree:
+//
+//   <root>/<user>/<mailbox>/.index        compact binary index (see below)
+//   <root>/<user>/<mailbox>/.attribs      mailbox attributes, one per line
+//   <root>/<user>/<mailbox>/.msgs/<uid>   one file per message, never changed
+//   <root>/<user>/<mailbox>/.msgs/<uid>.meta  cached ENVELOPE/BODYSTRUCTURE
+//   <root>/<user>/<mailbox>/.tmp/         APPENDs in progress (maildir-style)
+//   <root>/<user>/<mailbox>/<child>/      child mailboxes
+//   <root>/<user>/.subscriptions          LSUB list, one per line
+//
+// The index is an IndexHeader, the mailbox's keyword names ('\0'
+// separated), then one fixed-size IndexRecord per message in UID order, so
+// FLAGS/UID/INTERNALDATE/RFC822.SIZE and most of SEARCH never open a
+// message. It is kept in memory once a mailbox is first used; flag changes
+// rewrite a single record in place. Messages are served straight from mmap.
+//
+// Messages arrive in .tmp and are renamed into .msgs only once complete,
+// before the index records them, so a crash can lose an APPEND but never
+// index a partial message. Mailbox and path names beginning with '.' are
+// reserved and refused.
+//
+// Header and text SEARCH keys are narrowed with a TextIndex per mailbox,
+// built in memory on the first such search and kept current by APPEND and
+// EXPUNGE. Pass textIndex = false to the constructor to scan instead.
+//
+// getInst<MaildirModel>() stores mail under $IMAPLW_MAILDIR (default
+// "./mail"); subclass and pass a root to the constructor to choose another.
+class MaildirModel : public DataModel {
+ public:
+  // IndexRecord::flags uses the Flag_t bits, so it doubles as the SEARCH
+  // flags column
+  typedef enum : FlagBits {
+    SEEN = FLAG_SEEN,
+    ANSWERED = FLAG_ANSWERED,
+    FLAGGED = FLAG_FLAGGED,
+    DELETED = FLAG_DELETED,
+    DRAFT = FLAG_DRAFT,
+    RECENT = FLAG_RECENT
+  } SystemFlag_t;
+  // keywords take the remaining bits of IndexRecord::flags
+  static constexpr uint32_t kKeywordShift = IMAPProvider::kKeywordShift;
+  static constexpr size_t kMaxKeywords = IMAPProvider::kMaxKeywords;
+
+  struct IndexHeader {
+    char magic[4];
+    uint32_t uidvalidity;
+    uint32_t uidnext;
+    uint32_t keywordBytes;
+  };
+  struct IndexRecord {
+    uint32_t uid;
+    uint32_t reserved;  // zero
+    FlagBits flags;
+    uint64_t size;
+    int64_t date;  // internal date, seconds since the epoch
+    int64_t sent;  // sentDay() of the message's Date: header
+  };
+
+ private:
+  struct Box {
+    std::mutex lock;
+    bool loaded = false;
+    bool removed = false;
+    std::string dir;
+    IndexHeader header = {};
+    std::shared_ptr<const FlagDictionary> dict = FlagDictionary::standard();
+    std::vector<IndexRecord> records;
+    std::shared_ptr<const MailboxColumns> columns;  // dropped on every change
+    std::shared_ptr<TextIndex> text;  // built by the first content search
+    std::shared_ptr<ChangeBus::Topic> topic;  // sessions that selected it
+    uint64_t used = 0;  // when acquire() last handed it out; under boxesLock
+  };
+
+  class MaildirAppendStream;
+
+  const std::string root;
+  const bool useTextIndex;
+  std::mutex boxesLock;  // also guards .subscriptions
+  std::map<std::string, std::shared_ptr<Box> > boxes;
+  uint64_t clock = 0;  // counts acquire()s, for Box::used
+  // the last UIDVALIDITY handed out; a lock of its own, since create() runs
+  // with a Box locked and forget() takes Box locks under boxesLock
+  std::mutex validityLock;
+  uint32_t lastValidity = 0;
+
+  static constexpr char kMagic[4] = {'I', 'M', 'X', '1'};
+  // mailboxes kept in memory before the least recently used idle ones are
+  // dropped (and read back from disk when next used)
+  static constexpr size_t kMaxCachedBoxes = 1024;
+
+  static std::string defaultRoot() {
+    const char* env = std::getenv("IMAPLW_MAILDIR");
+    return env != nullptr && *env != '\0' ? env : "mail";
+  }
+
+  // Mailbox names are '/' separated; INBOX is case-insensitive
+  static bool canonical(const std::string& mailbox, std::string& out) {
+    out.clear();
+    size_t start = 0;
+    while (start <= mailbox.length()) {
+      size_t end = mailbox.find('/', start);
+      if (end == std::string::npos) end = mailbox.length();
+      std::string part = mailbox.substr(start, end - start);
+      start = end + 1;
+      if (part.empty()) continue;
+      if (part[0] == '.' || part.find('\0') != std::string::npos) return false;
+      if (out.empty() && ciCompare(part, "INBOX") == 0) part = "INBOX";
+      if (!out.empty()) out += '/';
+      out += part;
+    }
+    return !out.empty();
+  }
+  std::string userDir(const std::string& user) const {
+    if (user.empty() || user[0] == '.' || user.find('/') != std::string::npos)
+      return "";
+    return root + "/" + user;
+  }
+  std::string boxDir(const std::string& user, const std::string& mailbox) const {
+    std::string name, dir = userDir(user);
+    if (dir.empty() || !canonical(mailbox, name)) return "";
+    return dir + "/" + name;
+  }
+  static std::string messagePath(const std::string& dir, uint32_t uid) {
+    return dir + "/.msgs/" + std::to_string(uid);
+  }
+  static std::string messagePath(const Box& b, uint32_t uid) { return messagePath(b.dir, uid); }
+
+  static bool exists(const std::string& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0;
+  }
+  static bool mkdirs(const std::string& path) {
+    for (size_t p = path.find('/', 1);; p = path.find('/', p + 1)) {
+      std::string part = path.substr(0, p);
+      if (::mkdir(part.c_str(), 0700) != 0 && errno != EEXIST) return false;
+      if (p == std::string::npos) return true;
+    }
+  }
+  static bool removeTree(const std::string& path) {
+    DIR* d = ::opendir(path.c_str());
+    if (d == nullptr) return ::unlink(path.c_str()) == 0 || errno == ENOENT;
+    bool ok = true;
+    while (struct dirent* e = ::readdir(d)) {
+      if (std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0)
+        continue;
+      ok = removeTree(path + "/" + e->d_name) && ok;
+    }
+    ::closedir(d);
+    return ::rmdir(path.c_str()) == 0 && ok;
+  }
+  static bool writeAll(int fd, const void* data, size_t length, off_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+      ssize_t n = ::pwrite(fd, p, length, offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      length -= n;
+      offset += n;
+    }
+    return true;
+  }
+  // Copies the file at path into fd, and syncs it
+  static bool copyFile(const std::string& path, int fd) {
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    char chunk[64 * 1024];
+    off_t at = 0;
+    ssize_t n;
+    while ((n = ::read(in, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+      if (n < 0) continue;
+      if (!writeAll(fd, chunk, n, at)) break;
+      at += n;
+    }
+    ::close(in);
+    return n == 0 && ::fsync(fd) == 0;
+  }
+  // Writes path atomically: a temporary file, fsync, then rename over it
+  static bool replaceFile(const std::string& path, const std::string& data) {
+    std::string tmp = path + ".new";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, data.data(), data.length(), 0) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (ok && ::rename(tmp.c_str(), path.c_str()) == 0) return true;
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  static std::vector<std::string> readLines(const std::string& path) {
+    std::vector<std::string> lines;
+    std::ifstream in(path);
+    for (std::string line; std::getline(in, line);)
+      if (!line.empty()) lines.push_back(line);
+    return lines;
+  }
+
+  size_t recordOffset(const Box& b, size_t i) const {
+    return sizeof(IndexHeader) + b.header.keywordBytes + i * sizeof(IndexRecord);
+  }
+  bool load(Box& b) {
+    std::ifstream in(b.dir + "/.index", std::ios::binary);
+    if (!in) return false;
+    std::string data((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    b.columns.reset();
+    if (data.size() < sizeof(IndexHeader)) return false;
+    std::memcpy(&b.header, data.data(), sizeof(IndexHeader));
+    if (std::memcmp(b.header.magic, kMagic, 4) != 0 ||
+        data.size() < sizeof(IndexHeader) + b.header.keywordBytes)
+      return false;
+    std::vector<std::string> keywords;
+    const char* kw = data.data() + sizeof(IndexHeader);
+    for (size_t i = 0; i < b.header.keywordBytes;) {
+      keywords.emplace_back(kw + i);
+      i += keywords.back().length() + 1;
+    }
+    if (keywords.size() > kMaxKeywords) return false;
+    b.dict = std::make_shared<const FlagDictionary>(std::move(keywords));
+    size_t n = (data.size() - recordOffset(b, 0)) / sizeof(IndexRecord);
+    b.records.resize(n);
+    if (n > 0)
+      std::memcpy(b.records.data(), data.data() + recordOffset(b, 0),
+                  n * sizeof(IndexRecord));
+    b.loaded = true;
+    return true;
+  }
+  // Rewrites the whole index; used when its layout changes (expunge, new
+  // keyword). Everything else updates it in place. A new dictionary from
+  // toMask() becomes b's only once the index holding it is on disk.
+  bool writeIndex(Box& b, std::shared_ptr<const FlagDictionary> dict = nullptr) {
+    if (!dict) dict = b.dict;
+    b.columns.reset();
+    std::string kw;
+    for (const std::string& k : dict->keywords()) kw.append(k).push_back('\0');
+    IndexHeader header = b.header;
+    header.keywordBytes = kw.size();
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(IndexHeader));
+    data += kw;
+    data.append(reinterpret_cast<const char*>(b.records.data()),
+                b.records.size() * sizeof(IndexRecord));
+    if (!replaceFile(b.dir + "/.index", data)) return false;
+    b.header = header;
+    b.dict = std::move(dict);
+    return true;
+  }
+  bool writeRecord(Box& b, size_t i) {
+    b.columns.reset();
+    int fd = ::open((b.dir + "/.index").c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = writeAll(fd, &b.records[i], sizeof(IndexRecord), recordOffset(b, i));
+    ::close(fd);
+    return ok;
+  }
+  bool appendRecord(Box& b, const IndexRecord& r) {
+    b.columns.reset();
+    int fd = ::open((b.dir + "/.index").c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    const off_t end = recordOffset(b, b.records.size());
+    bool ok = writeAll(fd, &r, sizeof(IndexRecord), end) &&
+              writeAll(fd, &b.header, sizeof(IndexHeader), 0);
+    // a record written without its header would show up on the next load
+    if (!ok && ::ftruncate(fd, end) != 0) ok = false;
+    ::close(fd);
+    if (ok) b.records.push_back(r);
+    return ok;
+  }
+  // The clock, or one past the last value if that is not ahead yet, so a
+  // mailbox deleted (or renamed away) and made again within the same second
+  // never reuses a UIDVALIDITY
+  uint32_t nextValidity() {
+    std::lock_guard<std::mutex> g(validityLock);
+    lastValidity = std::max(static_cast<uint32_t>(std::time(nullptr)), lastValidity + 1);
+    return lastValidity;
+  }
+  bool create(Box& b) {
+    if (!mkdirs(b.dir + "/.msgs") || !mkdirs(b.dir + "/.tmp")) return false;
+    std::memcpy(b.header.magic, kMagic, 4);
+    b.header.uidvalidity = nextValidity();
+    b.header.uidnext = 1;
+    b.dict = FlagDictionary::standard();
+    b.records.clear();
+    if (!writeIndex(b)) return false;
+    b.loaded = true;
+    return true;
+  }
+
+  // Returns the mailbox locked by guard, or nullptr if it does not exist.
+  // INBOX always exists.
+  std::shared_ptr<Box> acquire(const std::string& user, const std::string& mailbox,
+                               std::unique_lock<std::mutex>& guard) {
+    std::string dir = boxDir(user, mailbox);
+    if (dir.empty()) return nullptr;
+    while (true) {
+      std::shared_ptr<Box> b;
+      {
+        std::lock_guard<std::mutex> g(boxesLock);
+        std::shared_ptr<Box>& slot = boxes[dir];
+        if (!slot) {
+          slot = std::make_shared<Box>();
+          slot->dir = dir;
+          slot->topic = changes().topic(user, dir.substr(userDir(user).length() + 1));
+        }
+        slot->used = ++clock;
+        b = slot;
+        if (boxes.size() > kMaxCachedBoxes) evict();
+      }
+      guard = std::unique_lock<std::mutex>(b->lock);
+      if (b->removed) continue;  // deleted or renamed meanwhile; look again
+      if (b->loaded || load(*b)) return b;
+      if (dir == userDir(user) + "/INBOX" && create(*b)) return b;
+      guard.unlock();
+      return nullptr;
+    }
+  }
+  // Drops the least recently used mailboxes that no one holds and no
+  // session has selected, until a quarter of the cache is free. Called with
+  // boxesLock held.
+  void evict() {
+    typedef std::map<std::string, std::shared_ptr<Box> >::iterator Slot;
+    std::vector<std::pair<uint64_t, Slot> > idle;
+    for (Slot it = boxes.begin(); it != boxes.end(); ++it)
+      if (it->second.use_count() == 1 && it->second->topic->empty())
+        idle.emplace_back(it->second->used, it);
+    size_t excess = boxes.size() - kMaxCachedBoxes * 3 / 4;
+    if (idle.size() > excess) {
+      std::nth_element(idle.begin(), idle.begin() + excess, idle.end(),
+                       [](const std::pair<uint64_t, Slot>& a, const std::pair<uint64_t, Slot>& b) {
+                         return a.first < b.first;
+                       });
+      idle.resize(excess);
+    }
+    for (auto& e : idle) {
+      const std::string path = e.second->first.substr(root.length() + 1);
+      const size_t slash = path.find('/');
+      changes().release(path.substr(0, slash), path.substr(slash + 1),
+                        std::move(e.second->second->topic));
+      boxes.erase(e.second);
+    }
+  }
+  // Drops cached state for dir and everything below it
+  void forget(const std::string& dir) {
+    std::lock_guard<std::mutex> g(boxesLock);
+    for (auto it = boxes.lower_bound(dir); it != boxes.end();) {
+      if (it->first.compare(0, dir.length(), dir) != 0) break;
+      if (it->first.length() > dir.length() && it->first[dir.length()] != '/') {
+        ++it;
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> bg(it->second->lock);
+        it->second->removed = true;
+      }
+      it = boxes.erase(it);
+    }
+  }
+
+  // Flags as bits, adding any new keywords to dict (a copy of a mailbox's
+  // dictionary, handed to writeIndex() once the change is made). Returns
+  // false if they would not fit.
+  static bool toMask(std::shared_ptr<const FlagDictionary>& dict, const FlagSet& flags,
+                     FlagBits& mask) {
+    std::shared_ptr<const FlagDictionary> grown = FlagDictionary::with(dict, flags);
+    if (!grown) return false;
+    dict = std::move(grown);
+    dict->bits(flags, mask);
+    mask &= ~RECENT;  // \Recent cannot be set by clients
+    return true;
+  }
+
+  // IMAP date-time, quoted, in UTC
+  static std::string formatDate(int64_t t) {
+    std::time_t tt = static_cast<std::time_t>(t);
+    struct tm tm;
+    gmtime_r(&tt, &tm);
+    char buf[40];
+    std::strftime(buf, sizeof(buf), "\"%d-%b-%Y %H:%M:%S +0000\"", &tm);
+    return buf;
+  }
+  // Parses an IMAP date-time (as given to APPEND); 0 if it is not one
+  static int64_t parseDate(const std::string& date) {
+    struct tm tm = {};
+    const char* rest = strptime(date.c_str(), "%d-%b-%Y %H:%M:%S", &tm);
+    if (rest == nullptr) return 0;
+    int64_t t = timegm(&tm);
+    while (*rest == ' ') rest++;
+    if ((rest[0] == '+' || rest[0] == '-') && std::strlen(rest) >= 5) {
+      int zone = std::atoi(rest + 1);
+      int64_t offset = (zone / 100) * 3600 + (zone % 100) * 60;
+      t += rest[0] == '+' ? -offset : offset;
+    }
+    return t;
+  }
+
+  // r of the mailbox in dir whose keywords are dict
+  static Message toMessage(const std::string& dir,
+                           const std::shared_ptr<const FlagDictionary>& dict,
+                           const IndexRecord& r, bool content) {
+    const MessageFlags flags(r.flags, dict);
+    if (!content) return Message(r.uid, formatDate(r.date), flags, r.size);
+    return Message(r.uid, formatDate(r.date), flags,
+                   std::make_shared<MmapBodySource>(messagePath(dir, r.uid)));
+  }
+
+  typedef bool (*FlagOp)(FlagBits& flags, FlagBits mask);
+  bool changeFlags(const std::string& user, const std::string& mailbox, int msgID,
+                   const FlagSet& flags, FlagOp op) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b || msgID < 1 || static_cast<size_t>(msgID) > b->records.size()) return false;
+    FlagBits mask;
+    std::shared_ptr<const FlagDictionary> dict = b->dict;
+    if (!toMask(dict, flags, mask)) return false;
+    const bool newKeyword = dict != b->dict;
+    IndexRecord& r = b->records[msgID - 1];
+    FlagBits before = r.flags;
+    op(r.flags, mask);
+    if (r.flags == before && !newKeyword) return true;
+    if (!(newKeyword ? writeIndex(*b, dict) : writeRecord(*b, msgID - 1))) {
+      r.flags = before;
+      b->columns.reset();
+      return false;
+    }
+    if (r.flags != before)
+      notify(*b, MailboxEvent::flagsChanged(msgID, MessageFlags(r.flags, b->dict)));
+    return true;
+  }
+
+  // Posts e to every session watching b. Called with b locked, so each
+  // session gets the events in the order the changes were made.
+  static void notify(Box& b, const MailboxEvent& e) { b.topic->publish(e); }
+  static void notifyCleared(Box& b, size_t count) {
+    for (size_t n = count; n > 0; n--) notify(b, MailboxEvent::expunge(n));
+  }
+
+  // Columns for SEARCH, rebuilt on the first search after any change
+  static std::shared_ptr<const MailboxColumns> columnsOf(Box& b) {
+    if (!b.columns) {
+      auto c = std::make_shared<MailboxColumns>();
+      c->reserve(b.records.size());
+      for (const IndexRecord& r : b.records) c->push(r.uid, r.flags, r.size, r.date, r.sent);
+      c->dict = b.dict;
+      b.columns = std::move(c);
+    }
+    return b.columns;
+  }
+  // Calls f with the header block and body of a message file
+  template <typename F>
+  static auto withContent(const std::string& path, F f) {
+    MmapBodySource src(path);
+    std::string_view all(src.data() == nullptr ? "" : src.data(), src.size());
+    size_t crlf = all.find("\r\n\r\n"), lf = all.find("\n\n");
+    size_t head = std::min(crlf == std::string_view::npos ? all.size() : crlf + 4,
+                           lf == std::string_view::npos ? all.size() : lf + 2);
+    return f(all.substr(0, head), all.substr(head));
+  }
+  static int64_t sentOf(const std::string& path) {
+    return withContent(path, [](std::string_view head, std::string_view) { return sentDay(head); });
+  }
+  static void indexFile(TextIndex& text, const Box& b, uint32_t uid) {
+    withContent(messagePath(b, uid), [&](std::string_view head, std::string_view body) {
+      text.add(uid, head, body);
+    });
+  }
+  // The mailbox's text index, building it (outside the mailbox lock) if
+  // this is the first content search
+  std::shared_ptr<TextIndex> textOf(const std::shared_ptr<Box>& b,
+                                    const MailboxColumns& cols) {
+    {
+      std::lock_guard<std::mutex> guard(b->lock);
+      if (b->text) return b->text;
+    }
+    auto text = std::make_shared<TextIndex>();
+    for (uint32_t uid : cols.uid) indexFile(*text, *b, uid);
+    std::lock_guard<std::mutex> guard(b->lock);
+    if (b->text) return b->text;
+    // catch up with APPENDs made while it was built
+    for (const IndexRecord& r : b->records)
+      if (r.uid > text->last()) indexFile(*text, *b, r.uid);
+    if (!b->removed) b->text = text;
+    return text;
+  }
+
+ protected:
+  explicit MaildirModel(const std::string& rootDir, bool textIndex = true)
+      : DataModel(), root(rootDir), useTextIndex(textIndex) {
+    mkdirs(root);
+  }
+
+ public:
+  MaildirModel() : MaildirModel(defaultRoot()) {}
+
+  selectResp select(const std::string& user, const std::string& mailbox) {
+    selectResp r = {};
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return r;
+    r.flags = b->dict;
+    r.permanentFlags = b->dict->permanentFlags();
+    r.exists = b->records.size();
+    bool changed = false;
+    for (size_t i = 0; i < b->records.size(); i++) {
+      IndexRecord& rec = b->records[i];
+      if (r.unseen == 0 && !(rec.flags & SEEN)) r.unseen = i + 1;
+      // \Recent is reported to the first session to see the message
+      if (rec.flags & RECENT) {
+        r.recent++;
+        rec.flags &= ~RECENT;
+        changed = true;
+      }
+    }
+    if (changed) writeIndex(*b);
+    r.uidnext = b->header.uidnext;
+    r.uidvalid = b->header.uidvalidity;
+    r.accessType = "[READ-WRITE]";
+    return r;
+  }
+  int messages(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    return b ? b->records.size() : 0;
+  }
+  int recent(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return 0;
+    return std::count_if(b->records.begin(), b->records.end(),
+                         [](const IndexRecord& r) { return r.flags & RECENT; });
+  }
+  unsigned long uidnext(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    return b ? b->header.uidnext : 0;
+  }
+  unsigned long uidvalid(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    return b ? b->header.uidvalidity : 0;
+  }
+  int unseen(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return 0;
+    return std::count_if(b->records.begin(), b->records.end(),
+                         [](const IndexRecord& r) { return !(r.flags & SEEN); });
+  }
+
+  bool createMbox(const std::string& user, const std::string& mailbox) {
+    std::string dir = boxDir(user, mailbox);
+    if (dir.empty() || exists(dir + "/.index")) return false;
+    forget(dir);
+    Box b;
+    b.dir = dir;
+    return create(b);
+  }
+  bool hasSubFolders(const std::string& user, const std::string& mailbox) {
+    std::string dir = boxDir(user, mailbox);
+    DIR* d = dir.empty() ? nullptr : ::opendir(dir.c_str());
+    if (d == nullptr) return false;
+    bool found = false;
+    while (struct dirent* e = ::readdir(d)) {
+      if (e->d_name[0] != '.' && exists(dir + "/" + e->d_name + "/.")) {
+        found = true;
+        break;
+      }
+    }
+    ::closedir(d);
+    return found;
+  }
+  bool hasAttrib(const std::string& user, const std::string& mailbox,
+                 const std::string& attrib) {
+    std::string dir = boxDir(user, mailbox);
+    if (dir.empty()) return false;
+    std::vector<std::string> attribs = readLines(dir + "/.attribs");
+    return std::any_of(attribs.begin(), attribs.end(), [&attrib](const std::string& a) {
+      return ciCompare(a, attrib) == 0;
+    });
+  }
+  bool addAttrib(const std::string& user, const std::string& mailbox,
+                 const std::string& attrib) {
+    std::string dir = boxDir(user, mailbox);
+    if (dir.empty() || attrib.find('\n') != std::string::npos) return false;
+    if (hasAttrib(user, mailbox, attrib)) return true;
+    std::vector<std::string> attribs = readLines(dir + "/.attribs");
+    attribs.push_back(attrib);
+    return replaceFile(dir + "/.attribs", join(attribs, "\n") + "\n");
+  }
+  bool rmFolder(const std::string& user, const std::string& mailbox) {
+    std::string dir = boxDir(user, mailbox);
+    if (dir.empty() || dir == userDir(user) + "/INBOX" || !exists(dir)) return false;
+    forget(dir);
+    return removeTree(dir);
+  }
+  bool clear(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return false;
+    for (const IndexRecord& r : b->records) {
+      ::unlink(messagePath(*b, r.uid).c_str());
+      ::unlink((messagePath(*b, r.uid) + ".meta").c_str());
+    }
+    notifyCleared(*b, b->records.size());
+    b->records.clear();
+    b->text.reset();
+    return writeIndex(*b);
+  }
+  bool rename(const std::string& user, const std::string& mailbox,
+              const std::string& name) {
+    std::string from = boxDir(user, mailbox), to = boxDir(user, name);
+    if (from.empty() || to.empty() || exists(to)) return false;
+    if (from == userDir(user) + "/INBOX") {
+      // RFC 3501: renaming INBOX moves its messages and leaves it empty
+      if (!createMbox(user, name)) return false;
+      {
+        std::unique_lock<std::mutex> g1, g2;
+        std::shared_ptr<Box> src = acquire(user, mailbox, g1);
+        std::shared_ptr<Box> dst = acquire(user, name, g2);
+        if (src && dst) {
+          size_t n = 0;
+          for (; n < src->records.size(); n++) {
+            IndexRecord moved = src->records[n];
+            moved.uid = dst->header.uidnext + n;
+            if (::rename(messagePath(*src, src->records[n].uid).c_str(),
+                         messagePath(*dst, moved.uid).c_str()) != 0)
+              break;
+            dst->records.push_back(moved);
+          }
+          const bool all = n == src->records.size();
+          if (all) {
+            dst->dict = src->dict;
+            dst->header.uidnext += n;
+          }
+          // INBOX is only emptied once the new mailbox's index holds it all
+          if (all && writeIndex(*dst)) {
+            for (const IndexRecord& r : src->records)
+              ::unlink((messagePath(*src, r.uid) + ".meta").c_str());
+            notifyCleared(*src, src->records.size());
+            src->records.clear();
+            src->text.reset();
+            dst->text.reset();
+            notify(*dst, MailboxEvent::exists(dst->records.size()));
+            return writeIndex(*src);
+          }
+          // put back whatever was moved; the new mailbox goes below
+          for (size_t i = 0; i < dst->records.size(); i++)
+            ::rename(messagePath(*dst, dst->records[i].uid).c_str(),
+                     messagePath(*src, src->records[i].uid).c_str());
+          dst->records.clear();
+        }
+      }
+      rmFolder(user, name);
+      return false;
+    }
+    size_t slash = to.rfind('/');
+    if (!mkdirs(to.substr(0, slash))) return false;
+    forget(from);
+    forget(to);
+    return ::rename(from.c_str(), to.c_str()) == 0;
+  }
+
+  bool addSub(const std::string& user, const std::string& mailbox) {
+    std::string name, dir = userDir(user);
+    if (dir.empty() || !canonical(mailbox, name)) return false;
+    std::lock_guard<std::mutex> g(boxesLock);
+    std::vector<std::string> subs = readLines(dir + "/.subscriptions");
+    if (std::find(subs.begin(), subs.end(), name) != subs.end()) return true;
+    subs.push_back(name);
+    return mkdirs(dir) && replaceFile(dir + "/.subscriptions", join(subs, "\n") + "\n");
+  }
+  bool rmSub(const std::string& user, const std::string& mailbox) {
+    std::string name, dir = userDir(user);
+    if (dir.empty() || !canonical(mailbox, name)) return false;
+    std::lock_guard<std::mutex> g(boxesLock);
+    std::vector<std::string> subs = readLines(dir + "/.subscriptions");
+    auto it = std::find(subs.begin(), subs.end(), name);
+    if (it == subs.end()) return false;
+    subs.erase(it);
+    return replaceFile(dir + "/.subscriptions", subs.empty() ? "" : join(subs, "\n") + "\n");
+  }
+
+  // LIST wildcard match: '*' matches anything, '%' anything but the
+  // hierarchy delimiter
+  static bool matches(const char* pattern, const char* name) {
+    for (; *pattern != '\0'; pattern++, name++) {
+      if (*pattern == '*' || *pattern == '%') {
+        for (const char* n = name;; n++) {
+          if (matches(pattern + 1, n)) return true;
+          if (*n == '\0' || (*pattern == '%' && *n == '/')) return false;
+        }
+      }
+      if (*name == '\0' ||
+          std::toupper(static_cast<unsigned char>(*pattern)) !=
+              std::toupper(static_cast<unsigned char>(*name)))
+        return false;
+    }
+    return *name == '\0';
+  }
+  void walk(const std::string& dir, const std::string& prefix,
+            std::vector<std::string>& names) const {
+    DIR* d = ::opendir(dir.c_str());
+    if (d == nullptr) return;
+    std::vector<std::string> children;
+    while (struct dirent* e = ::readdir(d))
+      if (e->d_name[0] != '.' && exists(dir + "/" + e->d_name + "/."))
+        children.push_back(e->d_name);
+    ::closedir(d);
+    std::sort(children.begin(), children.end());
+    for (const std::string& c : children) {
+      names.push_back(prefix + c);
+      walk(dir + "/" + c, prefix + c + "/", names);
+    }
+  }
+  struct mailbox describe(const std::string& user, const std::string& name) {
+    struct mailbox m;
+    m.path = name;
+    std::string dir = userDir(user) + "/" + name;
+    m.flags = MailboxFlags(readLines(dir + "/.attribs"));
+    if (!exists(dir + "/.index") && name != "INBOX") m.flags.add(MBOX_NOSELECT);
+    m.flags.add(hasSubFolders(user, name) ? MBOX_HASCHILDREN : MBOX_HASNOCHILDREN);
+    return m;
+  }
+  bool list(const std::string& user, const std::string& mailbox,
+            std::vector<struct mailbox>& lres) {
+    std::string dir = userDir(user);
+    if (dir.empty()) return false;
+    if (mailbox.empty()) {
+      // LIST "" "": just the hierarchy delimiter and root
+      lres.push_back({"", {"\\Noselect"}});
+      return true;
+    }
+    std::vector<std::string> names;
+    walk(dir, "", names);
+    if (std::find(names.begin(), names.end(), "INBOX") == names.end())
+      names.insert(names.begin(), "INBOX");
+    for (const std::string& n : names)
+      if (matches(mailbox.c_str(), n.c_str())) lres.push_back(describe(user, n));
+    return true;
+  }
+  bool lsub(const std::string& user, const std::string& mailbox,
+            std::vector<struct mailbox>& lres) {
+    std::string dir = userDir(user);
+    if (dir.empty()) return false;
+    std::vector<std::string> subs;
+    {
+      std::lock_guard<std::mutex> g(boxesLock);
+      subs = readLines(dir + "/.subscriptions");
+    }
+    for (const std::string& n : subs)
+      if (matches(mailbox.c_str(), n.c_str())) lres.push_back(describe(user, n));
+    return true;
+  }
+  bool mailboxExists(const std::string& user, const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    return acquire(user, mailbox, guard) != nullptr;
+  }
+
+  bool append(const std::string& user, const std::string& mailbox,
+              const std::string& messageData) {
+    std::unique_ptr<AppendStream> s =
+        beginAppend(user, mailbox, {}, "", messageData.length());
+    return s && s->write(messageData.data(), messageData.length()) && s->commit();
+  }
+  std::unique_ptr<AppendStream> beginAppend(const std::string& user,
+                                            const std::string& mailbox,
+                                            const std::vector<std::string>& flags,
+                                            const std::string& date, size_t size);
+
+  bool expunge(const std::string& user, const std::string& mailbox,
+               std::vector<std::string>& expunged) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return false;
+    std::vector<IndexRecord> kept;
+    std::vector<uint32_t> gone;
+    kept.reserve(b->records.size());
+    for (const IndexRecord& r : b->records) {
+      if (r.flags & DELETED) {
+        // each EXPUNGE renumbers the messages after it, so report the
+        // sequence number as it is at that point
+        expunged.push_back(std::to_string(kept.size() + 1));
+        gone.push_back(kept.size() + 1);
+        if (b->text) b->text->remove(r.uid);
+        ::unlink(messagePath(*b, r.uid).c_str());
+        ::unlink((messagePath(*b, r.uid) + ".meta").c_str());
+      } else {
+        kept.push_back(r);
+      }
+    }
+    if (kept.size() == b->records.size()) return true;
+    b->records.swap(kept);
+    for (uint32_t n : gone) notify(*b, MailboxEvent::expunge(n));
+    return writeIndex(*b);
+  }
+
+  // Message files never change, so each copy is a hard link (or, across
+  // filesystems, a copy of the file) made in the destination's .tmp. They
+  // all move into .msgs under one lock and one index write; if any of that
+  // fails, every one of them is taken back out.
+  bool copyRange(const std::string& user, const std::string& mailbox,
+                 const SequenceSet& messages, const std::string& destination) {
+    const std::string dir = boxDir(user, destination);
+    if (dir.empty() || !mailboxExists(user, destination)) return false;
+    struct Staged {
+      std::string path;
+      IndexRecord record;
+      FlagSet flags;
+    };
+    std::vector<Staged> staged;
+    auto discard = [&staged]() {
+      for (const Staged& s : staged)
+        if (!s.path.empty()) ::unlink(s.path.c_str());
+    };
+    std::vector<std::string> sources;
+    {
+      std::unique_lock<std::mutex> guard;
+      std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+      if (!b) return false;
+      for (uint32_t i : messages) {
+        if (i < 1 || i > b->records.size()) return false;
+        const IndexRecord& r = b->records[i - 1];
+        sources.push_back(messagePath(*b, r.uid));
+        staged.push_back(Staged{"", r, b->dict->set(r.flags & ~RECENT)});
+      }
+    }
+    for (size_t i = 0; i < staged.size(); i++) {
+      std::string tmp = dir + "/.tmp/copy.XXXXXX";
+      int fd = ::mkstemp(&tmp[0]);
+      if (fd < 0) {
+        discard();
+        return false;
+      }
+      staged[i].path = tmp;
+      // the link takes the place of the empty file mkstemp() reserved
+      const std::string linked = tmp + ".link";
+      bool ok = ::link(sources[i].c_str(), linked.c_str()) == 0 &&
+                ::rename(linked.c_str(), tmp.c_str()) == 0;
+      if (!ok) {
+        ::unlink(linked.c_str());
+        ok = copyFile(sources[i], fd);
+      }
+      ::close(fd);
+      if (!ok) {
+        discard();
+        return false;
+      }
+    }
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, destination, guard);
+    if (!b) {
+      discard();
+      return false;
+    }
+    const size_t count = b->records.size();
+    const IndexHeader header = b->header;
+    std::shared_ptr<const FlagDictionary> dict = b->dict;
+    bool ok = true;
+    for (Staged& s : staged) {
+      IndexRecord r = s.record;
+      if (!toMask(dict, s.flags, r.flags)) {
+        ok = false;
+        break;
+      }
+      r.flags |= RECENT;
+      r.uid = b->header.uidnext;
+      if (::rename(s.path.c_str(), messagePath(*b, r.uid).c_str()) != 0) {
+        ok = false;
+        break;
+      }
+      s.path.clear();
+      b->header.uidnext++;
+      b->records.push_back(r);
+    }
+    if (ok && writeIndex(*b, dict)) {
+      if (b->text)
+        for (size_t i = count; i < b->records.size(); i++) indexFile(*b->text, *b, b->records[i].uid);
+      notify(*b, MailboxEvent::exists(b->records.size()));
+      return true;
+    }
+    for (size_t i = count; i < b->records.size(); i++)
+      ::unlink(messagePath(*b, b->records[i].uid).c_str());
+    b->records.resize(count);
+    b->header = header;
+    b->columns.reset();
+    discard();
+    return false;
+  }
+
+  bool subscribe(const std::string& user, const std::string& mailbox,
+                 const std::shared_ptr<NotificationQueue>& queue) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return false;
+    b->topic->subscribe(queue);
+    return true;
+  }
+  void unsubscribe(const std::string& user, const std::string& mailbox,
+                   const std::shared_ptr<NotificationQueue>& queue) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b) return;
+    b->topic->unsubscribe(queue);
+  }
+
+  using DataModel::search;
+  bool search(const std::string& user, const std::string& mailbox,
+              const std::vector<std::string>& queries, std::vector<int>& messages) {
+    SearchKey key;
+    SequenceSet found;
+    if (!SearchParser().parse(join(queries, " "), key) ||
+        !search(user, mailbox, key, found))
+      return false;
+    messages.insert(messages.end(), found.begin(), found.end());
+    return true;
+  }
+  // Filters on a snapshot of the columns without holding the mailbox lock;
+  // only the rows left for header and text keys have their files mapped
+  bool search(const std::string& user, const std::string& mailbox,
+              const SearchKey& query, SequenceSet& messages) {
+    std::shared_ptr<const MailboxColumns> cols;
+    std::shared_ptr<Box> b;
+    {
+      std::unique_lock<std::mutex> guard;
+      b = acquire(user, mailbox, guard);
+      if (!b) return false;
+      cols = columnsOf(*b);
+    }
+    ContentMatcher matcher = [&](size_t row, const SearchKey& key) {
+      return withContent(messagePath(*b, cols->uid[row]),
+                         [&](std::string_view head, std::string_view body) {
+                           return matchesContent(key, head, body);
+                         });
+    };
+    std::shared_ptr<TextIndex> text;
+    if (useTextIndex && SearchIndex(*cols, matcher).needsContent(query)) text = textOf(b, *cols);
+    messages = SearchIndex(*cols, matcher, text.get()).evaluate(query).sequence();
+    return true;
+  }
+  std::shared_ptr<const MailboxColumns> columns(const std::string& user,
+                                                const std::string& mailbox) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    return b ? columnsOf(*b) : nullptr;
+  }
+
+  Message fetch(const std::string& user, const std::string& mailbox, int id) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    if (!b || id < 1 || static_cast<size_t>(id) > b->records.size())
+      return Message(0, "NIL", {}, size_t(0));
+    return toMessage(b->dir, b->dict, b->records[id - 1], true);
+  }
+  // One pass over the in-memory index. Only the records are copied under
+  // the lock; a message's file is mapped when the FETCH needs its content,
+  // just before its callback, so a long range keeps one file open at a time.
+  bool fetchRange(const std::string& user, const std::string& mailbox,
+                  const SequenceSet& messages, unsigned attributes,
+                  const FetchCallback& callback) {
+    std::vector<std::pair<uint32_t, IndexRecord> > batch;
+    std::shared_ptr<const FlagDictionary> dict;
+    std::string dir;
+    {
+      std::unique_lock<std::mutex> guard;
+      std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+      if (!b) return false;
+      for (uint32_t i : messages) {
+        if (i < 1 || i > b->records.size()) return false;
+        batch.emplace_back(i, b->records[i - 1]);
+      }
+      dict = b->dict;
+      dir = b->dir;
+    }
+    // callbacks may call back into the model (e.g. to set \Seen)
+    const bool content = attributes & FETCH_NEEDS_BODY;
+    for (const auto& r : batch) {
+      Message msg = toMessage(dir, dict, r.second, content);
+      if (!callback(r.first, msg)) return false;
+    }
+    return true;
+  }
+
+  bool loadMetadata(const std::string& user, const std::string& mailbox,
+                    long uid, std::string& serialized) {
+    std::string dir = boxDir(user, mailbox);
+    if (dir.empty()) return false;
+    std::ifstream in(dir + "/.msgs/" + std::to_string(uid) + ".meta", std::ios::binary);
+    if (!in) return false;
+    serialized.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+  }
+  bool storeMetadata(const std::string& user, const std::string& mailbox,
+                     long uid, const std::string& serialized) {
+    std::string dir = boxDir(user, mailbox);
+    std::string path = dir + "/.msgs/" + std::to_string(uid);
+    if (dir.empty() || !exists(path)) return false;
+    return replaceFile(path + ".meta", serialized);
+  }
+
+  bool setFlags(const std::string& user, const std::string& mailbox, int msgID,
+                const FlagSet& flags) {
+    return changeFlags(user, mailbox, msgID, flags, [](FlagBits& f, FlagBits m) {
+      f = (f & RECENT) | m;
+      return true;
+    });
+  }
+  bool addFlags(const std::string& user, const std::string& mailbox, int msgID,
+                const FlagSet& flags) {
+    return changeFlags(user, mailbox, msgID, flags, [](FlagBits& f, FlagBits m) {
+      f |= m;
+      return true;
+    });
+  }
+  bool removeFlags(const std::string& user, const std::string& mailbox, int msgID,
+                   const FlagSet& flags) {
+    return changeFlags(user, mailbox, msgID, flags, [](FlagBits& f, FlagBits m) {
+      f &= ~m;
+      return true;
+    });
+  }
+  bool keywordsFit(const std::string& user, const std::string& mailbox,
+                   const FlagSet& flags) {
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+    return !b || FlagDictionary::with(b->dict, flags) != nullptr;
+  }
+  // The whole STORE under one lock and at most one index write; if that
+  // write fails the in-memory flags are put back
+  bool storeFlags(const std::string& user, const std::string& mailbox,
+                  const SequenceSet& messages, StoreOp_t op, const FlagSet& flags,
+                  const StoreCallback& stored) {
+    std::vector<std::pair<uint32_t, MessageFlags> > report;
+    {
+      std::unique_lock<std::mutex> guard;
+      std::shared_ptr<Box> b = acquire(user, mailbox, guard);
+      if (!b || messages.min() < 1 || messages.max() > b->records.size()) return false;
+      FlagBits mask;
+      std::shared_ptr<const FlagDictionary> dict = b->dict;
+      if (!toMask(dict, flags, mask)) return false;
+      const bool newKeyword = dict != b->dict;
+      std::vector<std::pair<size_t, FlagBits> > undo;
+      for (uint32_t i : messages) {
+        FlagBits& f = b->records[i - 1].flags;
+        const FlagBits before = f;
+        if (op == STORE_REPLACE) f = (f & RECENT) | mask;
+        if (op == STORE_ADD) f |= mask;
+        if (op == STORE_REMOVE) f &= ~mask;
+        if (f != before) undo.emplace_back(i - 1, before);
+        if (stored) report.emplace_back(i, MessageFlags(f, dict));
+      }
+      bool ok = undo.empty() && !newKeyword ? true
+                : undo.size() == 1 && !newKeyword ? writeRecord(*b, undo[0].first)
+                : writeIndex(*b, dict);
+      if (!ok) {
+        for (const auto& u : undo) b->records[u.first].flags = u.second;
+        b->columns.reset();
+        return false;
+      }
+      for (const auto& u : undo)
+        notify(*b, MailboxEvent::flagsChanged(u.first + 1,
+                                              MessageFlags(b->records[u.first].flags, b->dict)));
+    }
+    for (const auto& r : report) stored(r.first, r.second);
+    return true;
+  }
+};
+
+// Writes the message straight into <mailbox>/.tmp and, on commit, moves it
+// into .msgs under the next UID and records it in the index
+class MaildirModel::MaildirAppendStream : public AppendStream {
+ private:
+  MaildirModel& model;
+  const std::string user;
+  const std::string mailbox;
+  std::vector<std::string> flags;
+  int64_t date;
+  std::string path;
+  int fd = -1;
+  uint64_t written = 0;
+
+ public:
+  MaildirAppendStream(MaildirModel& m, const std::string& u, const std::string& mb,
+                      const std::string& dir, const std::vector<std::string>& f,
+                      int64_t d)
+      : model(m), user(u), mailbox(mb), flags(f), date(d) {
+    std::string tmpl = dir + "/.tmp/append.XXXXXX";
+    fd = ::mkstemp(&tmpl[0]);
+    if (fd >= 0) path = tmpl;
+  }
+  ~MaildirAppendStream() {
+    if (fd >= 0) ::close(fd);
+    if (!path.empty()) ::unlink(path.c_str());
+  }
+  bool ok() const { return fd >= 0; }
+  bool write(const char* data, size_t length) {
+    if (fd < 0 || !writeAll(fd, data, length, written)) return false;
+    written += length;
+    return true;
+  }
+  bool commit() {
+    if (fd < 0 || ::fsync(fd) != 0) return false;
+    ::close(fd);
+    fd = -1;
+    const int64_t sent = sentOf(path);
+    std::unique_lock<std::mutex> guard;
+    std::shared_ptr<Box> b = model.acquire(user, mailbox, guard);
+    if (!b) return false;
+    IndexRecord r = {};
+    FlagSet set;
+    for (const std::string& f : flags)
+      if (!set.add(f)) return false;
+    std::shared_ptr<const FlagDictionary> dict = b->dict;
+    if (!toMask(dict, set, r.flags)) return false;
+    r.flags |= RECENT;
+    r.uid = b->header.uidnext;
+    r.size = written;
+    r.date = date;
+    r.sent = sent;
+    const std::string target = messagePath(*b, r.uid);
+    if (::rename(path.c_str(), target.c_str()) != 0) return false;
+    path.clear();
+    // uidnext and the record are only kept once the index has them
+    b->header.uidnext++;
+    bool ok;
+    if (dict != b->dict) {
+      b->records.push_back(r);
+      ok = model.writeIndex(*b, dict);
+      if (!ok) b->records.pop_back();
+    } else {
+      ok = model.appendRecord(*b, r);
+    }
+    if (!ok) {
+      b->header.uidnext--;
+      b->columns.reset();
+      ::unlink(target.c_str());
+      return false;
+    }
+    if (b->text) indexFile(*b->text, *b, r.uid);
+    notify(*b, MailboxEvent::exists(b->records.size()));
+    return true;
+  }
+};
+
+inline std::unique_ptr<AppendStream> MaildirModel::beginAppend(
+    const std::string& user, const std::string& mailbox,
+    const std::vector<std::string>& flags, const std::string& date, size_t /*size*/) {
+  std::string dir = boxDir(user, mailbox);
+  if (dir.empty() || !mailboxExists(user, mailbox)) return nullptr;
+  int64_t when = date.empty() ? 0 : parseDate(date);
+  if (when == 0) when = std::time(nullptr);
+  auto s = std::make_unique<MaildirAppendStream>(*this, user, mailbox, dir, flags, when);
+  if (!s->ok()) return nullptr;
+  return s;
+}
+}  // namespace IMAPProvider
+
+#endif
@@ -8,6 +8,9 @@
 #include <cctype>
 #include <regex>
 #include <initializer_list>
+#include <memory>
+#include "BodySource.hpp"
+#include "Flags.hpp"
 #include "Helpers.hpp"
 #include "infix_ostream_iterator.hpp"
 
@@ -30,34 +33,253 @@ const std::string mailboxToString(const mimetic::Mailbox& mbx);
 const std::string addrToString(const mimetic::Address& addr);
 const std::string fieldToString();
 const std::string mimeEntityToString(const mimetic::MimeEntity& me, bool extensions = true);
+const std::string envelopeToString(const mimetic::Header& header);
+
+//The parts of a FETCH response that are derived from an (immutable) message
+//and are worth keeping: ENVELOPE, BODYSTRUCTURE and BODY. Empty means not
+//computed yet. serialize() gives a compact form a backend can store next to
+//the message.
+struct MessageMetadata{
+	std::string envelope;
+	std::string bodyStructure;
+	std::string body;
+	//bitmask of the fields that are filled in
+	unsigned known() const{
+		return (envelope.empty() ? 0 : 1) | (bodyStructure.empty() ? 0 : 2) | (body.empty() ? 0 : 4);
+	}
+	//fills in whatever other knows that this does not
+	void merge(const MessageMetadata& other){
+		if(envelope.empty()) envelope = other.envelope;
+		if(bodyStructure.empty()) bodyStructure = other.bodyStructure;
+		if(body.empty()) body = other.body;
+	}
+	size_t bytes() const{return envelope.size() + bodyStructure.size() + body.size();}
+	//version byte, then each field as a varint length and its bytes
+	std::string serialize() const{
+		std::string out(1, kVersion);
+		out.reserve(bytes() + 16);
+		for(const std::string* f : {&envelope, &bodyStructure, &body}){
+			size_t n = f->size();
+			do{
+				out += static_cast<char>((n & 0x7f) | (n > 0x7f ? 0x80 : 0));
+				n >>= 7;
+			}while(n > 0);
+			out += *f;
+		}
+		return out;
+	}
+	static bool deserialize(const std::string& in, MessageMetadata& out){
+		if(in.empty() || in[0] != kVersion) return false;
+		size_t pos = 1;
+		MessageMetadata m;
+		for(std::string* f : {&m.envelope, &m.bodyStructure, &m.body}){
+			size_t n = 0;
+			for(int shift = 0;; shift += 7){
+				if(pos >= in.size() || shift > 56) return false;
+				unsigned char c = in[pos++];
+				n |= static_cast<size_t>(c & 0x7f) << shift;
+				if(!(c & 0x80)) break;
+			}
+			if(in.size() - pos < n) return false;
+			f->assign(in, pos, n);
+			pos += n;
+		}
+		out = std::move(m);
+		return true;
+	}
+	static constexpr char kVersion = 1;
+};
 //Message class
+//
+//Materialized lazily: uid, date, flags and size are plain metadata, the raw
+//message is only loaded when content is asked for, the header block is
+//parsed on its own for ENVELOPE and HEADER.FIELDS, and the full MIME tree is
+//only built for BODYSTRUCTURE and numbered sections. Whole-message, HEADER
+//and TEXT sections can be streamed straight from source() without loading
+//the message at all.
 class Message{
+public:
+	typedef std::function<std::string()> Loader;
+	static constexpr size_t npos = static_cast<size_t>(-1);
 private:
-	mimetic::MimeEntity __message__;
 	const long __uid__;
 	const std::string __date__;
-	std::vector<std::string> __flags__;
+	MessageFlags __flags__;
+	mutable size_t __size__;
+	mutable Loader __loader__;
+	mutable std::shared_ptr<BodySource> __source__;
+	mutable std::shared_ptr<const std::string> __raw__;
+	mutable std::string __head__;
+	mutable size_t __header_len__ = npos;
+	mutable std::shared_ptr<const mimetic::MimeEntity> __header__;
+	mutable std::shared_ptr<const mimetic::MimeEntity> __message__;
+	mutable MessageMetadata __meta__;
+	static std::string slurp(std::istream& body){
+		return std::string(std::istreambuf_iterator<char>(body), std::istreambuf_iterator<char>());
+	}
+	const std::string& raw() const;
+	const std::string& head() const;
+	size_t headerLength() const;
+	const mimetic::MimeEntity& headers() const;
+	const mimetic::MimeEntity& mime() const;
 public:
-	explicit Message(std::istream& body, const long uid, const std::string& date, const std::vector<std::string>& flags)
-	: __message__(body), __uid__(uid), __date__(date), __flags__(flags)
+	//flags may also be given as a list of names, e.g. {"\\Seen"}
+	explicit Message(std::istream& body, const long uid, const std::string& date, const MessageFlags& flags)
+	: __uid__(uid), __date__(date), __flags__(flags), __size__(npos),
+	  __raw__(std::make_shared<const std::string>(slurp(body)))
+	{}
+	//Metadata only; loader (if any) is called the first time content is needed
+	explicit Message(const long uid, const std::string& date, const MessageFlags& flags, size_t size = npos, Loader loader = Loader())
+	: __uid__(uid), __date__(date), __flags__(flags), __size__(size), __loader__(std::move(loader))
 	{}
-	explicit Message(std::istream& body, const long uid, const std::string& date, std::initializer_list<std::string> flags)
-	: __message__(body), __uid__(uid), __date__(date), __flags__(flags)
+	//Content read on demand from wherever the backend keeps it
+	explicit Message(const long uid, const std::string& date, const MessageFlags& flags, std::shared_ptr<BodySource> source)
+	: __uid__(uid), __date__(date), __flags__(flags), __size__(source ? source->size() : 0), __source__(std::move(source))
 	{}
-	const std::string body() const{return mimeEntityToString(__message__, false);}
+	const std::string body() const{
+		if(__meta__.body.empty()) __meta__.body = mimeEntityToString(mime(), false);
+		return __meta__.body;
+	}
 	const std::string body(const std::string& section, int origin) const;
-	const std::string bodyStructure() const{return mimeEntityToString(__message__, true);}
-	const std::string envelope() const;
-	const std::string flags() const {return "(" + join(__flags__, " ") + ")";}
+	const std::string bodyStructure() const{
+		if(__meta__.bodyStructure.empty()) __meta__.bodyStructure = mimeEntityToString(mime(), true);
+		return __meta__.bodyStructure;
+	}
+	const std::string envelope() const{
+		if(__meta__.envelope.empty()) __meta__.envelope = envelopeToString(headers().header());
+		return __meta__.envelope;
+	}
+	//Whatever of ENVELOPE/BODYSTRUCTURE/BODY has been computed (or attached)
+	const MessageMetadata& metadata() const {return __meta__;}
+	//Attaches previously computed (e.g. cached) metadata
+	void metadata(const MessageMetadata& meta){__meta__.merge(meta);}
+	//The raw message as a BodySource (shared, not copied, if already loaded)
+	std::shared_ptr<BodySource> source() const;
+	//Where a top-level section ("", "HEADER" or "TEXT") lies in source().
+	//Returns false for sections that need the MIME tree.
+	bool span(const std::string& section, size_t& offset, size_t& length) const;
+	const std::string flags() const {return __flags__.str();}
+	std::vector<std::string> flagList() const {return __flags__.names();}
+	const MessageFlags& flagBits() const {return __flags__;}
 	const std::string internalDate() const {return __date__;}
-	const std::string size() const {return std::to_string(__message__.size());}
+	const std::string size() const {return std::to_string(__size__ != npos ? __size__ : raw().length());}
 	const std::string uid() const {return std::to_string(__uid__);}
-	void print(std::ostream& s){ s << __message__; }
+	long uidNumber() const {return __uid__;}
+	void print(std::ostream& s){ s << raw(); }
 
 };
 
-const std::string Message::envelope() const{
-	const mimetic::Header& header = __message__.header();
+const std::string& Message::raw() const{
+	if(!__raw__){
+		std::string r;
+		if(__source__){
+			r.resize(__source__->size());
+			size_t got = 0;
+			while(got < r.size()){
+				ssize_t n = __source__->read(got, &r[got], r.size() - got);
+				if(n <= 0) break;
+				got += n;
+			}
+			r.resize(got);
+		}else if(__loader__){
+			r = __loader__();
+			__loader__ = Loader();
+		}
+		__raw__ = std::make_shared<const std::string>(std::move(r));
+	}
+	return *__raw__;
+}
+
+std::shared_ptr<BodySource> Message::source() const{
+	if(!__source__){
+		raw();
+		__source__ = std::make_shared<StringBodySource>(__raw__);
+	}
+	return __source__;
+}
+
+//The header block, including the blank line that ends it. Read from the
+//source a piece at a time so the body is never touched.
+const std::string& Message::head() const{
+	if(__header_len__ != npos) return __head__;
+	if(__raw__ || !__source__){
+		const std::string& r = raw();
+		size_t crlf = r.find("\r\n\r\n"), lf = r.find("\n\n");
+		if(crlf != std::string::npos && (lf == std::string::npos || crlf < lf)){
+			__header_len__ = crlf + 4;
+		}else if(lf != std::string::npos){
+			__header_len__ = lf + 2;
+		}else{
+			__header_len__ = r.length();
+		}
+		__head__ = r.substr(0, __header_len__);
+		return __head__;
+	}
+	char buf[4096];
+	size_t scanned = 0;
+	while(true){
+		ssize_t n = __source__->read(__head__.size(), buf, sizeof(buf));
+		if(n <= 0) break;
+		__head__.append(buf, n);
+		//resume a little early so a terminator split across reads is found
+		size_t from = scanned > 3 ? scanned - 3 : 0;
+		size_t crlf = __head__.find("\r\n\r\n", from), lf = __head__.find("\n\n", from);
+		if(crlf != std::string::npos && (lf == std::string::npos || crlf < lf)){
+			__head__.resize(crlf + 4);
+			break;
+		}else if(lf != std::string::npos){
+			__head__.resize(lf + 2);
+			break;
+		}
+		scanned = __head__.size();
+	}
+	__header_len__ = __head__.size();
+	return __head__;
+}
+
+size_t Message::headerLength() const{
+	head();
+	return __header_len__;
+}
+
+bool Message::span(const std::string& section, size_t& offset, size_t& length) const{
+	static const std::regex topLevel("^(HEADER|TEXT)?$", std::regex_constants::icase);
+	std::smatch m;
+	if(!std::regex_match(section, m, topLevel)) return false;
+	size_t total = source()->size();
+	if(m[1].length() == 0){
+		offset = 0;
+		length = total;
+	}else if(std::toupper(static_cast<unsigned char>(section[0])) == 'H'){
+		offset = 0;
+		length = std::min(headerLength(), total);
+	}else{
+		offset = std::min(headerLength(), total);
+		length = total - offset;
+	}
+	return true;
+}
+
+//The top-level header, parsed without touching the body
+const mimetic::MimeEntity& Message::headers() const{
+	if(__message__) return *__message__;
+	if(!__header__){
+		const std::string& h = head();
+		__header__ = std::make_shared<const mimetic::MimeEntity>(h.cbegin(), h.cend());
+	}
+	return *__header__;
+}
+
+const mimetic::MimeEntity& Message::mime() const{
+	if(!__message__){
+		const std::string& r = raw();
+		__message__ = std::make_shared<const mimetic::MimeEntity>(r.cbegin(), r.cend());
+		__header__.reset();
+	}
+	return *__message__;
+}
+
+const std::string envelopeToString(const mimetic::Header& header){
 	auto getField = std::bind(fieldElseNil,header,std::placeholders::_1);
 	std::stringstream message_stream;
 	std::ostream_iterator<std::string> endpoint(message_stream, "");
@@ -124,8 +346,18 @@ const std::string Message::envelope() const{
 
 const std::string Message::body(const std::string& section, int origin) const{
 	std::stringstream sec(section);
-	const mimetic::MimeEntity* msgitm = &__message__;
 	char c = sec.peek();
+	//Top-level sections are served from the raw message and the header alone
+	if(c == EOF || !std::isdigit(*reinterpret_cast<unsigned char*>(&c))){
+		static const std::regex headerOnly("^(HEADER|TEXT)?$", std::regex_constants::icase);
+		std::smatch whole;
+		if(std::regex_match(section, whole, headerOnly)){
+			if(whole[1].length() == 0) return raw();
+			if(std::toupper(static_cast<unsigned char>(section[0])) == 'H') return head();
+			return raw().substr(headerLength());
+		}
+	}
+	const mimetic::MimeEntity* msgitm = c == EOF || !std::isdigit(*reinterpret_cast<unsigned char*>(&c)) ? &headers() : &mime();
 	std::string itm;
 	bool nil = false;
 	while(c != EOF && std::isdigit(*reinterpret_cast<unsigned char*>(&c))){
@@ -333,12 +565,6 @@ const std::string mimeEntityToString(const mimetic::MimeEntity& me, bool extensi
 			struc << " NIL";
 		}
 
-		if(header.contentId().str() != ""){
-			struc << " " << enquote(header.contentId().str());
-		}else{
-			struc << " NIL";
-		}
-
 		if(header.contentId().str() != ""){
 			struc << " " << enquote(header.contentId().str());
 		}else{
@@ -358,23 +584,24 @@ const std::string mimeEntityToString(const mimetic::MimeEntity& me, bool extensi
 		}
 		struc << " " << me.size();
 
+		//lines are counted in the body as it is, not a re-serialized copy
 		if(type == "TEXT"){
-			std::stringstream part;
-			part << me;
-			std::istreambuf_iterator<char> start(part), end;
-			int lines = std::count(start, end, '\n');
-			struc << " " << lines + 1;
-			//lines
-		}else if(type == "MESSAGE"){
-			//envelope
-			//body structure
-			//lines
-			std::stringstream part;
-			part << me;
-			std::istreambuf_iterator<char> start(part), end;
-			int lines = std::count(start, end, '\n');
-			Message m(part, 0,"",{});
-			struc << m.envelope() << " " << m.bodyStructure() << " " << lines;
+			struc << " " << std::count(body.cbegin(), body.cend(), '\n');
+		}else if(type == "MESSAGE" && subtype == "RFC822"){
+			//envelope, body structure and lines of the encapsulated message,
+			//which the parser has already split out as the only child part
+			const mimetic::MimeEntityList& parts = body.parts();
+			std::unique_ptr<mimetic::MimeEntity> parsed;
+			const mimetic::MimeEntity* inner;
+			if(!parts.empty()){
+				inner = parts.front();
+			}else{
+				parsed.reset(new mimetic::MimeEntity(body.cbegin(), body.cend()));
+				inner = parsed.get();
+			}
+			struc << " " << envelopeToString(inner->header())
+			      << " " << mimeEntityToString(*inner, extensions)
+			      << " " << std::count(body.cbegin(), body.cend(), '\n');
 		}
 		if(extensions){
 			if(header.hasField("Content-MD5")){
@@ -0,0 +1,111 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "Message.hpp"
+
+#ifndef __IMAP_METADATA_CACHE__
+#define __IMAP_METADATA_CACHE__
+
+namespace IMAPProvider {
+// Identifies one immutable message. A message's content never changes under
+// a given UID, and a new UIDVALIDITY invalidates every old entry for the
+// mailbox, so entries never need to be updated, only evicted.
+struct MetadataKey {
+  std::string user;
+  std::string mailbox;
+  unsigned long uidvalidity;
+  long uid;
+  bool operator==(const MetadataKey& o) const {
+    return uid == o.uid && uidvalidity == o.uidvalidity &&
+           mailbox == o.mailbox && user == o.user;
+  }
+};
+struct MetadataKeyHash {
+  size_t operator()(const MetadataKey& k) const {
+    size_t h = std::hash<std::string>()(k.user);
+    h = h * 31 + std::hash<std::string>()(k.mailbox);
+    h = h * 31 + std::hash<unsigned long>()(k.uidvalidity);
+    return h * 31 + std::hash<long>()(k.uid);
+  }
+};
+
+// Process-wide LRU of ENVELOPE/BODYSTRUCTURE/BODY strings, bounded by the
+// bytes they hold. Shared by every connection, so it is guarded by a mutex;
+// the critical sections are a hash lookup and a list splice.
+class MetadataCache {
+ private:
+  typedef std::pair<MetadataKey, MessageMetadata> Entry;
+  std::list<Entry> lru;  // most recently used first
+  std::unordered_map<MetadataKey, std::list<Entry>::iterator, MetadataKeyHash>
+      index;
+  size_t bytes = 0;
+  const size_t capacity;
+  mutable std::mutex lock;
+
+  static size_t cost(const Entry& e) {
+    return e.second.bytes() + e.first.user.size() + e.first.mailbox.size() +
+           sizeof(Entry);
+  }
+
+ public:
+  static constexpr size_t kDefaultCapacity = 32 * 1024 * 1024;
+  explicit MetadataCache(size_t capacityBytes = kDefaultCapacity)
+      : capacity(capacityBytes) {}
+  MetadataCache(const MetadataCache&) = delete;
+  MetadataCache& operator=(const MetadataCache&) = delete;
+
+  bool get(const MetadataKey& key, MessageMetadata& out) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(key);
+    if (it == index.end()) return false;
+    lru.splice(lru.begin(), lru, it->second);
+    out = it->second->second;
+    return true;
+  }
+
+  // Adds meta, merging it with whatever is already known about the message
+  void put(const MetadataKey& key, const MessageMetadata& meta) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(key);
+    if (it != index.end()) {
+      bytes -= cost(*it->second);
+      it->second->second.merge(meta);
+      bytes += cost(*it->second);
+      lru.splice(lru.begin(), lru, it->second);
+    } else {
+      lru.emplace_front(key, meta);
+      index.emplace(key, lru.begin());
+      bytes += cost(lru.front());
+    }
+    while (bytes > capacity && lru.size() > 1) {
+      bytes -= cost(lru.back());
+      index.erase(lru.back().first);
+      lru.pop_back();
+    }
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return lru.size();
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
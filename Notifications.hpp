@@ -0,0 +1,248 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Flags.hpp"
+
+#ifndef __IMAP_NOTIFICATIONS__
+#define __IMAP_NOTIFICATIONS__
+
+namespace IMAPProvider {
+// A change to a mailbox as its backend reports it. Numbers are as they are
+// right after the change.
+struct MailboxEvent {
+  typedef enum { EVENT_EXISTS, EVENT_EXPUNGE, EVENT_FLAGS } Kind_t;
+  Kind_t kind;
+  uint32_t number;     // EXISTS: messages in the mailbox, else a sequence number
+  MessageFlags flags;  // FLAGS: the message's flags now
+
+  static MailboxEvent exists(uint32_t count) { return {EVENT_EXISTS, count, {}}; }
+  static MailboxEvent expunge(uint32_t seq) { return {EVENT_EXPUNGE, seq, {}}; }
+  static MailboxEvent flagsChanged(uint32_t seq, const MessageFlags& now) {
+    return {EVENT_FLAGS, seq, now};
+  }
+};
+
+// What a session has yet to be told about its mailbox, folded together as
+// the events arrive: the EXPUNGEs in order, one EXISTS, then one FETCH per
+// message with its latest flags. Messages that arrived and were expunged
+// in between are never mentioned.
+struct PendingChanges {
+  std::vector<uint32_t> expunged;
+  // Set instead of expunged when there were too many to keep: which of the
+  // messages the client knew of are gone, by their numbers back then
+  std::vector<bool> gone;
+  uint32_t exists = 0;    // messages the client knows of once told
+  bool announce = false;  // whether that needs an EXISTS
+  std::map<uint32_t, MessageFlags> flags;
+  // Set instead of flags when there were too many to keep: the client
+  // should be sent the flags of every message
+  bool resync = false;
+
+  bool empty() const {
+    return expunged.empty() && gone.empty() && !announce && flags.empty() && !resync;
+  }
+  void write(std::string& out) const {
+    for (uint32_t n : expunged) out += "* " + std::to_string(n) + " EXPUNGE\r\n";
+    // highest first, so each number is still right when the client reads it
+    for (size_t n = gone.size(); n > 0; n--)
+      if (gone[n - 1]) out += "* " + std::to_string(n) + " EXPUNGE\r\n";
+    if (announce) out += "* " + std::to_string(exists) + " EXISTS\r\n";
+    for (const auto& f : flags)
+      out += "* " + std::to_string(f.first) + " FETCH (FLAGS " + f.second.str() + ")\r\n";
+  }
+};
+
+// The changes waiting for one session. Backends (through ChangeBus) post()
+// from whatever thread made the change; only the thread serving the
+// session's connection take()s them and writes to it. Events are folded
+// into PendingChanges as they arrive, so a stalled session costs at most
+// one entry per message: past maxFlags changed messages the queue stops
+// tracking flags and asks for a resync instead, and past maxExpunged
+// EXPUNGEs it keeps one bit per message the client knew of instead of a
+// list. fd() is readable while changes are waiting, so the poller can wake
+// that thread for a connection that is otherwise quiet (e.g. in IDLE).
+class NotificationQueue {
+ public:
+  static constexpr size_t kMaxFlags = 4096;
+  static constexpr size_t kMaxExpunged = 4096;
+
+ private:
+  std::mutex lock;
+  const size_t maxFlags;
+  const size_t maxExpunged;
+  uint32_t visible = 0;  // messages the client knows of
+  uint32_t total = 0;    // messages in the mailbox
+  PendingChanges pending;
+  bool waiting = false;
+  int wakeRead = -1;
+  int wakeWrite = -1;
+
+  static NotificationQueue*& running() {
+    static thread_local NotificationQueue* current = nullptr;
+    return current;
+  }
+  void signal() {
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = ::write(wakeWrite, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t n = ::write(wakeWrite, &one, sizeof(one));
+#endif
+    (void)n;  // a full pipe is already readable
+  }
+  // Marks the nth message the client still knows of as gone, moving the
+  // expunged list into PendingChanges::gone the first time
+  void markGone(uint32_t n) {
+    std::vector<bool>& gone = pending.gone;
+    if (gone.empty()) {
+      std::vector<uint32_t> earlier;
+      earlier.swap(pending.expunged);
+      gone.assign(visible + earlier.size(), false);
+      for (uint32_t m : earlier) markGone(m);
+    }
+    for (size_t i = 0; i < gone.size(); i++)
+      if (!gone[i] && --n == 0) {
+        gone[i] = true;
+        return;
+      }
+  }
+  void fold(const MailboxEvent& e) {
+    switch (e.kind) {
+      case MailboxEvent::EVENT_EXISTS:
+        total = e.number;
+        break;
+      case MailboxEvent::EVENT_EXPUNGE: {
+        std::map<uint32_t, MessageFlags> shifted;
+        for (auto& f : pending.flags)
+          if (f.first != e.number)
+            shifted.emplace(f.first > e.number ? f.first - 1 : f.first, std::move(f.second));
+        pending.flags.swap(shifted);
+        // a message the client has not been told about yet just disappears
+        if (e.number > 0 && e.number <= visible) {
+          if (pending.gone.empty() && pending.expunged.size() < maxExpunged)
+            pending.expunged.push_back(e.number);
+          else
+            markGone(e.number);
+          visible--;
+        }
+        if (total > 0) total--;
+        break;
+      }
+      case MailboxEvent::EVENT_FLAGS:
+        if (e.number == 0 || pending.resync) break;
+        pending.flags[e.number] = e.flags;
+        if (pending.flags.size() > maxFlags) {
+          pending.flags.clear();
+          pending.resync = true;
+        }
+        break;
+    }
+  }
+
+ public:
+  explicit NotificationQueue(size_t flagLimit = kMaxFlags, size_t expungeLimit = kMaxExpunged)
+      : maxFlags(flagLimit), maxExpunged(expungeLimit) {
+#ifdef __linux__
+    wakeRead = wakeWrite = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    int p[2];
+    if (::pipe(p) == 0) {
+      for (int fd : p) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      wakeRead = p[0];
+      wakeWrite = p[1];
+    }
+#endif
+  }
+  ~NotificationQueue() {
+    if (wakeRead >= 0) ::close(wakeRead);
+    if (wakeWrite >= 0 && wakeWrite != wakeRead) ::close(wakeWrite);
+  }
+  NotificationQueue(const NotificationQueue&) = delete;
+  NotificationQueue& operator=(const NotificationQueue&) = delete;
+
+  int fd() const { return wakeRead; }
+
+  // Starts over from a client that knows of exists messages (e.g. after
+  // SELECT), dropping anything pending
+  void reset(uint32_t exists) {
+    acknowledge();
+    std::lock_guard<std::mutex> guard(lock);
+    visible = total = exists;
+    pending = PendingChanges();
+    waiting = false;
+  }
+  // A session's own STORE reports the flags it changed, so FLAGS events
+  // posted while one of its commands runs on this thread are dropped
+  void post(const MailboxEvent& e) {
+    if (e.kind == MailboxEvent::EVENT_FLAGS && running() == this) return;
+    bool wake;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      fold(e);
+      wake = !waiting;
+      waiting = true;
+    }
+    if (wake) signal();
+  }
+  // Clears fd() without taking the changes; they wait for the next take()
+  void acknowledge() {
+    char buf[64];
+    while (::read(wakeRead, buf, sizeof(buf)) > 0) {
+    }
+  }
+  PendingChanges take() {
+    // cleared first, so a post() racing with this one wakes the poller again
+    acknowledge();
+    std::lock_guard<std::mutex> guard(lock);
+    PendingChanges out = std::move(pending);
+    pending = PendingChanges();
+    waiting = false;
+    // EXISTS never shrinks the mailbox; only EXPUNGE does
+    out.announce = total > visible;
+    out.exists = visible = total = std::max(total, visible);
+    out.flags.erase(out.flags.upper_bound(out.exists), out.flags.end());
+    return out;
+  }
+
+  // Marks the session whose command is running on this thread
+  class Running {
+   private:
+    NotificationQueue* previous;
+
+   public:
+    explicit Running(NotificationQueue* q) : previous(running()) { running() = q; }
+    ~Running() { running() = previous; }
+    Running(const Running&) = delete;
+    Running& operator=(const Running&) = delete;
+  };
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "SearchQuery.hpp"
+#include "TextIndex.hpp"
+
+#ifndef __IMAP_SEARCH_INDEX__
+#define __IMAP_SEARCH_INDEX__
+
+namespace IMAPProvider {
+// The attributes SEARCH filters on most, one array per attribute, indexed by
+// sequence number - 1. flags holds the FlagBits of each message, with
+// keywords numbered by dict. sent is optional: a backend that leaves it
+// empty has SENTBEFORE/SENTON/SENTSINCE answered from the messages.
+struct MailboxColumns {
+  std::vector<uint32_t> uid;
+  std::vector<FlagBits> flags;
+  std::vector<uint64_t> size;
+  std::vector<int64_t> date;  // internal date, seconds since the epoch
+  std::vector<int64_t> sent;  // sentDay() of the Date: header
+  std::shared_ptr<const FlagDictionary> dict = FlagDictionary::standard();
+
+  size_t rows() const { return uid.size(); }
+  bool hasSent() const { return sent.size() == rows(); }
+  void reserve(size_t n) {
+    uid.reserve(n);
+    flags.reserve(n);
+    size.reserve(n);
+    date.reserve(n);
+  }
+  void push(uint32_t u, FlagBits f, uint64_t s, int64_t d) {
+    uid.push_back(u);
+    flags.push_back(f);
+    size.push_back(s);
+    date.push_back(d);
+  }
+  void push(uint32_t u, FlagBits f, uint64_t s, int64_t d, int64_t day) {
+    push(u, f, s, d);
+    sent.push_back(day);
+  }
+};
+
+// A set of rows as a bitmap, 64 rows per word
+class RowSet {
+ private:
+  std::vector<uint64_t> words;
+  size_t n;
+
+  void trim() {
+    if (n % 64) words.back() &= (uint64_t(1) << (n % 64)) - 1;
+  }
+
+ public:
+  explicit RowSet(size_t rows, bool all = false)
+      : words((rows + 63) / 64, all ? ~uint64_t(0) : 0), n(rows) {
+    if (all && !words.empty()) trim();
+  }
+  size_t rows() const { return n; }
+  std::vector<uint64_t>& data() { return words; }
+  const std::vector<uint64_t>& data() const { return words; }
+
+  void set(size_t r) { words[r / 64] |= uint64_t(1) << (r % 64); }
+  bool test(size_t r) const { return words[r / 64] >> (r % 64) & 1; }
+  bool none() const {
+    return std::all_of(words.begin(), words.end(), [](uint64_t w) { return w == 0; });
+  }
+  size_t count() const {
+    return std::accumulate(words.begin(), words.end(), size_t(0),
+                           [](size_t c, uint64_t w) { return c + __builtin_popcountll(w); });
+  }
+  RowSet& operator&=(const RowSet& o) {
+    for (size_t i = 0; i < words.size(); i++) words[i] &= o.words[i];
+    return *this;
+  }
+  RowSet& operator|=(const RowSet& o) {
+    for (size_t i = 0; i < words.size(); i++) words[i] |= o.words[i];
+    return *this;
+  }
+  // this & ~o
+  RowSet& subtract(const RowSet& o) {
+    for (size_t i = 0; i < words.size(); i++) words[i] &= ~o.words[i];
+    return *this;
+  }
+  // As message sequence numbers (row + 1), a whole word at a time where
+  // every row in it is set
+  SequenceSet sequence() const {
+    SequenceSet out;
+    for (size_t i = 0; i < words.size(); i++) {
+      if (words[i] == ~uint64_t(0)) {
+        out.add(i * 64 + 1, i * 64 + 64);
+        continue;
+      }
+      for (uint64_t w = words[i]; w; w &= w - 1) out.add(i * 64 + __builtin_ctzll(w) + 1);
+    }
+    return out;
+  }
+  template <typename F>
+  void forEach(F f) const {
+    for (size_t i = 0; i < words.size(); i++)
+      for (uint64_t w = words[i]; w; w &= w - 1) f(i * 64 + __builtin_ctzll(w));
+  }
+};
+
+// Answers a key that needs the message itself (SearchKey::needsContent())
+// for one row
+typedef std::function<bool(size_t row, const SearchKey&)> ContentMatcher;
+
+// Evaluates a SEARCH over columns. Index keys are branch-free loops over one
+// column that produce 64 rows per word (which compilers vectorize); the
+// boolean structure is then word-wise AND/OR/ANDNOT. Content keys are only
+// asked of matcher for rows that can still match (and, with a TextIndex,
+// whose UIDs it lists), and AND evaluates them after its index keys so
+// those rows are as few as possible.
+class SearchIndex {
+ private:
+  const MailboxColumns& cols;
+  const ContentMatcher& matcher;
+  const TextIndex* text;
+
+  template <typename Pred>
+  RowSet scan(const RowSet& candidates, Pred pred) const {
+    RowSet out(cols.rows());
+    std::vector<uint64_t>& w = out.data();
+    const std::vector<uint64_t>& c = candidates.data();
+    for (size_t i = 0; i < w.size(); i++) {
+      if (c[i] == 0) continue;
+      const size_t base = i * 64, end = std::min<size_t>(64, cols.rows() - base);
+      uint64_t bits = 0;
+      for (size_t j = 0; j < end; j++) bits |= uint64_t(pred(base + j)) << j;
+      w[i] = bits & c[i];
+    }
+    return out;
+  }
+  RowSet range(const RowSet& candidates, size_t first, size_t last) const {
+    RowSet out(cols.rows());
+    for (size_t r = first; r <= last && r < cols.rows(); r++) out.set(r);
+    return out &= candidates;
+  }
+  // A key only the message can answer, for the candidates matcher is asked
+  // about
+  RowSet content(const SearchKey& key, const RowSet& candidates) const {
+    RowSet out(cols.rows());
+    RowSet narrowed = candidates;
+    std::vector<uint32_t> uids;
+    if (text != nullptr && text->candidates(key, uids)) {
+      // both lists ascend, so one merge walk maps UIDs to rows
+      RowSet hits(cols.rows());
+      auto u = uids.begin();
+      for (size_t r = 0; r < cols.rows() && u != uids.end(); r++) {
+        while (u != uids.end() && *u < cols.uid[r]) ++u;
+        if (u != uids.end() && *u == cols.uid[r]) hits.set(r);
+      }
+      narrowed &= hits;
+    }
+    if (matcher)
+      narrowed.forEach([&](size_t r) {
+        if (matcher(r, key)) out.set(r);
+      });
+    return out;
+  }
+  RowSet eval(const SearchKey& key, const RowSet& candidates) const {
+    const FlagBits* f = cols.flags.data();
+    const uint64_t* s = cols.size.data();
+    const int64_t* d = cols.date.data();
+    if (candidates.none()) return candidates;
+    switch (key.kind) {
+      case SearchKey::ALL:
+        return candidates;
+      case SearchKey::AND: {
+        std::vector<const SearchKey*> order;
+        for (const SearchKey& k : key.children) order.push_back(&k);
+        std::stable_partition(order.begin(), order.end(),
+                              [this](const SearchKey* k) { return !needsContent(*k); });
+        RowSet out = candidates;
+        for (const SearchKey* k : order) out = eval(*k, out);
+        return out;
+      }
+      case SearchKey::OR: {
+        // each alternative only looks at the rows not matched yet
+        RowSet out(cols.rows()), rest = candidates;
+        for (const SearchKey& k : key.children) {
+          RowSet hit = eval(k, rest);
+          out |= hit;
+          rest.subtract(hit);
+        }
+        return out;
+      }
+      case SearchKey::NOT: {
+        RowSet out = candidates;
+        return out.subtract(eval(key.children[0], candidates));
+      }
+      case SearchKey::FLAGGED: {
+        const FlagBits m = key.flags;
+        return scan(candidates, [=](size_t r) { return (f[r] & m) == m; });
+      }
+      case SearchKey::UNFLAGGED: {
+        const FlagBits m = key.flags;
+        return scan(candidates, [=](size_t r) { return (f[r] & m) == 0; });
+      }
+      case SearchKey::KEYWORD:
+      case SearchKey::UNKEYWORD: {
+        const FlagBits m = cols.dict->keyword(key.value);
+        if (m == 0)
+          return key.kind == SearchKey::KEYWORD ? RowSet(cols.rows()) : candidates;
+        const bool want = key.kind == SearchKey::KEYWORD;
+        return scan(candidates, [=](size_t r) { return ((f[r] & m) != 0) == want; });
+      }
+      case SearchKey::LARGER: {
+        const uint64_t n = key.number;
+        return scan(candidates, [=](size_t r) { return s[r] > n; });
+      }
+      case SearchKey::SMALLER: {
+        const uint64_t n = key.number;
+        return scan(candidates, [=](size_t r) { return s[r] < n; });
+      }
+      case SearchKey::BEFORE: {
+        const int64_t t = key.number * 86400;
+        return scan(candidates, [=](size_t r) { return d[r] < t; });
+      }
+      case SearchKey::ON: {
+        const int64_t t = key.number * 86400;
+        return scan(candidates, [=](size_t r) { return d[r] >= t && d[r] < t + 86400; });
+      }
+      case SearchKey::SINCE: {
+        const int64_t t = key.number * 86400;
+        return scan(candidates, [=](size_t r) { return d[r] >= t; });
+      }
+      case SearchKey::SEQUENCE: {
+        RowSet out(cols.rows());
+        const SequenceSet set = key.set.resolve(cols.rows());
+        for (const SequenceSet::Range& r : set.intervals())
+          out |= range(candidates, r.first - 1, r.last - 1);
+        return out;
+      }
+      case SearchKey::UID: {
+        // UIDs ascend with sequence numbers, so each interval is a row range
+        RowSet out(cols.rows());
+        const uint32_t maxUid = cols.rows() ? cols.uid.back() : 0;
+        const SequenceSet set = key.set.resolve(maxUid);
+        for (const SequenceSet::Range& r : set.intervals()) {
+          size_t a = std::lower_bound(cols.uid.begin(), cols.uid.end(), r.first) - cols.uid.begin();
+          size_t b = std::upper_bound(cols.uid.begin(), cols.uid.end(), r.last) - cols.uid.begin();
+          if (a < b) out |= range(candidates, a, b - 1);
+        }
+        return out;
+      }
+      case SearchKey::SENTBEFORE:
+      case SearchKey::SENTON:
+      case SearchKey::SENTSINCE: {
+        if (!cols.hasSent()) return content(key, candidates);
+        // each key is a range of days [lo, hi); kNoSentDay is below all of them
+        const int64_t* day = cols.sent.data();
+        const int64_t n = key.number;
+        const int64_t lo = key.kind == SearchKey::SENTBEFORE ? kNoSentDay + 1 : n;
+        const int64_t hi = key.kind == SearchKey::SENTSINCE ? INT64_MAX
+                           : key.kind == SearchKey::SENTON  ? n + 1
+                                                            : n;
+        return scan(candidates, [=](size_t r) { return day[r] >= lo && day[r] < hi; });
+      }
+      default:
+        return content(key, candidates);
+    }
+  }
+
+ public:
+  // text, if given, narrows content keys before they reach matcher
+  SearchIndex(const MailboxColumns& c, const ContentMatcher& m,
+              const TextIndex* t = nullptr)
+      : cols(c), matcher(m), text(t) {}
+
+  RowSet evaluate(const SearchKey& key) const {
+    return eval(key, RowSet(cols.rows(), true));
+  }
+  // As SearchKey::needsContent(), but SENT* keys are index keys when the
+  // columns have sent
+  bool needsContent(const SearchKey& key) const {
+    switch (key.kind) {
+      case SearchKey::SENTBEFORE:
+      case SearchKey::SENTON:
+      case SearchKey::SENTSINCE:
+        return !cols.hasSent();
+      case SearchKey::AND:
+      case SearchKey::OR:
+      case SearchKey::NOT:
+        return std::any_of(key.children.begin(), key.children.end(),
+                           [this](const SearchKey& k) { return needsContent(k); });
+      default:
+        return key.needsContent();
+    }
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,550 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Flags.hpp"
+#include "Helpers.hpp"
+#include "SequenceSet.hpp"
+
+#ifndef __IMAP_SEARCH_QUERY__
+#define __IMAP_SEARCH_QUERY__
+
+namespace IMAPProvider {
+// One node of a parsed SEARCH (RFC 3501 section 6.4.4). The keys that only
+// depend on flags, size, internal date, sequence number or UID can be
+// answered from an index; the rest (needsContent()) need the message.
+struct SearchKey {
+  typedef enum {
+    ALL,
+    AND,         // children
+    OR,          // any of children (a chain of ORs is one node)
+    NOT,         // children[0]
+    FLAGGED,     // all of flags set (NEW is AND(RECENT, UNSEEN))
+    UNFLAGGED,   // none of flags set
+    KEYWORD,     // value
+    UNKEYWORD,   // value
+    LARGER,      // number (octets)
+    SMALLER,
+    BEFORE,      // number (day, days since the epoch), internal date
+    ON,
+    SINCE,
+    SENTBEFORE,  // number (day), Date: header
+    SENTON,
+    SENTSINCE,
+    HEADER,      // field contains value (FROM, TO, SUBJECT, ... too)
+    BODY,        // body text contains value
+    TEXT,        // header or body contains value
+    SEQUENCE,    // set
+    UID          // set
+  } Kind;
+
+  Kind kind = ALL;
+  uint32_t flags = 0;
+  int64_t number = 0;
+  std::string field;
+  std::string value;
+  SequenceSet set;
+  std::vector<SearchKey> children;
+
+  SearchKey() {}
+  explicit SearchKey(Kind k) : kind(k) {}
+  static SearchKey flag(Kind k, uint32_t f) {
+    SearchKey key(k);
+    key.flags = f;
+    return key;
+  }
+
+  bool needsContent() const {
+    switch (kind) {
+      case SENTBEFORE: case SENTON: case SENTSINCE:
+      case HEADER: case BODY: case TEXT:
+        return true;
+      case AND: case OR: case NOT:
+        return std::any_of(children.begin(), children.end(),
+                           [](const SearchKey& k) { return k.needsContent(); });
+      default:
+        return false;
+    }
+  }
+
+  // Back to IMAP syntax, for backends that only take query strings
+  std::string str() const {
+    static const char* names[] = {"SEEN", "ANSWERED", "FLAGGED", "DELETED",
+                                  "DRAFT", "RECENT"};
+    auto quote = [](const std::string& s) {
+      std::string q = "\"";
+      for (char c : s) {
+        if (c == '"' || c == '\\') q += '\\';
+        q += c;
+      }
+      return q + "\"";
+    };
+    auto date = [this]() {
+      time_t t = static_cast<time_t>(number) * 86400;
+      struct tm tm;
+      gmtime_r(&t, &tm);
+      char buf[16];
+      strftime(buf, sizeof(buf), "%d-%b-%Y", &tm);
+      return std::string(buf);
+    };
+    std::vector<std::string> parts;
+    switch (kind) {
+      case ALL: return "ALL";
+      case AND:
+        for (const SearchKey& k : children) parts.push_back(k.str());
+        return children.size() == 1 ? parts[0] : "(" + join(parts, " ") + ")";
+      case OR: {
+        std::string out = children.back().str();
+        for (size_t i = children.size() - 1; i-- > 0;)
+          out = "OR " + children[i].str() + " " + out;
+        return out;
+      }
+      case NOT: return "NOT " + children[0].str();
+      case FLAGGED:
+      case UNFLAGGED:
+        for (uint32_t i = 0; i < kKeywordShift; i++)
+          if (flags & (1u << i))
+            parts.push_back((kind == UNFLAGGED ? "UN" : "") + std::string(names[i]));
+        // there is no UNRECENT; OLD is its name
+        for (std::string& p : parts)
+          if (p == "UNRECENT") p = "OLD";
+        return parts.size() == 1 ? parts[0] : "(" + join(parts, " ") + ")";
+      case KEYWORD: return "KEYWORD " + value;
+      case UNKEYWORD: return "UNKEYWORD " + value;
+      case LARGER: return "LARGER " + std::to_string(number);
+      case SMALLER: return "SMALLER " + std::to_string(number);
+      case BEFORE: return "BEFORE " + date();
+      case ON: return "ON " + date();
+      case SINCE: return "SINCE " + date();
+      case SENTBEFORE: return "SENTBEFORE " + date();
+      case SENTON: return "SENTON " + date();
+      case SENTSINCE: return "SENTSINCE " + date();
+      case HEADER: return "HEADER " + quote(field) + " " + quote(value);
+      case BODY: return "BODY " + quote(value);
+      case TEXT: return "TEXT " + quote(value);
+      case SEQUENCE: return set.str();
+      case UID: return "UID " + set.str();
+    }
+    return "ALL";
+  }
+};
+
+// Days since the epoch of a proleptic Gregorian date
+constexpr int64_t civilDay(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int64_t era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = static_cast<unsigned>(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+// Day number of an IMAP date such as 17-Oct-2026 (RFC 3501 date-text), or
+// -1 if s is not one
+constexpr int64_t searchDay(std::string_view s) {
+  constexpr std::string_view months = "JANFEBMARAPRMAYJUNJULAUGSEPOCTNOVDEC";
+  size_t dash = s.find('-');
+  if (dash < 1 || dash > 2 || s.size() != dash + 9 || s[dash + 4] != '-') return -1;
+  unsigned day = 0, month = 0;
+  int64_t year = 0;
+  for (size_t i = 0; i < dash; i++) {
+    if (s[i] < '0' || s[i] > '9') return -1;
+    day = day * 10 + (s[i] - '0');
+  }
+  for (size_t m = 0; m < 12 && month == 0; m++)
+    if (ciCompare(s.substr(dash + 1, 3), months.substr(m * 3, 3)) == 0) month = m + 1;
+  for (size_t i = dash + 5; i < s.size(); i++) {
+    if (s[i] < '0' || s[i] > '9') return -1;
+    year = year * 10 + (s[i] - '0');
+  }
+  if (month == 0 || day < 1 || day > 31) return -1;
+  return civilDay(year, month, day);
+}
+
+// Single-pass recursive-descent parser for SEARCH arguments (RFC 3501
+// "search" minus the command name), straight from the command text:
+// atoms, quoted strings and literals, parenthesized lists, CHARSET,
+// sequence sets, dates and sizes. Key names are found by binary search
+// and atoms are only copied into the tree they end up in.
+//
+// Chains of OR such as "OR a OR b OR c d", which filter rules generate by
+// the hundred, are read iteratively into one OR node; only genuinely
+// nested keys (parentheses, NOT, OR on the left) recurse, up to kMaxDepth.
+class SearchParser {
+ public:
+  static constexpr size_t kMaxDepth = 64;
+  // ESEARCH (RFC 4731) result options
+  typedef enum : unsigned {
+    RETURN_MIN = 1 << 0,
+    RETURN_MAX = 1 << 1,
+    RETURN_ALL = 1 << 2,
+    RETURN_COUNT = 1 << 3
+  } ReturnOption_t;
+
+ private:
+  typedef enum { NONE, ASTRING, FIELD, HEADER, ATOM, NUMBER, DATE, SET, NEW, NOT, OR } Arg_t;
+  struct Rule {
+    std::string_view name;
+    SearchKey::Kind kind;
+    uint32_t flags;
+    Arg_t arg;
+  };
+  std::string_view in;
+  size_t pos = 0;
+  size_t depth = 0;
+  bool unsupported = false;
+  bool extended = false;
+  unsigned options = 0;
+
+  bool more() const { return pos < in.size() && in[pos] != ')'; }
+  // Exactly one SP separates arguments; be lenient about runs of them
+  bool space() {
+    if (pos >= in.size() || in[pos] != ' ') return false;
+    while (pos < in.size() && in[pos] == ' ') pos++;
+    return true;
+  }
+  bool atom(std::string_view& out) {
+    size_t start = pos;
+    while (pos < in.size() && in[pos] != ' ' && in[pos] != '(' && in[pos] != ')' &&
+           in[pos] != '"' && static_cast<unsigned char>(in[pos]) > 0x1f)
+      pos++;
+    out = in.substr(start, pos - start);
+    return !out.empty();
+  }
+  bool astring(std::string& out) {
+    if (pos >= in.size()) return false;
+    if (in[pos] == '"') {
+      out.clear();
+      for (pos++; pos < in.size() && in[pos] != '"'; pos++) {
+        if (in[pos] == '\\' && ++pos >= in.size()) return false;
+        out += in[pos];
+      }
+      return pos++ < in.size();
+    }
+    if (in[pos] == '{') {
+      // {n} or {n+}, CRLF, then n octets
+      size_t n = 0, p = pos + 1;
+      while (p < in.size() && in[p] >= '0' && in[p] <= '9' && n < (size_t(1) << 40))
+        n = n * 10 + (in[p++] - '0');
+      if (p < in.size() && in[p] == '+') p++;
+      if (p == pos + 1 || p >= in.size() || in[p++] != '}') return false;
+      if (p < in.size() && in[p] == '\r') p++;
+      if (p >= in.size() || in[p++] != '\n' || in.size() - p < n) return false;
+      out.assign(in.data() + p, n);
+      pos = p + n;
+      return true;
+    }
+    std::string_view a;
+    if (!atom(a)) return false;
+    out.assign(a.data(), a.size());
+    return true;
+  }
+  bool date(int64_t& day) {
+    bool quoted = pos < in.size() && in[pos] == '"';
+    pos += quoted;
+    std::string_view a;
+    if (!atom(a) || (day = searchDay(a)) < 0) return false;
+    return !quoted || (pos < in.size() && in[pos++] == '"');
+  }
+  bool number(int64_t& n) {
+    std::string_view a;
+    if (!atom(a) || a.size() > 18) return false;
+    n = 0;
+    for (char c : a) {
+      if (c < '0' || c > '9') return false;
+      n = n * 10 + (c - '0');
+    }
+    return true;
+  }
+
+  static const Rule* rule(std::string_view name) {
+    static constexpr Rule rules[] = {
+        {"ALL", SearchKey::ALL, 0, NONE},
+        {"ANSWERED", SearchKey::FLAGGED, FLAG_ANSWERED, NONE},
+        {"BCC", SearchKey::HEADER, 0, FIELD},
+        {"BEFORE", SearchKey::BEFORE, 0, DATE},
+        {"BODY", SearchKey::BODY, 0, ASTRING},
+        {"CC", SearchKey::HEADER, 0, FIELD},
+        {"DELETED", SearchKey::FLAGGED, FLAG_DELETED, NONE},
+        {"DRAFT", SearchKey::FLAGGED, FLAG_DRAFT, NONE},
+        {"FLAGGED", SearchKey::FLAGGED, FLAG_FLAGGED, NONE},
+        {"FROM", SearchKey::HEADER, 0, FIELD},
+        {"HEADER", SearchKey::HEADER, 0, HEADER},
+        {"KEYWORD", SearchKey::KEYWORD, 0, ATOM},
+        {"LARGER", SearchKey::LARGER, 0, NUMBER},
+        {"NEW", SearchKey::AND, 0, NEW},
+        {"NOT", SearchKey::NOT, 0, NOT},
+        {"OLD", SearchKey::UNFLAGGED, FLAG_RECENT, NONE},
+        {"ON", SearchKey::ON, 0, DATE},
+        {"OR", SearchKey::OR, 0, OR},
+        {"RECENT", SearchKey::FLAGGED, FLAG_RECENT, NONE},
+        {"SEEN", SearchKey::FLAGGED, FLAG_SEEN, NONE},
+        {"SENTBEFORE", SearchKey::SENTBEFORE, 0, DATE},
+        {"SENTON", SearchKey::SENTON, 0, DATE},
+        {"SENTSINCE", SearchKey::SENTSINCE, 0, DATE},
+        {"SINCE", SearchKey::SINCE, 0, DATE},
+        {"SMALLER", SearchKey::SMALLER, 0, NUMBER},
+        {"SUBJECT", SearchKey::HEADER, 0, FIELD},
+        {"TEXT", SearchKey::TEXT, 0, ASTRING},
+        {"TO", SearchKey::HEADER, 0, FIELD},
+        {"UID", SearchKey::UID, 0, SET},
+        {"UNANSWERED", SearchKey::UNFLAGGED, FLAG_ANSWERED, NONE},
+        {"UNDELETED", SearchKey::UNFLAGGED, FLAG_DELETED, NONE},
+        {"UNDRAFT", SearchKey::UNFLAGGED, FLAG_DRAFT, NONE},
+        {"UNFLAGGED", SearchKey::UNFLAGGED, FLAG_FLAGGED, NONE},
+        {"UNKEYWORD", SearchKey::UNKEYWORD, 0, ATOM},
+        {"UNSEEN", SearchKey::UNFLAGGED, FLAG_SEEN, NONE}};
+    static_assert([]() {
+      for (size_t i = 1; i < sizeof(rules) / sizeof(rules[0]); i++)
+        if (ciCompare(rules[i - 1].name, rules[i].name) >= 0) return false;
+      return true;
+    }(), "SEARCH keys must be sorted by name");
+    const Rule* found = std::lower_bound(
+        std::begin(rules), std::end(rules), name,
+        [](const Rule& r, std::string_view n) { return ciCompare(r.name, n) < 0; });
+    if (found == std::end(rules) || ciCompare(found->name, name) != 0) return nullptr;
+    return found;
+  }
+
+  // search-key *(SP search-key), up to the end or a ')'
+  bool keys(SearchKey& out) {
+    out = SearchKey(SearchKey::AND);
+    do {
+      out.children.emplace_back();
+      if (!key(out.children.back())) return false;
+    } while (space() && more());
+    return true;
+  }
+
+  bool key(SearchKey& out) {
+    if (++depth > kMaxDepth) return false;
+    bool ok = parseKey(out);
+    depth--;
+    return ok;
+  }
+  bool parseKey(SearchKey& out) {
+    if (pos < in.size() && in[pos] == '(') {
+      pos++;
+      if (!keys(out) || pos >= in.size() || in[pos++] != ')') return false;
+      if (out.children.size() == 1) {
+        SearchKey only = std::move(out.children[0]);
+        out = std::move(only);
+      }
+      return true;
+    }
+    std::string_view name;
+    if (!atom(name)) return false;
+    const Rule* r = rule(name);
+    if (r == nullptr) {
+      out = SearchKey(SearchKey::SEQUENCE);
+      return SequenceSet::parse(name, out.set);
+    }
+    out = SearchKey::flag(r->kind, r->flags);
+    switch (r->arg) {
+      case NONE:
+        return true;
+      case ASTRING:
+        return space() && astring(out.value);
+      case FIELD:
+        out.field.assign(name.data(), name.size());
+        return space() && astring(out.value);
+      case HEADER:
+        return space() && astring(out.field) && space() && astring(out.value);
+      case ATOM: {
+        std::string_view a;
+        if (!space() || !atom(a)) return false;
+        out.value.assign(a.data(), a.size());
+        return true;
+      }
+      case NUMBER:
+        return space() && number(out.number);
+      case DATE:
+        return space() && date(out.number);
+      case SET: {
+        std::string_view a;
+        return space() && atom(a) && SequenceSet::parse(a, out.set);
+      }
+      case NEW:
+        out.children.push_back(SearchKey::flag(SearchKey::FLAGGED, FLAG_RECENT));
+        out.children.push_back(SearchKey::flag(SearchKey::UNFLAGGED, FLAG_SEEN));
+        return true;
+      case NOT:
+        out.children.emplace_back();
+        return space() && key(out.children.back());
+      case OR:
+        // OR a OR b c: keep going down the right-hand side without recursing
+        while (true) {
+          out.children.emplace_back();
+          if (!space() || !key(out.children.back()) || !space()) return false;
+          size_t save = pos;
+          std::string_view next;
+          if (atom(next) && ciCompare(next, "OR") == 0) continue;
+          pos = save;
+          out.children.emplace_back();
+          return key(out.children.back());
+        }
+    }
+    return false;
+  }
+
+ public:
+  // Parses the arguments of SEARCH into out. Returns false on a syntax
+  // error or an unsupported charset (see badCharset()).
+  bool parse(std::string_view input, SearchKey& out) {
+    in = input;
+    pos = depth = 0;
+    unsupported = extended = false;
+    options = 0;
+    while (!in.empty() && (in.back() == '\n' || in.back() == '\r' || in.back() == ' '))
+      in.remove_suffix(1);
+    while (pos < in.size() && in[pos] == ' ') pos++;
+    std::string_view name;
+    size_t save = pos;
+    if (atom(name) && ciCompare(name, "RETURN") == 0) {
+      // RETURN (MIN MAX ...); an empty list means ALL
+      if (!space() || pos >= in.size() || in[pos++] != '(') return false;
+      static const std::pair<std::string_view, unsigned> returnOptions[] = {
+          {"MIN", RETURN_MIN}, {"MAX", RETURN_MAX},
+          {"ALL", RETURN_ALL}, {"COUNT", RETURN_COUNT}};
+      while (pos < in.size() && in[pos] != ')') {
+        std::string_view opt;
+        if (!atom(opt)) return false;
+        auto known = std::find_if(std::begin(returnOptions), std::end(returnOptions),
+                                  [&](const auto& o) { return ciCompare(o.first, opt) == 0; });
+        if (known == std::end(returnOptions)) return false;
+        options |= known->second;
+        if (pos < in.size() && in[pos] == ' ') pos++;
+      }
+      if (pos++ >= in.size() || !space()) return false;
+      extended = true;
+      if (options == 0) options = RETURN_ALL;
+      save = pos;
+    } else {
+      pos = save;
+    }
+    if (atom(name) && ciCompare(name, "CHARSET") == 0) {
+      std::string charset;
+      if (!space() || !astring(charset) || !space()) return false;
+      if (ciCompare(charset, "UTF-8") != 0 && ciCompare(charset, "US-ASCII") != 0) {
+        unsupported = true;
+        return false;
+      }
+    } else {
+      pos = save;
+    }
+    if (pos >= in.size()) return false;
+    if (!keys(out) || pos != in.size()) return false;
+    if (out.children.size() == 1) {
+      SearchKey only = std::move(out.children[0]);
+      out = std::move(only);
+    }
+    return true;
+  }
+  // The last parse() failed only because of its CHARSET
+  bool badCharset() const { return unsupported; }
+  // Whether the query asked for an ESEARCH response, and with which
+  // ReturnOption_t bits
+  bool esearch() const { return extended; }
+  unsigned returnOptions() const { return options; }
+};
+
+// Case-insensitive substring test, as SEARCH requires
+inline bool containsCi(std::string_view hay, std::string_view needle) {
+  return std::search(hay.begin(), hay.end(), needle.begin(), needle.end(),
+                     [](char a, char b) {
+                       return std::tolower(static_cast<unsigned char>(a)) ==
+                              std::tolower(static_cast<unsigned char>(b));
+                     }) != hay.end();
+}
+
+// Unfolded value of the first field called name in a raw header block
+inline std::string headerField(std::string_view head, std::string_view name) {
+  size_t pos = 0;
+  while (pos < head.size()) {
+    size_t eol = head.find('\n', pos);
+    if (eol == std::string_view::npos) eol = head.size();
+    std::string_view line = head.substr(pos, eol - pos);
+    pos = eol + 1;
+    if (line.size() <= name.size() || line[name.size()] != ':' ||
+        ciCompare(line.substr(0, name.size()), name) != 0)
+      continue;
+    std::string value(line.substr(name.size() + 1));
+    while (pos < head.size() && (head[pos] == ' ' || head[pos] == '\t')) {
+      eol = head.find('\n', pos);
+      if (eol == std::string_view::npos) eol = head.size();
+      value += head.substr(pos, eol - pos);
+      pos = eol + 1;
+    }
+    value.erase(std::remove(value.begin(), value.end(), '\r'), value.end());
+    return value;
+  }
+  return "";
+}
+
+// A message with no Date: header that sentDay() can read
+constexpr int64_t kNoSentDay = INT64_MIN;
+
+// The day (since the epoch) of the Date: header in a raw header block,
+// ignoring its time and zone as SENTBEFORE/SENTON/SENTSINCE do, or
+// kNoSentDay
+inline int64_t sentDay(std::string_view head) {
+  std::string date = headerField(head, "Date");
+  const char* p = date.c_str();
+  while (*p == ' ') p++;
+  struct tm tm = {};
+  if (strptime(p, "%a, %d %b %Y", &tm) == nullptr &&
+      strptime(p, "%d %b %Y", &tm) == nullptr)
+    return kNoSentDay;
+  return timegm(&tm) / 86400;
+}
+
+// Whether a sentDay() matches a SENTBEFORE, SENTON or SENTSINCE key
+inline bool matchesSent(const SearchKey& key, int64_t day) {
+  if (day == kNoSentDay) return false;
+  if (key.kind == SearchKey::SENTBEFORE) return day < key.number;
+  if (key.kind == SearchKey::SENTON) return day == key.number;
+  return day >= key.number;
+}
+
+// Evaluates a content key against a message's raw header block and body
+inline bool matchesContent(const SearchKey& key, std::string_view head,
+                           std::string_view body) {
+  switch (key.kind) {
+    case SearchKey::HEADER:
+      // HEADER field "" matches any message that has the field
+      if (key.value.empty()) return containsCi(head, key.field + ":");
+      return containsCi(headerField(head, key.field), key.value);
+    case SearchKey::BODY:
+      return containsCi(body, key.value);
+    case SearchKey::TEXT:
+      return containsCi(head, key.value) || containsCi(body, key.value);
+    case SearchKey::SENTBEFORE:
+    case SearchKey::SENTON:
+    case SearchKey::SENTSINCE:
+      return matchesSent(key, sentDay(head));
+    default:
+      return false;
+  }
+}
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef __IMAP_SEQUENCE_SET__
+#define __IMAP_SEQUENCE_SET__
+
+namespace IMAPProvider {
+// An IMAP sequence set (RFC 3501 "sequence-set") such as 1:4,7,9:*, kept as
+// a sorted list of disjoint inclusive intervals. Iterating visits every
+// number in order without ever expanding the set.
+class SequenceSet {
+ public:
+  static constexpr uint32_t kStar = UINT32_MAX;  // '*' until resolve()
+  struct Range {
+    uint32_t first;
+    uint32_t last;
+  };
+
+ private:
+  std::vector<Range> ranges;
+
+  void normalize() {
+    std::sort(ranges.begin(), ranges.end(),
+              [](const Range& a, const Range& b) { return a.first < b.first; });
+    std::vector<Range> merged;
+    for (const Range& r : ranges) {
+      if (!merged.empty() && (merged.back().last == kStar ||
+                              r.first <= merged.back().last + 1)) {
+        merged.back().last = std::max(merged.back().last, r.last);
+      } else {
+        merged.push_back(r);
+      }
+    }
+    ranges.swap(merged);
+  }
+  static bool number(std::string_view s, uint32_t& n) {
+    if (s == "*") {
+      n = kStar;
+      return true;
+    }
+    if (s.empty() || s.length() > 10 || s[0] == '0') return false;
+    uint64_t v = 0;
+    for (char c : s) {
+      if (c < '0' || c > '9') return false;
+      v = v * 10 + (c - '0');
+    }
+    if (v >= kStar) return false;
+    n = static_cast<uint32_t>(v);
+    return true;
+  }
+
+ public:
+  class iterator {
+   private:
+    const std::vector<Range>* r = nullptr;
+    size_t idx = 0;
+    uint32_t cur = 0;
+
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef uint32_t value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const uint32_t* pointer;
+    typedef const uint32_t& reference;
+    iterator() {}
+    iterator(const std::vector<Range>* ranges, size_t i)
+        : r(ranges), idx(i), cur(i < ranges->size() ? (*ranges)[i].first : 0) {}
+    reference operator*() const { return cur; }
+    iterator& operator++() {
+      if (cur == (*r)[idx].last) {
+        if (++idx < r->size()) cur = (*r)[idx].first;
+      } else {
+        cur++;
+      }
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator t = *this;
+      ++*this;
+      return t;
+    }
+    bool operator==(const iterator& o) const {
+      return idx == o.idx && (idx >= r->size() || cur == o.cur);
+    }
+    bool operator!=(const iterator& o) const { return !(*this == o); }
+  };
+
+  SequenceSet() {}
+  SequenceSet(uint32_t first, uint32_t last) { add(first, last); }
+
+  // Parses a sequence set. Returns false (leaving out untouched) if s is
+  // not valid sequence-set syntax.
+  static bool parse(std::string_view s, SequenceSet& out) {
+    SequenceSet set;
+    while (!s.empty()) {
+      size_t comma = s.find(',');
+      std::string_view item = s.substr(0, comma);
+      size_t colon = item.find(':');
+      uint32_t a, b;
+      if (!number(item.substr(0, colon), a)) return false;
+      if (colon == std::string_view::npos) {
+        b = a;
+      } else if (!number(item.substr(colon + 1), b)) {
+        return false;
+      }
+      set.ranges.push_back({std::min(a, b), std::max(a, b)});
+      if (comma == std::string_view::npos) break;
+      s.remove_prefix(comma + 1);
+      if (s.empty()) return false;
+    }
+    if (set.ranges.empty()) return false;
+    set.normalize();
+    out = std::move(set);
+    return true;
+  }
+
+  // Adding in ascending order (the usual way results are built) is O(1)
+  void add(uint32_t first, uint32_t last) {
+    if (first > last) std::swap(first, last);
+    if (ranges.empty() ||
+        (ranges.back().last != kStar && first > ranges.back().last + 1)) {
+      ranges.push_back({first, last});
+    } else if (ranges.back().first <= first) {
+      ranges.back().last = std::max(ranges.back().last, last);
+    } else {
+      ranges.push_back({first, last});
+      normalize();
+    }
+  }
+  void add(uint32_t n) { add(n, n); }
+
+  // Replaces '*' with max (the highest message number or UID in use) and
+  // drops anything above it, as RFC 3501 requires for FETCH/STORE/COPY
+  SequenceSet resolve(uint32_t max) const {
+    SequenceSet out;
+    for (Range r : ranges) {
+      if (r.last == kStar) r.last = max;
+      if (r.first == kStar) r.first = max;
+      if (r.first > r.last) std::swap(r.first, r.last);
+      if (r.first == 0 || r.first > max) continue;
+      out.ranges.push_back({r.first, std::min(r.last, max)});
+    }
+    out.normalize();
+    return out;
+  }
+
+  bool empty() const { return ranges.empty(); }
+  // number of members; only meaningful once resolved
+  uint64_t count() const {
+    uint64_t n = 0;
+    for (const Range& r : ranges) n += uint64_t(r.last) - r.first + 1;
+    return n;
+  }
+  uint32_t min() const { return ranges.empty() ? 0 : ranges.front().first; }
+  uint32_t max() const { return ranges.empty() ? 0 : ranges.back().last; }
+  bool contains(uint32_t n) const {
+    auto it = std::upper_bound(
+        ranges.begin(), ranges.end(), n,
+        [](uint32_t v, const Range& r) { return v < r.first; });
+    return it != ranges.begin() && std::prev(it)->last >= n;
+  }
+  const std::vector<Range>& intervals() const { return ranges; }
+
+  iterator begin() const { return iterator(&ranges, 0); }
+  iterator end() const { return iterator(&ranges, ranges.size()); }
+
+  // Compact wire form, e.g. "1:4,7,9:*"
+  std::string str() const {
+    std::string out;
+    for (const Range& r : ranges) {
+      if (!out.empty()) out += ',';
+      out += r.first == kStar ? "*" : std::to_string(r.first);
+      if (r.last != r.first)
+        out += ":" + (r.last == kStar ? std::string("*") : std::to_string(r.last));
+    }
+    return out;
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <tls.h>
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <boost/log/trivial.hpp>
+
+#include "ConfigModel.hpp"
+#include "TicketKeys.hpp"
+
+#ifndef __IMAP_TLS_CONTEXT__
+#define __IMAP_TLS_CONTEXT__
+
+namespace IMAPProvider {
+// A libtls server context and the configuration it was made from.
+// Connections hold on to the context they were accepted with, so a
+// replaced context lives until the last of them closes.
+class TLSContext {
+ private:
+  struct tls* server = NULL;
+  struct tls_config* conf = NULL;
+  const TLSOptions options;
+  // revision of the newest shared ticket key handed to conf
+  uint32_t ticketRevision = 0;
+
+  explicit TLSContext(const TLSOptions& o) : options(o) {}
+
+  static std::atomic<unsigned>& requests() {
+    static std::atomic<unsigned> count{0};
+    return count;
+  }
+  static void requested(int) { requests().fetch_add(1, std::memory_order_relaxed); }
+
+ public:
+  ~TLSContext() {
+    if (conf != NULL) tls_config_free(conf);
+    if (server != NULL) {
+      tls_close(server);
+      tls_free(server);
+    }
+  }
+  TLSContext(const TLSContext&) = delete;
+  TLSContext& operator=(const TLSContext&) = delete;
+
+  // Builds a context from o, reading its key and certificate files. ok is
+  // false if any part of the configuration was rejected (each problem is
+  // logged); the context is returned either way.
+  static std::shared_ptr<TLSContext> create(const TLSOptions& o, bool& ok) {
+    std::shared_ptr<TLSContext> c(new TLSContext(o));
+    ok = true;
+    c->conf = tls_config_new();
+    if (c->conf == NULL) throw std::runtime_error("TLS Out of Memory Exception");
+    c->server = tls_server();
+    if (c->server == NULL) throw std::runtime_error("TLS Out of Memory Exception");
+    unsigned int protocols = 0;
+    if (tls_config_parse_protocols(&protocols, o.versions.c_str()) < 0) {
+      BOOST_LOG_TRIVIAL(fatal) << "tls_config_parse_protocols error";
+      ok = false;
+    }
+    tls_config_set_protocols(c->conf, protocols);
+    if (tls_config_set_ciphers(c->conf, o.ciphers.c_str()) < 0) {
+      BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_ciphers error";
+      ok = false;
+    }
+    if (tls_config_set_key_file(c->conf, o.keypath.c_str()) < 0) {
+      BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_key_file error";
+      ok = false;
+    }
+    if (tls_config_set_cert_file(c->conf, o.certpath.c_str()) < 0) {
+      BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_cert_file error";
+      ok = false;
+    }
+    if (o.sessionLifetime > 0) {
+      // the same ID everywhere in the process: each context keeps a cache
+      // of its own, but a session or ticket from one is accepted by another
+      const auto& id = TicketKeys::shared().sessionId();
+      if (tls_config_set_session_id(c->conf, id.data(), id.size()) < 0) {
+        BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_session_id error";
+        ok = false;
+      }
+      if (tls_config_set_session_lifetime(c->conf, o.sessionLifetime) < 0) {
+        BOOST_LOG_TRIVIAL(fatal) << "tls_config_set_session_lifetime error";
+        ok = false;
+      }
+      // a replacement (see TLSContextSlot) starts out with the keys the
+      // context before it had, so it opens the tickets that one sealed
+      for (TicketKeys::Key key : TicketKeys::shared().recent(c->ticketInterval())) {
+        if (tls_config_add_ticket_key(c->conf, key.revision, key.bytes.data(), key.bytes.size()) < 0) {
+          BOOST_LOG_TRIVIAL(fatal) << "tls_config_add_ticket_key error: " << tls_config_error(c->conf);
+          ok = false;
+        }
+        c->ticketRevision = key.revision;
+      }
+    }
+    if (tls_configure(c->server, c->conf) < 0) {
+      BOOST_LOG_TRIVIAL(fatal) << "tls_configure error: %" << tls_error(c->server);
+      ok = false;
+    }
+    return c;
+  }
+
+  const TLSOptions& settings() const { return options; }
+
+  // Seconds each shared ticket key is used for
+  int ticketInterval() const {
+    return options.ticketRotation > 0 ? options.ticketRotation : options.sessionLifetime;
+  }
+  // The shared ticket key new tickets should be sealed with; 0 without
+  // session resumption
+  uint32_t latestRevision() const {
+    if (options.sessionLifetime <= 0) return 0;
+    return TicketKeys::shared().current(ticketInterval()).revision;
+  }
+  // Whether the shared ticket key has moved on since this context was
+  // built. conf is never changed once configured, as handshakes on other
+  // threads read it; TLSContextSlot::poll() replaces the context instead.
+  bool stale() const {
+    uint32_t latest = latestRevision();
+    return latest != 0 && latest != ticketRevision;
+  }
+  // Starts a server-side connection on fd, as tls_accept_socket()
+  int accept(int fd, struct tls** conn) { return tls_accept_socket(server, conn, fd); }
+
+  // Makes signum (e.g. SIGHUP) ask every provider to reload its TLS
+  // configuration; each does so before its next accept
+  static void reloadOn(int signum) {
+    requests();  // not first constructed inside the handler
+    std::signal(signum, &TLSContext::requested);
+  }
+  // Times a reload has been asked for by signal
+  static unsigned reloadRequests() { return requests().load(std::memory_order_relaxed); }
+};
+
+// The context a provider accepts new connections with. reload() builds a
+// replacement on a background thread and swaps it in only if the whole
+// configuration was accepted, so a bad certificate leaves the old one in
+// use. poll() does so on a signal and whenever the shared ticket key has
+// been replaced.
+class TLSContextSlot : public std::enable_shared_from_this<TLSContextSlot> {
+ private:
+  std::shared_ptr<TLSContext> context;
+  std::atomic<bool> building{false};
+  std::atomic<unsigned> handled;
+  // ticket key revision last rebuilt for, so a failing rebuild is tried
+  // once per key rather than on every accept
+  std::atomic<uint32_t> attempted{0};
+
+ public:
+  explicit TLSContextSlot(const TLSOptions& o) : handled(TLSContext::reloadRequests()) {
+    bool ok;
+    context = TLSContext::create(o, ok);
+  }
+
+  std::shared_ptr<TLSContext> get() const { return std::atomic_load(&context); }
+
+  // Rebuilds from o in the background. Returns false if a rebuild is
+  // already under way.
+  bool reload(const TLSOptions& o) {
+    if (building.exchange(true)) return false;
+    std::shared_ptr<TLSContextSlot> self = shared_from_this();
+    std::thread([self, o] {
+      try {
+        bool ok;
+        std::shared_ptr<TLSContext> next = TLSContext::create(o, ok);
+        if (ok) {
+          std::atomic_store(&self->context, next);
+          BOOST_LOG_TRIVIAL(info) << "TLS configuration reloaded";
+        } else {
+          BOOST_LOG_TRIVIAL(error) << "TLS configuration reload failed; keeping the current one";
+        }
+      } catch (const std::exception& e) {
+        BOOST_LOG_TRIVIAL(error) << "TLS configuration reload failed: " << e.what();
+      }
+      self->building = false;
+    }).detach();
+    return true;
+  }
+  // Reloads if a signal asked for it since the last check, or if the
+  // current context is missing the latest ticket key
+  void poll() {
+    std::shared_ptr<TLSContext> c = get();
+    unsigned seen = handled.load(), now = TLSContext::reloadRequests();
+    if (seen != now) {
+      if (reload(c->settings())) handled.compare_exchange_strong(seen, now);
+      return;
+    }
+    if (!c->stale()) return;
+    uint32_t latest = c->latestRevision();
+    if (attempted.load() != latest && reload(c->settings())) attempted = latest;
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
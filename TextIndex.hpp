@@ -0,0 +1,288 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <boost/locale.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "SearchQuery.hpp"
+
+#ifndef __IMAP_TEXT_INDEX__
+#define __IMAP_TEXT_INDEX__
+
+namespace IMAPProvider {
+// Inverted index over the words of a mailbox's messages, used to narrow
+// BODY, TEXT and HEADER (FROM, TO, ...) keys to a few candidate UIDs before
+// the backend verifies them against the real content.
+//
+// Words come from Boost.Locale word boundary analysis, lower-cased. SEARCH
+// matches substrings, so a needle word selects every indexed word that
+// contains it, and a needle of several words the messages holding all of
+// them. The result is a superset of the matches, never a subset: content
+// the index skips (overlong words, oversized or undecodable fields) puts
+// the message on the field's always-candidate list instead. Scripts written
+// without spaces (CJK, Thai, ...) are split into words by dictionary, so a
+// needle in them can cross the words its text was split into; needle words
+// with such characters are not used to narrow.
+//
+// Posting lists are ascending UIDs stored as varint deltas; UIDs must be
+// added in ascending order, as APPEND assigns them. Removed UIDs are dropped
+// from the lists in batches.
+class TextIndex {
+ public:
+  // Field tags; every term is stored as tag + word
+  typedef enum : char {
+    FIELD_BODY = 'B',
+    FIELD_HEADER = 'H',  // the whole header block
+    FIELD_SUBJECT = 's',
+    FIELD_FROM = 'f',
+    FIELD_TO = 't',
+    FIELD_CC = 'c',
+    FIELD_BCC = 'b'
+  } Field_t;
+  static constexpr size_t kMaxWord = 64;
+  static constexpr size_t kMaxField = 1 << 20;
+
+ private:
+  struct Posting {
+    std::string deltas;
+    uint32_t last = 0;
+  };
+  std::map<std::string, Posting> terms;
+  std::map<char, std::vector<uint32_t> > unindexed;
+  std::vector<uint32_t> removed;  // sorted
+  size_t live = 0;
+  uint32_t lastUid = 0;
+  mutable std::shared_mutex lock;
+
+  static const std::locale& locale() {
+    static const std::locale loc = boost::locale::generator()("en_US.UTF-8");
+    return loc;
+  }
+  // Calls f with each lower-cased word of text; false if text could not be
+  // segmented (e.g. it is not UTF-8)
+  template <typename F>
+  static bool words(std::string_view text, F f) {
+    namespace lb = boost::locale::boundary;
+    try {
+      lb::csegment_index index(lb::word, text.data(), text.data() + text.size(),
+                               locale());
+      index.rule(lb::word_any);
+      for (const lb::csegment& w : index)
+        f(boost::locale::to_lower(w.begin(), w.end(), locale()));
+    } catch (const std::exception&) {
+      return false;
+    }
+    return true;
+  }
+  // Whether word has a character of a script Boost.Locale segments by
+  // dictionary rather than by spaces and punctuation
+  static bool dictionarySegmented(const std::string& word) {
+    for (size_t i = 0; i < word.size();) {
+      const unsigned char c = word[i];
+      const int extra = c < 0x80 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+      uint32_t cp = extra == 0 ? c : c & (0x3f >> extra);
+      for (int k = 1; k <= extra && i + k < word.size(); k++) cp = cp << 6 | (word[i + k] & 0x3f);
+      i += extra + 1;
+      if ((cp >= 0x0e00 && cp <= 0x0eff) ||    // Thai, Lao
+          (cp >= 0x1000 && cp <= 0x109f) ||    // Myanmar
+          (cp >= 0x1780 && cp <= 0x17ff) ||    // Khmer
+          (cp >= 0x19e0 && cp <= 0x19ff) ||    // Khmer symbols
+          (cp >= 0x2e80 && cp <= 0x9fff) ||    // CJK radicals, kana, ideographs
+          (cp >= 0xa9e0 && cp <= 0xa9ff) ||    // Myanmar extended-B
+          (cp >= 0xaa60 && cp <= 0xaa7f) ||    // Myanmar extended-A
+          (cp >= 0xf900 && cp <= 0xfaff) ||    // CJK compatibility ideographs
+          (cp >= 0xff66 && cp <= 0xff9f) ||    // halfwidth katakana
+          (cp >= 0x20000 && cp <= 0x3ffff))    // ideograph extensions
+        return true;
+    }
+    return false;
+  }
+  static void putVarint(std::string& out, uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+  }
+  static void decode(const Posting& p, std::vector<uint32_t>& out) {
+    uint32_t uid = 0;
+    for (size_t i = 0; i < p.deltas.size();) {
+      uint32_t d = 0;
+      for (int shift = 0; i < p.deltas.size(); shift += 7) {
+        uint8_t c = p.deltas[i++];
+        d |= uint32_t(c & 0x7f) << shift;
+        if (!(c & 0x80)) break;
+      }
+      out.push_back(uid += d);
+    }
+  }
+  static void append(Posting& p, uint32_t uid) {
+    if (p.last == uid) return;
+    putVarint(p.deltas, uid - p.last);
+    p.last = uid;
+  }
+
+  void addField(char field, uint32_t uid, std::string_view text) {
+    bool complete = text.size() <= kMaxField;
+    std::string term(1, field);
+    complete = words(text.substr(0, kMaxField), [&](const std::string& w) {
+                 if (w.size() > kMaxWord) {
+                   complete = false;
+                   return;
+                 }
+                 term.resize(1);
+                 append(terms[term += w], uid);
+               }) && complete;
+    if (!complete) {
+      std::vector<uint32_t>& u = unindexed[field];
+      if (u.empty() || u.back() != uid) u.push_back(uid);
+    }
+  }
+
+  // Rewrites every list without the removed UIDs
+  void compact() {
+    std::vector<uint32_t> uids;
+    for (auto it = terms.begin(); it != terms.end();) {
+      uids.clear();
+      decode(it->second, uids);
+      Posting p;
+      for (uint32_t u : uids)
+        if (!std::binary_search(removed.begin(), removed.end(), u)) append(p, u);
+      if (p.deltas.empty()) {
+        it = terms.erase(it);
+      } else {
+        (it++)->second = std::move(p);
+      }
+    }
+    for (auto& f : unindexed) {
+      std::vector<uint32_t>& u = f.second;
+      u.erase(std::remove_if(u.begin(), u.end(),
+                             [this](uint32_t x) {
+                               return std::binary_search(removed.begin(), removed.end(), x);
+                             }),
+              u.end());
+    }
+    removed.clear();
+  }
+
+  // UIDs whose field may contain needle; false if the index cannot narrow
+  // the search (the needle has no words it can look up)
+  bool lookup(char field, const std::string& needle, std::vector<uint32_t>& out) const {
+    std::vector<std::string> tokens;
+    if (!words(needle, [&](const std::string& w) {
+          if (!dictionarySegmented(w)) tokens.push_back(w);
+        }) ||
+        tokens.empty())
+      return false;
+    const std::string from(1, field), to(1, field + 1);
+    auto first = terms.lower_bound(from), last = terms.lower_bound(to);
+    auto always = unindexed.find(field);
+    bool started = false;
+    for (const std::string& t : tokens) {
+      std::vector<uint32_t> hits;
+      if (always != unindexed.end()) hits = always->second;
+      for (auto it = first; it != last; ++it)
+        if (it->first.find(t, 1) != std::string::npos) decode(it->second, hits);
+      std::sort(hits.begin(), hits.end());
+      hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+      if (!started) {
+        out.swap(hits);
+        started = true;
+      } else {
+        std::vector<uint32_t> both;
+        std::set_intersection(out.begin(), out.end(), hits.begin(), hits.end(),
+                              std::back_inserter(both));
+        out.swap(both);
+      }
+      if (out.empty()) break;
+    }
+    return true;
+  }
+
+ public:
+  static char field(const std::string& name) {
+    static const std::pair<const char*, Field_t> fields[] = {
+        {"SUBJECT", FIELD_SUBJECT}, {"FROM", FIELD_FROM}, {"TO", FIELD_TO},
+        {"CC", FIELD_CC},           {"BCC", FIELD_BCC}};
+    for (const auto& f : fields)
+      if (ciCompare(name, f.first) == 0) return f.second;
+    return FIELD_HEADER;
+  }
+
+  // Indexes a message; UIDs at or below the last one added are ignored
+  void add(uint32_t uid, std::string_view header, std::string_view body) {
+    std::unique_lock<std::shared_mutex> guard(lock);
+    if (uid <= lastUid) return;
+    lastUid = uid;
+    live++;
+    for (char f : {FIELD_SUBJECT, FIELD_FROM, FIELD_TO, FIELD_CC, FIELD_BCC}) {
+      static const char* names[] = {"Subject", "From", "To", "Cc", "Bcc"};
+      const char* name = names[std::string_view("sftcb").find(f)];
+      std::string value = headerField(header, name);
+      if (!value.empty()) addField(f, uid, value);
+    }
+    addField(FIELD_HEADER, uid, header);
+    addField(FIELD_BODY, uid, body);
+  }
+
+  void remove(uint32_t uid) {
+    std::unique_lock<std::shared_mutex> guard(lock);
+    auto at = std::lower_bound(removed.begin(), removed.end(), uid);
+    if (uid > lastUid || (at != removed.end() && *at == uid)) return;
+    removed.insert(at, uid);
+    live--;
+    if (removed.size() >= 1024 && removed.size() > live) compact();
+  }
+
+  uint32_t last() const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return lastUid;
+  }
+
+  // Sorted UIDs that may match a content key. false if the index cannot
+  // narrow the key (SENT* keys, HEADER field "", needles without words
+  // outside dictionary-segmented scripts), in which case every message is
+  // a candidate.
+  bool candidates(const SearchKey& key, std::vector<uint32_t>& out) const {
+    std::shared_lock<std::shared_mutex> guard(lock);
+    switch (key.kind) {
+      case SearchKey::BODY:
+        return lookup(FIELD_BODY, key.value, out);
+      case SearchKey::HEADER:
+        return !key.value.empty() && lookup(field(key.field), key.value, out);
+      case SearchKey::TEXT: {
+        std::vector<uint32_t> head, body;
+        if (!lookup(FIELD_HEADER, key.value, head) ||
+            !lookup(FIELD_BODY, key.value, body))
+          return false;
+        std::set_union(head.begin(), head.end(), body.begin(), body.end(),
+                       std::back_inserter(out));
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
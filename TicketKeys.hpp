@@ -0,0 +1,100 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <tls.h>
+#ifdef __linux__
+#include <sys/random.h>
+#else
+#include <cstdlib>
+#endif
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+
+#ifndef __IMAP_TICKET_KEYS__
+#define __IMAP_TICKET_KEYS__
+
+namespace IMAPProvider {
+// Session ticket keys shared by every IMAPProvider in the process, so a
+// client can resume its session on whichever one accepts its next
+// connection. The current key is replaced every interval seconds, and the
+// last kKept are handed to each new TLS context, so tickets sealed with a
+// retired key (or by a context that has since been replaced) still open
+// for a few intervals.
+class TicketKeys {
+ public:
+  static constexpr size_t kKeySize = TLS_TICKET_KEY_SIZE;
+  // as many as libtls keeps per configuration
+  static constexpr size_t kKept = 4;
+  struct Key {
+    uint32_t revision = 0;
+    std::array<unsigned char, kKeySize> bytes = {};
+  };
+
+ private:
+  std::mutex lock;
+  std::deque<Key> keys;  // oldest first
+  time_t issued = 0;
+  std::array<unsigned char, TLS_MAX_SESSION_ID_LENGTH> id = {};
+
+  static void random(unsigned char* out, size_t n) {
+#ifdef __linux__
+    while (n > 0) {
+      ssize_t got = getrandom(out, n, 0);
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) throw std::runtime_error("getrandom failed");
+      out += got;
+      n -= got;
+    }
+#else
+    arc4random_buf(out, n);
+#endif
+  }
+  TicketKeys() { random(id.data(), id.size()); }
+
+ public:
+  static TicketKeys& shared() {
+    static TicketKeys keys;
+    return keys;
+  }
+  TicketKeys(const TicketKeys&) = delete;
+  TicketKeys& operator=(const TicketKeys&) = delete;
+
+  // Identifies this process's session cache to libtls
+  const std::array<unsigned char, TLS_MAX_SESSION_ID_LENGTH>& sessionId() const { return id; }
+  // The key new tickets should be sealed with, replacing it first if it is
+  // more than interval seconds old
+  Key current(int interval) { return recent(interval).back(); }
+  // current() and the keys it replaced, oldest first
+  std::deque<Key> recent(int interval) {
+    std::lock_guard<std::mutex> guard(lock);
+    time_t now = std::time(nullptr);
+    if (keys.empty() || now - issued >= interval) {
+      Key next;
+      random(next.bytes.data(), next.bytes.size());
+      next.revision = keys.empty() ? 1 : keys.back().revision + 1;
+      keys.push_back(next);
+      if (keys.size() > kKept) keys.pop_front();
+      issued = now;
+    }
+    return keys;
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <boost/log/trivial.hpp>
+
+#ifndef __IMAP_WAKER__
+#define __IMAP_WAKER__
+
+namespace IMAPProvider {
+// Waits, on a thread of its own, for what SocketPool only ever reports as
+// readability on the connection itself: a socket with parked output (or a
+// TLS handshake wanting to write) becoming writable, and a session's
+// NotificationQueue getting changes. Each fd is armed with what it is
+// waiting for; when any of it fires, the fd is disarmed and ready(fd) is
+// called, which is expected to arm it again if it still has to wait.
+//
+// The thread keeps its pollfd array from one poll() to the next and only
+// applies the fds armed or disarmed since, so a wake costs the number of
+// changes rather than the number of idling sessions.
+class Waker {
+ private:
+  struct Wait {
+    bool writable;
+    int notifier;
+    bool operator==(const Wait& o) const { return writable == o.writable && notifier == o.notifier; }
+  };
+  // The thread's poll set. Entry 0 is the wakeup fd; every other entry is
+  // a connection's socket (slot 0, POLLOUT) or its notifier (slot 1,
+  // POLLIN), and at[fd] holds the indices of its entries (-1 for none).
+  // Entries are removed by moving the last one into their place.
+  class PollSet {
+   private:
+    struct Owner {
+      int fd;
+      int slot;
+    };
+    std::vector<Owner> owners;
+    std::unordered_map<int, std::array<int, 2>> at;
+
+    void erase(size_t i) {
+      const size_t last = fds.size() - 1;
+      if (i != last) {
+        fds[i] = fds[last];
+        owners[i] = owners[last];
+        at[owners[i].fd][owners[i].slot] = static_cast<int>(i);
+      }
+      fds.pop_back();
+      owners.pop_back();
+    }
+
+   public:
+    std::vector<pollfd> fds;
+
+    explicit PollSet(int wake) : owners(1, Owner{-1, 0}), fds(1, pollfd{wake, POLLIN, 0}) {}
+    int owner(size_t i) const { return owners[i].fd; }
+    void remove(int fd) {
+      auto it = at.find(fd);
+      if (it == at.end()) return;
+      const std::array<int, 2> slots = it->second;
+      at.erase(it);
+      // the higher index first, so the move cannot pick up the other one
+      const int high = std::max(slots[0], slots[1]), low = std::min(slots[0], slots[1]);
+      if (high >= 0) erase(static_cast<size_t>(high));
+      if (low >= 0) erase(static_cast<size_t>(low));
+    }
+    void set(int fd, const Wait& w) {
+      remove(fd);
+      std::array<int, 2> slots = {-1, -1};
+      if (w.writable) {
+        slots[0] = static_cast<int>(fds.size());
+        fds.push_back(pollfd{fd, POLLOUT, 0});
+        owners.push_back(Owner{fd, 0});
+      }
+      if (w.notifier >= 0) {
+        slots[1] = static_cast<int>(fds.size());
+        fds.push_back(pollfd{w.notifier, POLLIN, 0});
+        owners.push_back(Owner{fd, 1});
+      }
+      at[fd] = slots;
+    }
+  };
+
+  const std::function<void(int)> ready;
+  std::mutex lock;
+  std::map<int, Wait> waits;
+  std::vector<int> changed;  // fds armed or disarmed since run() last looked
+  std::atomic<bool> stopping{false};
+  int wakeRead = -1;
+  int wakeWrite = -1;
+  std::thread thread;
+
+  // Makes the thread pick up a changed set of waits
+  void signal() {
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = ::write(wakeWrite, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t n = ::write(wakeWrite, &one, sizeof(one));
+#endif
+    (void)n;  // a full pipe is already readable
+  }
+  void run() {
+    PollSet set(wakeRead);
+    std::vector<pollfd>& fds = set.fds;
+    std::vector<int> fired;
+    while (!stopping.load()) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int fd : changed) {
+          auto it = waits.find(fd);
+          if (it == waits.end())
+            set.remove(fd);
+          else
+            set.set(fd, it->second);
+        }
+        changed.clear();
+      }
+      if (::poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) continue;
+        BOOST_LOG_TRIVIAL(error) << "Waker poll failed: " << strerror(errno);
+        return;
+      }
+      if (fds[0].revents != 0) {
+        char buf[64];
+        while (::read(wakeRead, buf, sizeof(buf)) > 0) {
+        }
+      }
+      fired.clear();
+      for (size_t i = 1; i < fds.size(); i++)
+        if (fds[i].revents != 0 && std::find(fired.begin(), fired.end(), set.owner(i)) == fired.end())
+          fired.push_back(set.owner(i));
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int fd : fired) {
+          waits.erase(fd);
+          set.remove(fd);
+        }
+      }
+      // a stale wake (an fd closed and reused since) is harmless: ready()
+      // only acts on what the connection is actually waiting for
+      for (int fd : fired) ready(fd);
+    }
+  }
+
+ public:
+  explicit Waker(std::function<void(int)> onReady) : ready(std::move(onReady)) {
+#ifdef __linux__
+    wakeRead = wakeWrite = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+    int p[2];
+    if (::pipe(p) == 0) {
+      for (int fd : p) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      wakeRead = p[0];
+      wakeWrite = p[1];
+    }
+#endif
+    if (wakeRead < 0) throw std::runtime_error("Waker could not create its wakeup fd");
+    thread = std::thread(&Waker::run, this);
+  }
+  ~Waker() {
+    stopping = true;
+    signal();
+    thread.join();
+    ::close(wakeRead);
+    if (wakeWrite != wakeRead) ::close(wakeWrite);
+  }
+  Waker(const Waker&) = delete;
+  Waker& operator=(const Waker&) = delete;
+
+  // Calls ready(fd) once fd is writable (if writable) or notifier (if not
+  // -1) is readable; with neither, fd is disarmed
+  void arm(int fd, bool writable, int notifier) {
+    if (!writable && notifier < 0) {
+      disarm(fd);
+      return;
+    }
+    const Wait w = {writable, notifier};
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      auto it = waits.find(fd);
+      if (it != waits.end() && it->second == w) return;
+      waits[fd] = w;
+      changed.push_back(fd);
+    }
+    signal();
+  }
+  void disarm(int fd) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (waits.erase(fd) == 0) return;
+      changed.push_back(fd);
+    }
+    signal();
+  }
+};
+}  // namespace IMAPProvider
+
+#endif
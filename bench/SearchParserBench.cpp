@@ -0,0 +1,145 @@
+/*
+ * Copyright [2020] <Zachary Tipnis> – All Rights Reserved
+ *
+ * The use (including but not limited to modification and
+ * distribution) of this source file and its contents shall
+ * be governed by the terms of the MIT License.
+ *
+ * You should have received a copy of the MIT License with
+ * this file. If not, please write to "zatipnis@icloud.com"
+ * or visit: https://zacharytipnis.com
+ *
+ */
+
+// Times SearchParser against the regex tokenizer it replaced on generated
+// chains of "OR SUBJECT wN ...", the shape filter rules produce. Built with
+// -DIMAPLW_BENCHMARKS=ON; run as search_parser_bench [iterations].
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "../SearchQuery.hpp"
+
+namespace {
+// search_query_r() as it was before SearchParser, kept here only to be
+// compared against. Returns each top-level token of query in turn, one
+// regex match (and one copy of the rest of the query) per token.
+std::string* search_query_r(std::string* query) {
+  static const std::array<std::string, 34> regex_query_items = {{
+    "ALL",
+    "ANSWERED",
+    "DELETED",
+    "FLAGGED",
+    "NEW",
+    "NOT",
+    "OR",
+    "OLD",
+    "RECENT",
+    "SEEN",
+    "UNANSWERED",
+    "UNDELETED",
+    "UNDRAFT",
+    "UNFLAGGED",
+    "UNSEEN",
+    "BCC .+?",
+    "CC .+?",
+    "FROM .+?",
+    "HEADER .+?",
+    "KEYWORD .+?",
+    "LARGER \\d+",
+    "ON .+?",
+    "SENTBEFORE .+?",
+    "SENTON .+?",
+    "SENTSINCE .+?",
+    "SINCE .+?",
+    "SMALLER \\d+",
+    "SUBJECT .+?",
+    "TEXT .+?",
+    "TO .+?",
+    "UID (?:\\d+-\\d+|(?:[\\d\\s]+)+)",
+    "UNKEYWORD .+?",
+    "\\d+[-:]\\d+",
+    "[\\d\\s]+"
+  }};
+  static const std::regex searchParse(
+      "^(" + join(regex_query_items, "|") + ")(?:\\s|^|$|\\r\\n|\\n)",
+      std::regex::icase | std::regex::optimize);
+  thread_local std::string* cPtr;
+  if (query != NULL) {
+    cPtr = query;
+  } else if (cPtr == NULL) {
+    return NULL;
+  } else if (cPtr->length() == 0) {
+    cPtr = NULL;
+    return NULL;
+  }
+  std::smatch m;
+  std::regex_search(*cPtr, m, searchParse);
+  if (m.size() == 2) {
+    std::string* match = new std::string(m.str(1));
+    *cPtr = cPtr->substr(m.position() + m.length());
+    if (match->length() > 0 && *match != "\0") return match;
+    delete match;
+    return search_query_r(NULL);
+  }
+  return NULL;
+}
+
+// The term list the old SEARCH built from search_query_r(), each OR
+// folded together with the two tokens after it
+size_t oldParse(const std::string& query) {
+  std::string rest(query);
+  std::vector<std::string> terms;
+  for (std::string* t = search_query_r(&rest); t != NULL; t = search_query_r(NULL)) {
+    if (*t == "OR") {
+      std::string *a = search_query_r(NULL), *b = search_query_r(NULL);
+      if (a != NULL && b != NULL) *t += " " + *a + " " + *b;
+      delete a;
+      delete b;
+    }
+    terms.push_back(std::move(*t));
+    delete t;
+  }
+  return terms.size();
+}
+
+size_t newParse(const std::string& query) {
+  IMAPProvider::SearchParser parser;
+  IMAPProvider::SearchKey key;
+  if (!parser.parse(query, key)) std::abort();
+  return key.children.size() + 1;
+}
+
+// "OR SUBJECT w0 OR SUBJECT w1 ... SUBJECT wN", n keys in all
+std::string chain(size_t n) {
+  std::string q;
+  for (size_t i = 0; i + 1 < n; i++) q += "OR SUBJECT w" + std::to_string(i) + " ";
+  return q + "SUBJECT w" + std::to_string(n - 1);
+}
+
+template <class F>
+double microseconds(F parse, const std::string& query, int iterations) {
+  size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) sink += parse(query);
+  std::chrono::duration<double, std::micro> took = std::chrono::steady_clock::now() - start;
+  if (sink == 0) std::abort();
+  return took.count() / iterations;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 200;
+  oldParse(chain(1));  // builds the regex
+  std::printf("%8s %14s %14s\n", "keys", "old us/parse", "new us/parse");
+  for (size_t n : {10, 100, 1000, 5000}) {
+    const std::string query = chain(n);
+    std::printf("%8zu %14.1f %14.1f\n", n, microseconds(oldParse, query, iterations),
+                microseconds(newParse, query, iterations));
+  }
+}